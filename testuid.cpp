@@ -1,5 +1,8 @@
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <deque>
 #include <string>
 #include <vector>
 #include <random>
@@ -7,222 +10,9736 @@
 #include <iomanip>
 #include <algorithm>
 #include <locale>  
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <functional>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <variant>
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <climits>
+#include <ctime>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-// Класс для представления записи с UID (7 байт)
+// Допустимые длины UID: основной формат - 7 байт, системы партнёров
+// присылают также 6-, 8- и 16-байтовые UID
+inline bool isSupportedUidWidth(size_t length) {
+    return length == 6 || length == 7 || length == 8 || length == 16;
+}
+
+// Класс для представления записи с UID (7 байт; UID партнёров - 6, 8 или 16)
 class Record {
 private:
-    string uid;  // 7 байт
+    string uid;  // 7 байт (6, 8 или 16 для UID партнёров)
     string data; // произвольные данные
     
-public:
-    Record(const string& uid, const string& data) 
-        : uid(uid), data(data) {
-        if (uid.length() != 7) {
-            throw invalid_argument("UID должен быть длиной ровно 7 байт");
+public:
+    Record(const string& uid, const string& data) 
+        : uid(uid), data(data) {
+        if (!isSupportedUidWidth(uid.length())) {
+            throw invalid_argument("UID должен быть длиной 6, 7, 8 или 16 байт");
+        }
+    }
+    
+    const string& getUid() const { return uid; }
+    const string& getData() const { return data; }
+    
+    void setData(string newData) { data = move(newData); }
+    
+    // Извлечение данных без копирования; запись остаётся с пустыми данными
+    string releaseData() {
+        string old = move(data);
+        data.clear();
+        return old;
+    }
+};
+
+// Хранилища с 56-битными ключами принимают только 7-байтовые UID;
+// записи других длин хранит MixedWidthDatabase
+inline void requireNarrowUid(const string& uid) {
+    if (uid.length() != 7) {
+        throw invalid_argument("UID длиной " + to_string(uid.length()) + " байт требует MixedWidthDatabase");
+    }
+}
+
+// Упаковка 7-байтового UID в 56-битный ключ (big-endian, порядок ключей
+// совпадает с лексикографическим порядком UID)
+inline uint64_t packUid(const string& uid) {
+    uint64_t key = 0;
+    for (int i = 0; i < 7; ++i) {
+        key = (key << 8) | static_cast<unsigned char>(uid[i]);
+    }
+    return key;
+}
+
+inline string unpackUid(uint64_t key) {
+    string uid(7, '\0');
+    for (int i = 6; i >= 0; --i) {
+        uid[i] = static_cast<char>(key & 0xFF);
+        key >>= 8;
+    }
+    return uid;
+}
+
+// Перемешивание битов ключа (финализатор splitmix64)
+inline uint64_t mixHash(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Отображение 32-битного хэша на диапазон [0, n) без деления
+inline size_t fastRange(uint32_t hash, size_t n) {
+    return static_cast<size_t>((static_cast<uint64_t>(hash) * n) >> 32);
+}
+
+// Трассировка фаз в формате Chrome trace events (файл открывается
+// в Perfetto и chrome://tracing). TRACE_SPAN("имя") отмечает интервал
+// до конца области видимости. Интервалы пишутся в буфер своего потока
+// без блокировок, время - счётчик тактов rdtsc, переводимый в
+// микросекунды при выгрузке. При сборке с -DUID_TRACING=0 макрос
+// исчезает полностью; в обычной сборке выключенная трассировка стоит
+// одну проверку флага на интервал.
+#ifndef UID_TRACING
+#define UID_TRACING 1
+#endif
+
+class Tracer {
+private:
+    struct Span {
+        const char* name;
+        uint64_t start;
+        uint64_t end;
+    };
+    
+    struct ThreadBuffer {
+        uint32_t tid;
+        vector<Span> spans;
+    };
+    
+    static inline atomic<bool> active{false};
+    static inline mutex buffersLock;
+    static inline vector<unique_ptr<ThreadBuffer>> buffers;
+    static inline uint64_t startTicks = 0;
+    static inline chrono::steady_clock::time_point startTime;
+    
+    // Буфер потока создаётся при первом интервале и переживает поток
+    static ThreadBuffer& localBuffer() {
+        thread_local ThreadBuffer* buffer = nullptr;
+        if (!buffer) {
+            lock_guard<mutex> guard(buffersLock);
+            buffers.emplace_back(new ThreadBuffer{static_cast<uint32_t>(buffers.size() + 1), {}});
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+    
+public:
+    static uint64_t ticks() {
+#if defined(__x86_64__)
+        return __rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+    
+    static bool enabled() {
+        return active.load(memory_order_relaxed);
+    }
+    
+    static void enable() {
+        startTime = chrono::steady_clock::now();
+        startTicks = ticks();
+        active.store(true, memory_order_release);
+    }
+    
+    static void record(const char* name, uint64_t start, uint64_t end) {
+        localBuffer().spans.push_back({name, start, end});
+    }
+    
+    // Выгрузка трассы; вызывается, когда рабочие потоки завершены.
+    // Частота счётчика определяется по интервалу с момента enable()
+    static size_t writeJson(const string& path) {
+        active.store(false, memory_order_release);
+        double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - startTime).count();
+        double ticksPerMicro = max(1e-9, (ticks() - startTicks) / max(micros, 1.0));
+        
+        ofstream out(path);
+        if (!out) {
+            throw runtime_error("Не удалось открыть файл трассы " + path);
+        }
+        lock_guard<mutex> guard(buffersLock);
+        int pid = getpid();
+        size_t count = 0;
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        out << fixed << setprecision(3);
+        for (const auto& buffer : buffers) {
+            out << (count++ ? ",\n" : "\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+                << ",\"tid\":" << buffer->tid << ",\"args\":{\"name\":\"поток " << buffer->tid << "\"}}";
+            for (const Span& span : buffer->spans) {
+                out << ",\n{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":" << pid
+                    << ",\"tid\":" << buffer->tid
+                    << ",\"ts\":" << (span.start - startTicks) / ticksPerMicro
+                    << ",\"dur\":" << (span.end - span.start) / ticksPerMicro << "}";
+                ++count;
+            }
+        }
+        out << "\n]}\n";
+        return count - buffers.size();
+    }
+};
+
+class TraceSpan {
+private:
+    const char* name;
+    uint64_t start = 0;
+    
+public:
+    explicit TraceSpan(const char* name) : name(name) {
+        if (Tracer::enabled()) {
+            start = Tracer::ticks();
+        }
+    }
+    
+    ~TraceSpan() {
+        if (start) {
+            Tracer::record(name, start, Tracer::ticks());
+        }
+    }
+    
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+#if UID_TRACING
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) do {} while (false)
+#endif
+
+// Политики индекса для Database. Каждая политика отображает упакованный
+// ключ на номер записи (слот) в векторе records и реализует:
+//   insert(key, slot), find(key, slot), erase(key), reserve(n), clear(),
+//   size(), memoryUsage(), build() и статический name().
+// build() вызывается из Database::freeze() после массовой загрузки;
+// изменяемым индексам он не нужен.
+
+// Индекс на основе стандартной хэш-таблицы
+class HashMapIndex {
+private:
+    unordered_map<uint64_t, uint32_t> map;
+    
+public:
+    static const char* name() { return "unordered_map"; }
+    
+    void insert(uint64_t key, uint32_t slot) {
+        map[key] = slot;
+    }
+    
+    bool find(uint64_t key, uint32_t& slot) const {
+        auto it = map.find(key);
+        if (it != map.end()) {
+            slot = it->second;
+            return true;
+        }
+        return false;
+    }
+    
+    bool erase(uint64_t key) {
+        return map.erase(key) > 0;
+    }
+    
+    void reserve(size_t n) { map.reserve(n); }
+    void build() {}
+    void clear() { map.clear(); }
+    size_t size() const { return map.size(); }
+    
+    // Оценка: массив корзин + узел списка (ключ, значение, указатель,
+    // служебные данные аллокатора) на каждый элемент
+    size_t memoryUsage() const {
+        return map.bucket_count() * sizeof(void*)
+             + map.size() * (sizeof(pair<const uint64_t, uint32_t>) + 2 * sizeof(void*));
+    }
+};
+
+// Кукушечный хэш-индекс: 4-канальные корзины по 64 байта (одна кэш-линия),
+// у каждого ключа ровно две корзины-кандидата. Поиск читает не более двух
+// кэш-линий, вставка при заполненных корзинах ищет кратчайший путь
+// вытеснения поиском в ширину, что позволяет держать загрузку до 95%.
+class CuckooIndex {
+private:
+    static constexpr int WAYS = 4;
+    static constexpr uint64_t OCCUPIED = 1ULL << 63;
+    static constexpr uint64_t KEY_MASK = (1ULL << 56) - 1;
+    static constexpr size_t MAX_BFS_NODES = 512;
+    
+    struct alignas(64) Bucket {
+        uint64_t keys[WAYS];   // 56 бит ключа + флаг занятости в старшем бите
+        uint32_t slots[WAYS];  // номер записи в Database::records
+    };
+    
+    // Узел пути вытеснения: элемент parent-корзины в позиции way
+    // переезжает в корзину bucket
+    struct PathNode {
+        size_t bucket;
+        int parent;
+        int way;
+    };
+    
+    vector<Bucket> buckets;
+    vector<PathNode> bfsQueue;
+    size_t count = 0;
+    double maxLoadFactor;
+    
+    void candidateBuckets(uint64_t key, size_t& b1, size_t& b2) const {
+        uint64_t h = mixHash(key);
+        b1 = fastRange(static_cast<uint32_t>(h), buckets.size());
+        b2 = fastRange(static_cast<uint32_t>(h >> 32), buckets.size());
+        if (b2 == b1) {
+            b2 = (b1 + 1) % buckets.size();
+        }
+    }
+    
+    size_t alternateBucket(uint64_t key, size_t current) const {
+        size_t b1, b2;
+        candidateBuckets(key, b1, b2);
+        return current == b1 ? b2 : b1;
+    }
+    
+    static int freeWay(const Bucket& bucket) {
+        for (int i = 0; i < WAYS; ++i) {
+            if (bucket.keys[i] == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    
+    // Корзина уже встречается на пути от корня до узла: повторный заход
+    // испортил бы цепочку перемещений
+    bool onPath(int node, size_t bucket) const {
+        for (; node >= 0; node = bfsQueue[node].parent) {
+            if (bfsQueue[node].bucket == bucket) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Сдвигает элементы вдоль найденного пути, начиная с конца,
+    // и записывает новый ключ в освободившуюся позицию корневой корзины
+    void applyPath(int node, int way, uint64_t tagged, uint32_t slot) {
+        while (bfsQueue[node].parent >= 0) {
+            const PathNode& step = bfsQueue[node];
+            Bucket& from = buckets[bfsQueue[step.parent].bucket];
+            Bucket& to = buckets[step.bucket];
+            to.keys[way] = from.keys[step.way];
+            to.slots[way] = from.slots[step.way];
+            way = step.way;
+            node = step.parent;
+        }
+        Bucket& root = buckets[bfsQueue[node].bucket];
+        root.keys[way] = tagged;
+        root.slots[way] = slot;
+    }
+    
+    bool place(uint64_t key, uint32_t slot) {
+        uint64_t tagged = key | OCCUPIED;
+        size_t b1, b2;
+        candidateBuckets(key, b1, b2);
+        
+        int way = freeWay(buckets[b1]);
+        if (way >= 0) {
+            buckets[b1].keys[way] = tagged;
+            buckets[b1].slots[way] = slot;
+            return true;
+        }
+        way = freeWay(buckets[b2]);
+        if (way >= 0) {
+            buckets[b2].keys[way] = tagged;
+            buckets[b2].slots[way] = slot;
+            return true;
+        }
+        
+        // Поиск в ширину кратчайшей цепочки вытеснений до свободной позиции
+        bfsQueue.clear();
+        bfsQueue.push_back({b1, -1, -1});
+        bfsQueue.push_back({b2, -1, -1});
+        for (size_t head = 0; head < bfsQueue.size() && bfsQueue.size() < MAX_BFS_NODES; ++head) {
+            size_t current = bfsQueue[head].bucket;
+            for (int i = 0; i < WAYS; ++i) {
+                size_t alt = alternateBucket(buckets[current].keys[i] & KEY_MASK, current);
+                if (onPath(static_cast<int>(head), alt)) {
+                    continue;
+                }
+                bfsQueue.push_back({alt, static_cast<int>(head), i});
+                way = freeWay(buckets[alt]);
+                if (way >= 0) {
+                    applyPath(static_cast<int>(bfsQueue.size() - 1), way, tagged, slot);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    void rehash(size_t bucketCount) {
+        TRACE_SPAN("перехэширование cuckoo");
+        vector<Bucket> old;
+        old.swap(buckets);
+        for (;;) {
+            buckets.assign(max<size_t>(bucketCount, 2), Bucket());
+            bool ok = true;
+            for (const Bucket& bucket : old) {
+                for (int i = 0; i < WAYS && ok; ++i) {
+                    if (bucket.keys[i] != 0) {
+                        ok = place(bucket.keys[i] & KEY_MASK, bucket.slots[i]);
+                    }
+                }
+                if (!ok) {
+                    break;
+                }
+            }
+            if (ok) {
+                return;
+            }
+            bucketCount = bucketCount * 2;
+        }
+    }
+    
+    bool locate(uint64_t key, size_t& bucket, int& way) const {
+        if (buckets.empty()) {
+            return false;
+        }
+        size_t b1, b2;
+        candidateBuckets(key, b1, b2);
+        uint64_t tagged = key | OCCUPIED;
+        for (size_t b : {b1, b2}) {
+            for (int i = 0; i < WAYS; ++i) {
+                if (buckets[b].keys[i] == tagged) {
+                    bucket = b;
+                    way = i;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    size_t bucketsFor(size_t n) const {
+        return static_cast<size_t>(n / (WAYS * maxLoadFactor)) + 1;
+    }
+    
+public:
+    explicit CuckooIndex(double maxLoadFactor = 0.95)
+        : maxLoadFactor(maxLoadFactor) {
+        if (maxLoadFactor <= 0.0 || maxLoadFactor > 0.95) {
+            throw invalid_argument("Коэффициент загрузки должен быть в диапазоне (0; 0.95]");
+        }
+    }
+    
+    static const char* name() { return "cuckoo"; }
+    
+    void insert(uint64_t key, uint32_t slot) {
+        size_t bucket;
+        int way;
+        if (locate(key, bucket, way)) {
+            buckets[bucket].slots[way] = slot;
+            return;
+        }
+        if (count + 1 > maxLoadFactor * capacity()) {
+            rehash(max(bucketsFor(count + 1), buckets.size() * 2));
+        }
+        while (!place(key, slot)) {
+            // Путь вытеснения не найден: таблица фактически заполнена
+            rehash(buckets.size() * 2);
+        }
+        ++count;
+    }
+    
+    bool find(uint64_t key, uint32_t& slot) const {
+        if (buckets.empty()) {
+            return false;
+        }
+        size_t b1, b2;
+        candidateBuckets(key, b1, b2);
+        const Bucket& first = buckets[b1];
+        const Bucket& second = buckets[b2];
+        // Обе кэш-линии запрашиваются одновременно
+        __builtin_prefetch(&first);
+        __builtin_prefetch(&second);
+        
+        uint64_t tagged = key | OCCUPIED;
+        for (int i = 0; i < WAYS; ++i) {
+            if (first.keys[i] == tagged) {
+                slot = first.slots[i];
+                return true;
+            }
+        }
+        for (int i = 0; i < WAYS; ++i) {
+            if (second.keys[i] == tagged) {
+                slot = second.slots[i];
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool erase(uint64_t key) {
+        size_t bucket;
+        int way;
+        if (!locate(key, bucket, way)) {
+            return false;
+        }
+        buckets[bucket].keys[way] = 0;
+        --count;
+        return true;
+    }
+    
+    void reserve(size_t n) {
+        size_t needed = bucketsFor(n);
+        if (needed > buckets.size()) {
+            rehash(needed);
+        }
+    }
+    
+    void build() {}
+    
+    void clear() {
+        buckets.clear();
+        count = 0;
+    }
+    
+    size_t size() const { return count; }
+    size_t capacity() const { return buckets.size() * WAYS; }
+    double loadFactor() const { return capacity() ? static_cast<double>(count) / capacity() : 0.0; }
+    size_t memoryUsage() const { return buckets.size() * sizeof(Bucket); }
+};
+
+// Замороженный индекс на основе обученной модели (RMI): упакованные ключи
+// хранятся отсортированным массивом, двухуровневая кусочно-линейная модель
+// предсказывает позицию ключа, а поиск завершается двоичным поиском в окне
+// гарантированной ошибки листовой модели. Памяти сверх массива ключей
+// требуется около 24 байт на листовую модель.
+// Вставки до вызова build() копятся в буфере (хэш-таблице).
+class RmiIndex {
+private:
+    static constexpr uint32_t ERASED = UINT32_MAX;
+    
+    struct LeafModel {
+        double slope;
+        double intercept;
+        int32_t errLo;  // минимальное (позиция - предсказание)
+        int32_t errHi;  // максимальное (позиция - предсказание)
+    };
+    
+    size_t keysPerLeaf;
+    double rootSlope = 0.0;
+    double rootIntercept = 0.0;
+    vector<LeafModel> leaves;
+    vector<uint64_t> keys;
+    vector<uint32_t> slots;
+    unordered_map<uint64_t, uint32_t> pending;  // вставки и удаления после build()
+    size_t liveCount = 0;  // актуальных ключей с учётом pending
+    
+    double buildMillis = 0.0;
+    int32_t maxError = 0;
+    double meanWindow = 0.0;
+    
+    size_t leafFor(uint64_t key) const {
+        double p = rootSlope * static_cast<double>(key) + rootIntercept;
+        if (p <= 0.0) {
+            return 0;
+        }
+        size_t leaf = static_cast<size_t>(p);
+        return leaf < leaves.size() ? leaf : leaves.size() - 1;
+    }
+    
+    static int64_t predict(const LeafModel& model, uint64_t key) {
+        return static_cast<int64_t>(model.slope * static_cast<double>(key) + model.intercept);
+    }
+    
+    // Линейная регрессия позиции по ключу на отрезке [from, to)
+    void fitLinear(size_t from, size_t to, double& slope, double& intercept) const {
+        size_t n = to - from;
+        if (n == 0) {
+            slope = 0.0;
+            intercept = static_cast<double>(from);
+            return;
+        }
+        // Ключи берутся относительно первого, чтобы не терять точность
+        double base = static_cast<double>(keys[from]);
+        double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+        for (size_t i = from; i < to; ++i) {
+            double x = static_cast<double>(keys[i]) - base;
+            double y = static_cast<double>(i);
+            sumX += x;
+            sumY += y;
+            sumXX += x * x;
+            sumXY += x * y;
+        }
+        double denom = n * sumXX - sumX * sumX;
+        slope = denom > 0 ? (n * sumXY - sumX * sumY) / denom : 0.0;
+        intercept = (sumY - slope * sumX) / n - slope * base;
+    }
+    
+    void mergePending() {
+        TRACE_SPAN("слияние буфера RMI");
+        if (pending.empty()) {
+            return;
+        }
+        vector<pair<uint64_t, uint32_t>> sorted(pending.begin(), pending.end());
+        sort(sorted.begin(), sorted.end());
+        vector<uint64_t> mergedKeys;
+        vector<uint32_t> mergedSlots;
+        mergedKeys.reserve(keys.size() + sorted.size());
+        mergedSlots.reserve(keys.size() + sorted.size());
+        
+        // Значение из буфера заменяет значение из массива с тем же ключом
+        size_t i = 0, j = 0;
+        while (i < keys.size() || j < sorted.size()) {
+            if (j < sorted.size() && (i == keys.size() || sorted[j].first <= keys[i])) {
+                if (i < keys.size() && keys[i] == sorted[j].first) {
+                    ++i;
+                }
+                if (sorted[j].second != ERASED) {
+                    mergedKeys.push_back(sorted[j].first);
+                    mergedSlots.push_back(sorted[j].second);
+                }
+                ++j;
+            } else {
+                if (slots[i] != ERASED) {
+                    mergedKeys.push_back(keys[i]);
+                    mergedSlots.push_back(slots[i]);
+                }
+                ++i;
+            }
+        }
+        keys.swap(mergedKeys);
+        slots.swap(mergedSlots);
+        unordered_map<uint64_t, uint32_t>().swap(pending);
+    }
+    
+    bool findSorted(uint64_t key, size_t& pos) const {
+        if (keys.empty()) {
+            return false;
+        }
+        const LeafModel& model = leaves[leafFor(key)];
+        int64_t predicted = predict(model, key);
+        int64_t n = static_cast<int64_t>(keys.size());
+        int64_t lo = max<int64_t>(predicted + model.errLo, 0);
+        int64_t hi = min<int64_t>(predicted + model.errHi + 1, n);
+        if (lo >= hi) {
+            return false;
+        }
+        auto it = lower_bound(keys.begin() + lo, keys.begin() + hi, key);
+        if (it != keys.begin() + hi && *it == key) {
+            pos = it - keys.begin();
+            return true;
+        }
+        return false;
+    }
+    
+public:
+    explicit RmiIndex(size_t keysPerLeaf = 256)
+        : keysPerLeaf(max<size_t>(keysPerLeaf, 1)) {}
+    
+    static const char* name() { return "rmi"; }
+    
+    void insert(uint64_t key, uint32_t slot) {
+        uint32_t previous;
+        if (!find(key, previous)) {
+            ++liveCount;
+        }
+        pending[key] = slot;
+    }
+    
+    bool find(uint64_t key, uint32_t& slot) const {
+        auto it = pending.find(key);
+        if (it != pending.end()) {
+            if (it->second == ERASED) {
+                return false;
+            }
+            slot = it->second;
+            return true;
+        }
+        size_t pos;
+        if (findSorted(key, pos) && slots[pos] != ERASED) {
+            slot = slots[pos];
+            return true;
+        }
+        return false;
+    }
+    
+    bool erase(uint64_t key) {
+        uint32_t slot;
+        if (!find(key, slot)) {
+            return false;
+        }
+        --liveCount;
+        if (!pending.empty()) {
+            pending[key] = ERASED;
+        } else {
+            size_t pos;
+            if (findSorted(key, pos)) {
+                slots[pos] = ERASED;
+            }
+        }
+        return true;
+    }
+    
+    void reserve(size_t n) { pending.reserve(n); }
+    
+    // Слияние буфера вставок с отсортированным массивом и обучение моделей
+    void build() {
+        TRACE_SPAN("обучение RMI");
+        auto start = chrono::high_resolution_clock::now();
+        mergePending();
+        
+        size_t n = keys.size();
+        size_t leafCount = max<size_t>(n / keysPerLeaf, 1);
+        leaves.assign(leafCount, LeafModel{0.0, 0.0, 0, 0});
+        
+        // Корневая модель: ключ -> номер листа (позиция * leafCount / n)
+        fitLinear(0, n, rootSlope, rootIntercept);
+        if (n > 0) {
+            double scale = static_cast<double>(leafCount) / n;
+            rootSlope *= scale;
+            rootIntercept *= scale;
+        }
+        
+        // Корневая модель монотонна, поэтому каждому листу достаётся
+        // непрерывный отрезок массива ключей
+        size_t from = 0;
+        long long windowSum = 0;
+        maxError = 0;
+        for (size_t leaf = 0; leaf < leafCount; ++leaf) {
+            size_t to = from;
+            while (to < n && leafFor(keys[to]) == leaf) {
+                ++to;
+            }
+            LeafModel& model = leaves[leaf];
+            fitLinear(from, to, model.slope, model.intercept);
+            if (from == to) {
+                model.errLo = model.errHi = 0;
+            } else {
+                int64_t lo = INT64_MAX, hi = INT64_MIN;
+                for (size_t i = from; i < to; ++i) {
+                    int64_t err = static_cast<int64_t>(i) - predict(model, keys[i]);
+                    lo = min(lo, err);
+                    hi = max(hi, err);
+                }
+                model.errLo = static_cast<int32_t>(lo);
+                model.errHi = static_cast<int32_t>(hi);
+                maxError = max<int32_t>(maxError, max(-model.errLo, model.errHi));
+                windowSum += static_cast<long long>(model.errHi - model.errLo + 1) * (to - from);
+            }
+            from = to;
+        }
+        meanWindow = n ? static_cast<double>(windowSum) / n : 0.0;
+        
+        auto end = chrono::high_resolution_clock::now();
+        buildMillis = chrono::duration<double, milli>(end - start).count();
+    }
+    
+    void clear() {
+        keys.clear();
+        slots.clear();
+        leaves.clear();
+        pending.clear();
+        liveCount = 0;
+    }
+    
+    size_t size() const { return liveCount; }
+    size_t leafCount() const { return leaves.size(); }
+    double getBuildMillis() const { return buildMillis; }
+    int32_t getMaxError() const { return maxError; }
+    double getMeanWindow() const { return meanWindow; }
+    
+    size_t modelMemory() const { return leaves.size() * sizeof(LeafModel); }
+    size_t memoryUsage() const {
+        return keys.size() * sizeof(uint64_t) + slots.size() * sizeof(uint32_t)
+             + pending.bucket_count() * sizeof(void*)
+             + pending.size() * (sizeof(pair<const uint64_t, uint32_t>) + 2 * sizeof(void*)) + modelMemory();
+    }
+};
+
+// Двухуровневая таблица прямой адресации: первые PrefixBytes байт UID
+// напрямую выбирают блок в каталоге смещений (без вычисления хэша), блок
+// хранит отсортированные оставшиеся байты ключа (суффиксы). При префиксе
+// в 3 байта суффикс занимает 4 байта вместо 8, поиск внутри блока идёт
+// сравнением по 4 суффикса за инструкцию SSE2.
+// Каталог занимает 4 * 256^PrefixBytes байт, поэтому 3-байтовый префикс
+// оправдан начиная с десятков миллионов ключей.
+// Как и RmiIndex, строится в build(), вставки до этого копятся в буфере.
+template <int PrefixBytes>
+class RadixIndex {
+private:
+    static_assert(PrefixBytes == 2 || PrefixBytes == 3, "Префикс должен занимать 2 или 3 байта");
+    
+    static constexpr int SUFFIX_BITS = 56 - 8 * PrefixBytes;
+    static constexpr size_t DIRECTORY_SIZE = size_t(1) << (8 * PrefixBytes);
+    static constexpr uint32_t ERASED = UINT32_MAX;
+    
+    typedef typename conditional<SUFFIX_BITS <= 32, uint32_t, uint64_t>::type Suffix;
+    
+    vector<uint32_t> offsets;   // начало блока для каждого префикса
+    vector<Suffix> suffixes;
+    vector<uint32_t> slots;
+    unordered_map<uint64_t, uint32_t> pending;  // вставки и удаления после build()
+    size_t liveCount = 0;  // актуальных ключей с учётом pending
+    double buildMillis = 0.0;
+    
+    bool findBuilt(uint64_t key, size_t& pos) const {
+        if (offsets.empty()) {
+            return false;
+        }
+        size_t prefix = static_cast<size_t>(key >> SUFFIX_BITS);
+        Suffix suffix = static_cast<Suffix>(key & ((uint64_t(1) << SUFFIX_BITS) - 1));
+        size_t i = offsets[prefix];
+        size_t end = offsets[prefix + 1];
+#ifdef __SSE2__
+        if (sizeof(Suffix) == 4) {
+            __m128i needle = _mm_set1_epi32(static_cast<int>(suffix));
+            for (; i + 4 <= end; i += 4) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&suffixes[i]));
+                int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, needle)));
+                if (mask) {
+                    pos = i + __builtin_ctz(mask);
+                    return true;
+                }
+            }
+        }
+#endif
+        if (sizeof(Suffix) == 8) {
+            // Крупные блоки 2-байтового префикса: двоичный поиск
+            auto it = lower_bound(suffixes.begin() + i, suffixes.begin() + end, suffix);
+            if (it != suffixes.begin() + end && *it == suffix) {
+                pos = it - suffixes.begin();
+                return true;
+            }
+            return false;
+        }
+        for (; i < end; ++i) {
+            if (suffixes[i] == suffix) {
+                pos = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+public:
+    static const char* name() { return PrefixBytes == 2 ? "radix16" : "radix24"; }
+    
+    void insert(uint64_t key, uint32_t slot) {
+        uint32_t previous;
+        if (!find(key, previous)) {
+            ++liveCount;
+        }
+        pending[key] = slot;
+    }
+    
+    bool find(uint64_t key, uint32_t& slot) const {
+        auto it = pending.find(key);
+        if (it != pending.end()) {
+            if (it->second == ERASED) {
+                return false;
+            }
+            slot = it->second;
+            return true;
+        }
+        size_t pos;
+        if (findBuilt(key, pos) && slots[pos] != ERASED) {
+            slot = slots[pos];
+            return true;
+        }
+        return false;
+    }
+    
+    bool erase(uint64_t key) {
+        uint32_t slot;
+        if (!find(key, slot)) {
+            return false;
+        }
+        --liveCount;
+        if (!pending.empty()) {
+            pending[key] = ERASED;
+        } else {
+            size_t pos;
+            if (findBuilt(key, pos)) {
+                slots[pos] = ERASED;
+            }
+        }
+        return true;
+    }
+    
+    void reserve(size_t n) { pending.reserve(n); }
+    
+    // Пересборка каталога: существующие ключи и буфер вставок
+    // раскладываются подсчётом по префиксам
+    void build() {
+        TRACE_SPAN("построение каталога radix");
+        auto start = chrono::high_resolution_clock::now();
+        
+        vector<pair<uint64_t, uint32_t>> entries;
+        entries.reserve(suffixes.size() + pending.size());
+        for (size_t prefix = 0; prefix + 1 < offsets.size(); ++prefix) {
+            for (size_t i = offsets[prefix]; i < offsets[prefix + 1]; ++i) {
+                if (slots[i] != ERASED) {
+                    entries.emplace_back((uint64_t(prefix) << SUFFIX_BITS) | suffixes[i], slots[i]);
+                }
+            }
+        }
+        entries.insert(entries.end(), pending.begin(), pending.end());
+        unordered_map<uint64_t, uint32_t>().swap(pending);
+        
+        // Сортировка с сохранением порядка: значение из буфера вставок
+        // идёт после значения из каталога и заменяет его
+        stable_sort(entries.begin(), entries.end(),
+                    [](const pair<uint64_t, uint32_t>& a, const pair<uint64_t, uint32_t>& b) {
+                        return a.first < b.first;
+                    });
+        size_t unique = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i + 1 < entries.size() && entries[i + 1].first == entries[i].first) {
+                continue;
+            }
+            if (entries[i].second != ERASED) {
+                entries[unique++] = entries[i];
+            }
+        }
+        entries.resize(unique);
+        
+        offsets.assign(DIRECTORY_SIZE + 1, 0);
+        suffixes.resize(unique);
+        slots.resize(unique);
+        for (size_t i = 0; i < unique; ++i) {
+            ++offsets[(entries[i].first >> SUFFIX_BITS) + 1];
+            suffixes[i] = static_cast<Suffix>(entries[i].first & ((uint64_t(1) << SUFFIX_BITS) - 1));
+            slots[i] = entries[i].second;
+        }
+        for (size_t prefix = 0; prefix < DIRECTORY_SIZE; ++prefix) {
+            offsets[prefix + 1] += offsets[prefix];
+        }
+        
+        auto end = chrono::high_resolution_clock::now();
+        buildMillis = chrono::duration<double, milli>(end - start).count();
+    }
+    
+    void clear() {
+        offsets.clear();
+        suffixes.clear();
+        slots.clear();
+        pending.clear();
+        liveCount = 0;
+    }
+    
+    size_t size() const { return liveCount; }
+    double getBuildMillis() const { return buildMillis; }
+    
+    size_t memoryUsage() const {
+        return offsets.size() * sizeof(uint32_t) + suffixes.size() * sizeof(Suffix)
+             + slots.size() * sizeof(uint32_t) + pending.bucket_count() * sizeof(void*)
+             + pending.size() * (sizeof(pair<const uint64_t, uint32_t>) + 2 * sizeof(void*));
+    }
+};
+
+// Вторичный индекс по данным записи (или по извлечённому из них полю):
+// открытая адресация с линейным пробированием, элемент - 32 бита хэша
+// поля и номер слота записи. Сами значения не копируются: при совпадении
+// хэша поле извлекается из записи и сравнивается. Одному значению может
+// соответствовать несколько записей.
+class PayloadIndex {
+public:
+    typedef function<string_view(const string&)> FieldExtractor;
+    
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    
+    struct Entry {
+        uint32_t tag;
+        uint32_t slot;
+    };
+    
+    FieldExtractor extract;
+    vector<Entry> table;
+    size_t count = 0;
+    
+    static uint64_t hashField(string_view field) {
+        return mixHash(hash<string_view>()(field));
+    }
+    
+    size_t mask() const { return table.size() - 1; }
+    
+    void place(uint64_t h, uint32_t slot) {
+        size_t pos = h & mask();
+        while (table[pos].slot != EMPTY) {
+            pos = (pos + 1) & mask();
+        }
+        table[pos] = {static_cast<uint32_t>(h >> 32), slot};
+    }
+    
+    void grow(const vector<Record>& records) {
+        TRACE_SPAN("перехэширование индекса данных");
+        vector<Entry> old(max<size_t>(table.size() * 2, 16), Entry{0, EMPTY});
+        old.swap(table);
+        for (const Entry& entry : old) {
+            if (entry.slot != EMPTY) {
+                place(hashField(extract(records[entry.slot].getData())), entry.slot);
+            }
+        }
+    }
+    
+public:
+    explicit PayloadIndex(FieldExtractor extract) : extract(move(extract)) {}
+    
+    void insert(const vector<Record>& records, uint32_t slot) {
+        if ((count + 1) * 10 > table.size() * 7) {
+            grow(records);
+        }
+        place(hashField(extract(records[slot].getData())), slot);
+        ++count;
+    }
+    
+    // Удаление должно выполняться до изменения данных записи:
+    // положение элемента определяется хэшем текущего значения поля.
+    // Освободившаяся позиция заполняется сдвигом следующих элементов
+    // цепочки назад, без пометок удаления.
+    void erase(const vector<Record>& records, uint32_t slot) {
+        if (table.empty()) {
+            return;
+        }
+        size_t pos = hashField(extract(records[slot].getData())) & mask();
+        while (table[pos].slot != slot) {
+            if (table[pos].slot == EMPTY) {
+                return;
+            }
+            pos = (pos + 1) & mask();
+        }
+        size_t hole = pos;
+        for (size_t next = (hole + 1) & mask(); table[next].slot != EMPTY; next = (next + 1) & mask()) {
+            size_t home = hashField(extract(records[table[next].slot].getData())) & mask();
+            // Элемент можно сдвинуть в дыру, если его исходная позиция
+            // не лежит в циклическом интервале (hole, next]
+            bool between = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+            if (!between) {
+                table[hole] = table[next];
+                hole = next;
+            }
+        }
+        table[hole].slot = EMPTY;
+        --count;
+    }
+    
+    void find(const vector<Record>& records, string_view value, vector<uint32_t>& slots) const {
+        slots.clear();
+        if (table.empty()) {
+            return;
+        }
+        uint64_t h = hashField(value);
+        uint32_t tag = static_cast<uint32_t>(h >> 32);
+        for (size_t pos = h & mask(); table[pos].slot != EMPTY; pos = (pos + 1) & mask()) {
+            if (table[pos].tag == tag && extract(records[table[pos].slot].getData()) == value) {
+                slots.push_back(table[pos].slot);
+            }
+        }
+    }
+    
+    void clear() {
+        table.clear();
+        count = 0;
+    }
+    
+    size_t size() const { return count; }
+    size_t memoryUsage() const { return table.size() * sizeof(Entry); }
+};
+
+// Инвертированный индекс по триграммам данных для поиска подстрок.
+// Для каждой триграммы (три подряд идущих байта) хранится список слотов
+// записей, сжатый разностным кодированием в varint. Запрос пересекает
+// списки всех триграмм фрагмента, начиная с самого короткого, после чего
+// кандидаты проверяются по самим данным.
+// Новые слоты только растут, поэтому addRecord дописывает их в конец
+// списков. Слот изменённой записи попадает в множество "грязных",
+// которые всегда проверяются напрямую (до следующей полной сборки).
+class TrigramIndex {
+private:
+    struct PostingList {
+        vector<uint8_t> bytes;
+        uint32_t last = 0;
+        uint32_t count = 0;
+        
+        void append(uint32_t slot) {
+            if (count > 0 && slot <= last) {
+                return;
+            }
+            uint32_t delta = count > 0 ? slot - last : slot;
+            while (delta >= 0x80) {
+                bytes.push_back(static_cast<uint8_t>(delta | 0x80));
+                delta >>= 7;
+            }
+            bytes.push_back(static_cast<uint8_t>(delta));
+            last = slot;
+            ++count;
+        }
+        
+        // Дописывание списка с более старшими слотами: первое значение
+        // other закодировано абсолютно и перекодируется относительно last
+        void concat(const PostingList& other) {
+            if (other.count == 0) {
+                return;
+            }
+            size_t pos = 0;
+            uint32_t first = decodeVarint(other.bytes, pos);
+            append(first);
+            bytes.insert(bytes.end(), other.bytes.begin() + pos, other.bytes.end());
+            count += other.count - 1;
+            last = other.last;
+        }
+        
+        void decode(vector<uint32_t>& out) const {
+            out.clear();
+            out.reserve(count);
+            uint32_t slot = 0;
+            for (size_t pos = 0; pos < bytes.size();) {
+                slot += decodeVarint(bytes, pos);
+                out.push_back(slot);
+            }
+        }
+    };
+    
+    unordered_map<uint32_t, PostingList> postings;
+    unordered_set<uint32_t> dirty;
+    
+    static uint32_t decodeVarint(const vector<uint8_t>& bytes, size_t& pos) {
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = bytes[pos++];
+            value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+    }
+    
+    // Различные триграммы строки
+    static void trigramsOf(string_view text, vector<uint32_t>& out) {
+        out.clear();
+        for (size_t i = 0; i + 3 <= text.size(); ++i) {
+            out.push_back((static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 16)
+                        | (static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8)
+                        | static_cast<unsigned char>(text[i + 2]));
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+    
+public:
+    void add(uint32_t slot, string_view data) {
+        vector<uint32_t> trigrams;
+        trigramsOf(data, trigrams);
+        for (uint32_t trigram : trigrams) {
+            postings[trigram].append(slot);
+        }
+    }
+    
+    void markDirty(uint32_t slot) {
+        dirty.insert(slot);
+    }
+    
+    // Полная сборка по возрастающему списку слотов: каждый поток
+    // индексирует свой отрезок слотов, затем списки отрезков склеиваются
+    // по порядку
+    void build(const vector<Record>& records, const vector<uint32_t>& slots, unsigned threadCount) {
+        TRACE_SPAN("построение триграммного индекса");
+        threadCount = max(threadCount, 1u);
+        vector<unordered_map<uint32_t, PostingList>> partial(threadCount);
+        vector<thread> threads;
+        for (unsigned t = 0; t < threadCount; ++t) {
+            threads.emplace_back([&, t] {
+                TRACE_SPAN("триграммы части записей");
+                vector<uint32_t> trigrams;
+                size_t from = slots.size() * t / threadCount;
+                size_t to = slots.size() * (t + 1) / threadCount;
+                for (size_t i = from; i < to; ++i) {
+                    trigramsOf(records[slots[i]].getData(), trigrams);
+                    for (uint32_t trigram : trigrams) {
+                        partial[t][trigram].append(slots[i]);
+                    }
+                }
+            });
+        }
+        for (thread& t : threads) {
+            t.join();
+        }
+        
+        postings.swap(partial[0]);
+        for (unsigned t = 1; t < threadCount; ++t) {
+            for (auto& entry : partial[t]) {
+                postings[entry.first].concat(entry.second);
+            }
+            unordered_map<uint32_t, PostingList>().swap(partial[t]);
+        }
+        dirty.clear();
+    }
+    
+    // Кандидаты для фрагмента; false - фрагмент короче триграммы,
+    // и индекс не сужает поиск
+    bool candidates(string_view fragment, vector<uint32_t>& out) const {
+        out.clear();
+        if (fragment.size() < 3) {
+            return false;
+        }
+        vector<uint32_t> trigrams;
+        trigramsOf(fragment, trigrams);
+        vector<const PostingList*> lists;
+        bool missing = false;
+        for (uint32_t trigram : trigrams) {
+            auto it = postings.find(trigram);
+            if (it == postings.end()) {
+                missing = true;
+                break;
+            }
+            lists.push_back(&it->second);
+        }
+        
+        if (!missing) {
+            sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) {
+                return a->count < b->count;
+            });
+            lists.front()->decode(out);
+            vector<uint32_t> other;
+            for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+                lists[i]->decode(other);
+                vector<uint32_t> merged;
+                set_intersection(out.begin(), out.end(), other.begin(), other.end(), back_inserter(merged));
+                out.swap(merged);
+            }
+        }
+        if (!dirty.empty()) {
+            out.insert(out.end(), dirty.begin(), dirty.end());
+            sort(out.begin(), out.end());
+            out.erase(unique(out.begin(), out.end()), out.end());
+        }
+        return true;
+    }
+    
+    void clear() {
+        postings.clear();
+        dirty.clear();
+    }
+    
+    size_t trigramCount() const { return postings.size(); }
+    
+    size_t memoryUsage() const {
+        size_t bytes = postings.bucket_count() * sizeof(void*) + dirty.size() * 2 * sizeof(void*);
+        for (const auto& entry : postings) {
+            bytes += sizeof(entry) + 2 * sizeof(void*) + entry.second.bytes.capacity();
+        }
+        return bytes;
+    }
+};
+
+// Выбор позиции k-го (с нуля) единичного бита слова. С BMI2 - одна
+// инструкция pdep, без неё - последовательное снятие младших бит
+inline unsigned selectBitGeneric(uint64_t word, unsigned k) {
+    for (unsigned i = 0; i < k; ++i) {
+        word &= word - 1;
+    }
+    return __builtin_ctzll(word);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("bmi2")))
+inline unsigned selectBitBmi2(uint64_t word, unsigned k) {
+    return __builtin_ctzll(_pdep_u64(uint64_t(1) << k, word));
+}
+
+inline unsigned selectBit(uint64_t word, unsigned k) {
+    static const bool bmi2 = __builtin_cpu_supports("bmi2");
+    return bmi2 ? selectBitBmi2(word, k) : selectBitGeneric(word, k);
+}
+#else
+inline unsigned selectBit(uint64_t word, unsigned k) {
+    return selectBitGeneric(word, k);
+}
+#endif
+
+// Фильтр Блума: k хэшей двойным хэшированием. Удаление не поддерживается,
+// поэтому после удаления записей фильтр продолжает пропускать их UID
+class BloomFilter {
+private:
+    vector<uint64_t> bits;
+    uint64_t bitCount;
+    int hashCount;
+    
+public:
+    BloomFilter(size_t expectedKeys, double bitsPerKey)
+        : bitCount(max<uint64_t>(64, static_cast<uint64_t>(expectedKeys * bitsPerKey))),
+          hashCount(max(1, static_cast<int>(lround(bitsPerKey * log(2.0))))) {
+        bits.assign((bitCount + 63) / 64, 0);
+    }
+    
+    void insert(uint64_t key) {
+        uint64_t h = mixHash(key);
+        uint64_t step = (h >> 32) | 1;
+        for (int i = 0; i < hashCount; ++i, h += step) {
+            uint64_t bit = h % bitCount;
+            bits[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+    
+    bool mayContain(uint64_t key) const {
+        uint64_t h = mixHash(key);
+        uint64_t step = (h >> 32) | 1;
+        for (int i = 0; i < hashCount; ++i, h += step) {
+            uint64_t bit = h % bitCount;
+            if (!((bits[bit >> 6] >> (bit & 63)) & 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    size_t memoryUsage() const { return bits.size() * sizeof(uint64_t); }
+};
+
+// Фильтр частного (quotient filter) с ранговой разметкой (RSQF) и подсчётом:
+// хэш ключа даёт отпечаток из q + r бит, старшие q бит - номер «родного»
+// слота (частное), младшие r бит - остаток, который хранится в слоте.
+// Остатки одного частного образуют отсортированную серию, серии идут по
+// возрастанию частных и при коллизиях сдвигаются вправо. Слоты собраны в
+// блоки по 64: в блоке лежат слово occupieds (у частного есть серия),
+// слово runends (слот завершает серию), смещение offset (сколько первых
+// слотов блока занято сериями из предыдущих блоков) и упакованные остатки.
+// Конец серии находится за O(1) через rank по occupieds и select по runends.
+// Повторная вставка ключа добавляет копию остатка (счётчик), удаление
+// снимает одну копию. При росте фильтр удваивается, забирая бит остатка
+// в частное (вероятность ложного срабатывания растёт вдвое); два фильтра
+// с одинаковой длиной отпечатка сливаются слиянием отсортированных
+// отпечатков.
+class QuotientFilter {
+private:
+    static constexpr size_t META_WORDS = 3;  // occupieds, runends, offset
+    static constexpr double MAX_LOAD = 0.95;
+    
+    int quotientBits;
+    int remainderBits;
+    uint64_t quotientCount;
+    uint64_t slotCount;  // частные и запас в конце для сдвинутых серий
+    size_t blockWords;
+    vector<uint64_t> blocks;
+    size_t entryCount = 0;
+    size_t resizeCount = 0;
+    
+    uint64_t& occupieds(uint64_t block) { return blocks[block * blockWords]; }
+    uint64_t& runends(uint64_t block) { return blocks[block * blockWords + 1]; }
+    uint64_t& offset(uint64_t block) { return blocks[block * blockWords + 2]; }
+    uint64_t occupieds(uint64_t block) const { return blocks[block * blockWords]; }
+    uint64_t runends(uint64_t block) const { return blocks[block * blockWords + 1]; }
+    uint64_t offset(uint64_t block) const { return blocks[block * blockWords + 2]; }
+    
+    bool isOccupied(uint64_t quotient) const {
+        return (occupieds(quotient >> 6) >> (quotient & 63)) & 1;
+    }
+    
+    bool isRunEnd(uint64_t slot) const {
+        return (runends(slot >> 6) >> (slot & 63)) & 1;
+    }
+    
+    uint64_t remainderAt(uint64_t slot) const {
+        const uint64_t* words = &blocks[(slot >> 6) * blockWords + META_WORDS];
+        uint64_t bit = (slot & 63) * remainderBits;
+        uint64_t value = words[bit >> 6] >> (bit & 63);
+        if ((bit & 63) + remainderBits > 64) {
+            value |= words[(bit >> 6) + 1] << (64 - (bit & 63));
+        }
+        return value & ((uint64_t(1) << remainderBits) - 1);
+    }
+    
+    void setRemainder(uint64_t slot, uint64_t value) {
+        uint64_t* words = &blocks[(slot >> 6) * blockWords + META_WORDS];
+        uint64_t bit = (slot & 63) * remainderBits;
+        uint64_t mask = (uint64_t(1) << remainderBits) - 1;
+        words[bit >> 6] = (words[bit >> 6] & ~(mask << (bit & 63))) | (value << (bit & 63));
+        if ((bit & 63) + remainderBits > 64) {
+            unsigned spill = 64 - (bit & 63);
+            words[(bit >> 6) + 1] = (words[(bit >> 6) + 1] & ~(mask >> spill)) | (value >> spill);
+        }
+    }
+    
+    // Конец серии частного quotient, а если серии нет - конец последней
+    // серии меньшего частного (может быть левее quotient; -1, если такой
+    // серии нет до начала блока)
+    int64_t runEndOrPrevious(uint64_t quotient) const {
+        uint64_t block = quotient >> 6;
+        uint64_t start = (block << 6) + offset(block);
+        uint64_t mask = (quotient & 63) == 63 ? ~uint64_t(0) : (uint64_t(2) << (quotient & 63)) - 1;
+        unsigned rank = __builtin_popcountll(occupieds(block) & mask);
+        if (rank == 0) {
+            return static_cast<int64_t>(start) - 1;
+        }
+        uint64_t current = start >> 6;
+        uint64_t word = runends(current) & (~uint64_t(0) << (start & 63));
+        for (;;) {
+            unsigned count = __builtin_popcountll(word);
+            if (count >= rank) {
+                return static_cast<int64_t>((current << 6) + selectBit(word, rank - 1));
+            }
+            rank -= count;
+            word = runends(++current);
+        }
+    }
+    
+    // Пересчёт смещений блоков с номерами из [first, last]: смещение
+    // блока определяется концом последней серии предыдущего блока
+    void refreshOffsets(uint64_t first, uint64_t last) {
+        for (uint64_t block = max<uint64_t>(first, 1); block <= last && block < slotCount / 64; ++block) {
+            int64_t previous = runEndOrPrevious((block << 6) - 1);
+            offset(block) = static_cast<uint64_t>(max<int64_t>(0, previous + 1 - static_cast<int64_t>(block << 6)));
+        }
+    }
+    
+    // Элементы кластера (частное, остаток) по порядку слотов; буфер
+    // переиспользуется между вставками и удалениями
+    vector<pair<uint64_t, uint64_t>> cluster;
+    
+    // Чтение кластера начиная с серии quotient (возможно, пустой) до
+    // первого свободного слота; start - первый слот серии quotient
+    void readCluster(uint64_t quotient, uint64_t& start, uint64_t& end) {
+        int64_t previous = quotient == 0 ? -1 : runEndOrPrevious(quotient - 1);
+        start = max<uint64_t>(quotient, static_cast<uint64_t>(previous + 1));
+        cluster.clear();
+        uint64_t slot = start;
+        auto readRun = [&](uint64_t runQuotient) {
+            for (;; ++slot) {
+                cluster.emplace_back(runQuotient, remainderAt(slot));
+                if (isRunEnd(slot)) {
+                    ++slot;
+                    break;
+                }
+            }
+        };
+        if (isOccupied(quotient)) {
+            readRun(quotient);
+        }
+        // Следующие серии входят в кластер, пока начинаются вплотную
+        for (uint64_t next = quotient + 1; next <= slot && slot < slotCount;) {
+            uint64_t block = next >> 6;
+            uint64_t word = occupieds(block) & (~uint64_t(0) << (next & 63));
+            if (word == 0) {
+                next = (block + 1) << 6;
+                continue;
+            }
+            next = (block << 6) + __builtin_ctzll(word);
+            if (next > slot) {
+                break;
+            }
+            readRun(next);
+            ++next;
+        }
+        end = slot;
+    }
+    
+    // Запись кластера на место прежнего [start, oldEnd); false без изменений,
+    // если кластер не помещается до конца запаса слотов. Биты occupieds
+    // выставляет вызывающий
+    bool writeCluster(uint64_t quotient, uint64_t start, uint64_t oldEnd) {
+        uint64_t end = start;
+        for (size_t i = 0; i < cluster.size(); ++i) {
+            end = (i == 0 || cluster[i].first != cluster[i - 1].first) ? max(end, cluster[i].first) + 1 : end + 1;
+        }
+        if (end > slotCount) {
+            return false;
+        }
+        for (uint64_t slot = start; slot < oldEnd; ++slot) {
+            runends(slot >> 6) &= ~(uint64_t(1) << (slot & 63));
+        }
+        uint64_t slot = start;
+        for (size_t i = 0; i < cluster.size(); ++i) {
+            if (i == 0 || cluster[i].first != cluster[i - 1].first) {
+                slot = max(slot, cluster[i].first);
+            }
+            setRemainder(slot, cluster[i].second);
+            if (i + 1 == cluster.size() || cluster[i + 1].first != cluster[i].first) {
+                runends(slot >> 6) |= uint64_t(1) << (slot & 63);
+            }
+            ++slot;
+        }
+        refreshOffsets((quotient >> 6) + 1, (max(slot, oldEnd) >> 6) + 1);
+        return true;
+    }
+    
+    uint64_t fingerprint(uint64_t key) const {
+        return mixHash(key) & ((uint64_t(1) << (quotientBits + remainderBits)) - 1);
+    }
+    
+    void allocate() {
+        quotientCount = uint64_t(1) << quotientBits;
+        uint64_t spare = max<uint64_t>(64, static_cast<uint64_t>(10 * sqrt(static_cast<double>(quotientCount))));
+        slotCount = (quotientCount + spare + 63) / 64 * 64;
+        blockWords = META_WORDS + remainderBits;
+        blocks.assign(slotCount / 64 * blockWords, 0);
+        entryCount = 0;
+    }
+    
+    // Дозапись отпечатка в порядке возрастания (массовое построение)
+    void appendSorted(uint64_t print, int64_t& lastSlot, uint64_t& lastQuotient) {
+        uint64_t quotient = print >> remainderBits;
+        uint64_t slot = max<uint64_t>(quotient, static_cast<uint64_t>(lastSlot + 1));
+        if (slot >= slotCount) {
+            throw overflow_error("Фильтр частного переполнен");
+        }
+        if (lastSlot >= 0 && quotient == lastQuotient) {
+            runends(lastSlot >> 6) &= ~(uint64_t(1) << (lastSlot & 63));
+        }
+        occupieds(quotient >> 6) |= uint64_t(1) << (quotient & 63);
+        runends(slot >> 6) |= uint64_t(1) << (slot & 63);
+        setRemainder(slot, print & ((uint64_t(1) << remainderBits) - 1));
+        lastSlot = static_cast<int64_t>(slot);
+        lastQuotient = quotient;
+        ++entryCount;
+    }
+    
+public:
+    // Фильтр на expectedKeys ключей с отпечатком fingerprintBits бит
+    QuotientFilter(size_t expectedKeys, int fingerprintBits) {
+        quotientBits = 6;
+        while ((uint64_t(1) << quotientBits) * MAX_LOAD < expectedKeys) {
+            ++quotientBits;
+        }
+        remainderBits = fingerprintBits - quotientBits;
+        if (remainderBits < 1 || fingerprintBits > 63) {
+            throw invalid_argument("Отпечаток должен быть длиннее частного");
+        }
+        allocate();
+    }
+    
+    // Все отпечатки (с повторами) по возрастанию
+    template <typename Visitor>
+    void forEachFingerprint(Visitor visit) const {
+        uint64_t slot = 0;
+        for (uint64_t block = 0; block < slotCount / 64; ++block) {
+            for (uint64_t word = occupieds(block); word; word &= word - 1) {
+                uint64_t quotient = (block << 6) + __builtin_ctzll(word);
+                slot = max(slot, quotient);
+                for (;; ++slot) {
+                    visit(quotient << remainderBits | remainderAt(slot));
+                    if (isRunEnd(slot)) {
+                        ++slot;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    void insert(uint64_t key) {
+        if (entryCount + 1 > quotientCount * MAX_LOAD) {
+            grow();
+        }
+        uint64_t print = fingerprint(key);
+        uint64_t quotient = print >> remainderBits;
+        uint64_t remainder = print & ((uint64_t(1) << remainderBits) - 1);
+        uint64_t start, end;
+        readCluster(quotient, start, end);
+        auto position = upper_bound(cluster.begin(), cluster.end(), make_pair(quotient, remainder));
+        cluster.insert(position, make_pair(quotient, remainder));
+        bool wasOccupied = isOccupied(quotient);
+        occupieds(quotient >> 6) |= uint64_t(1) << (quotient & 63);
+        if (!writeCluster(quotient, start, end)) {
+            // Кластер упёрся в конец запаса слотов
+            if (!wasOccupied) {
+                occupieds(quotient >> 6) &= ~(uint64_t(1) << (quotient & 63));
+            }
+            grow();
+            insert(key);
+            return;
+        }
+        ++entryCount;
+    }
+    
+    // Снятие одной копии ключа; false, если отпечатка нет
+    bool erase(uint64_t key) {
+        uint64_t print = fingerprint(key);
+        uint64_t quotient = print >> remainderBits;
+        if (!isOccupied(quotient)) {
+            return false;
+        }
+        uint64_t remainder = print & ((uint64_t(1) << remainderBits) - 1);
+        uint64_t start, end;
+        readCluster(quotient, start, end);
+        auto it = lower_bound(cluster.begin(), cluster.end(), make_pair(quotient, remainder));
+        if (it == cluster.end() || *it != make_pair(quotient, remainder)) {
+            return false;
+        }
+        it = cluster.erase(it);
+        bool runEmpty = (it == cluster.end() || it->first != quotient)
+                     && (it == cluster.begin() || prev(it)->first != quotient);
+        if (runEmpty) {
+            occupieds(quotient >> 6) &= ~(uint64_t(1) << (quotient & 63));
+        }
+        writeCluster(quotient, start, end);
+        --entryCount;
+        return true;
+    }
+    
+    // Число копий отпечатка ключа
+    size_t count(uint64_t key) const {
+        uint64_t print = fingerprint(key);
+        uint64_t quotient = print >> remainderBits;
+        if (!isOccupied(quotient)) {
+            return 0;
+        }
+        uint64_t remainder = print & ((uint64_t(1) << remainderBits) - 1);
+        int64_t slot = runEndOrPrevious(quotient);
+        size_t matches = 0;
+        // Серия просматривается с конца; остатки в ней отсортированы
+        for (;; --slot) {
+            uint64_t value = remainderAt(slot);
+            if (value < remainder) {
+                break;
+            }
+            matches += value == remainder;
+            if (static_cast<uint64_t>(slot) == quotient || isRunEnd(slot - 1)) {
+                break;
+            }
+        }
+        return matches;
+    }
+    
+    bool mayContain(uint64_t key) const {
+        return count(key) > 0;
+    }
+    
+    // Удвоение числа частных: бит остатка переходит в частное
+    void grow() {
+        TRACE_SPAN("рост фильтра частного");
+        if (remainderBits <= 1) {
+            throw overflow_error("Фильтр частного: отпечаток исчерпан, рост невозможен");
+        }
+        vector<uint64_t> prints;
+        prints.reserve(entryCount);
+        forEachFingerprint([&](uint64_t print) { prints.push_back(print); });
+        ++quotientBits;
+        --remainderBits;
+        allocate();
+        int64_t lastSlot = -1;
+        uint64_t lastQuotient = 0;
+        for (uint64_t print : prints) {
+            appendSorted(print, lastSlot, lastQuotient);
+        }
+        refreshOffsets(1, slotCount / 64);
+        ++resizeCount;
+    }
+    
+    // Слияние фильтров с одинаковой длиной отпечатка (например, построенных
+    // по частям в разных потоках); результат получает большее число частных
+    static QuotientFilter merge(const QuotientFilter& a, const QuotientFilter& b) {
+        if (a.quotientBits + a.remainderBits != b.quotientBits + b.remainderBits) {
+            throw invalid_argument("Сливаемые фильтры должны иметь одинаковую длину отпечатка");
+        }
+        vector<uint64_t> first, second;
+        first.reserve(a.entryCount);
+        second.reserve(b.entryCount);
+        a.forEachFingerprint([&](uint64_t print) { first.push_back(print); });
+        b.forEachFingerprint([&](uint64_t print) { second.push_back(print); });
+        vector<uint64_t> prints;
+        prints.reserve(first.size() + second.size());
+        std::merge(first.begin(), first.end(), second.begin(), second.end(), back_inserter(prints));
+        return fromSortedFingerprints(prints, a.quotientBits + a.remainderBits);
+    }
+    
+    // Массовое построение по ключам: отпечатки сортируются и дописываются
+    // подряд без сдвигов
+    static QuotientFilter fromKeys(const vector<uint64_t>& keys, int fingerprintBits) {
+        QuotientFilter filter(keys.size(), fingerprintBits);
+        vector<uint64_t> prints(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            prints[i] = filter.fingerprint(keys[i]);
+        }
+        sort(prints.begin(), prints.end());
+        return fromSortedFingerprints(prints, fingerprintBits);
+    }
+    
+    static QuotientFilter fromSortedFingerprints(const vector<uint64_t>& prints, int fingerprintBits) {
+        QuotientFilter filter(prints.size(), fingerprintBits);
+        int64_t lastSlot = -1;
+        uint64_t lastQuotient = 0;
+        for (uint64_t print : prints) {
+            filter.appendSorted(print, lastSlot, lastQuotient);
+        }
+        filter.refreshOffsets(1, filter.slotCount / 64);
+        return filter;
+    }
+    
+    size_t size() const { return entryCount; }
+    size_t resizes() const { return resizeCount; }
+    int getRemainderBits() const { return remainderBits; }
+    int getFingerprintBits() const { return quotientBits + remainderBits; }
+    double loadFactor() const { return static_cast<double>(entryCount) / quotientCount; }
+    size_t memoryUsage() const { return blocks.size() * sizeof(uint64_t); }
+};
+
+// Хранилище с данными внутри слотов индекса: открытая адресация с
+// линейным пробированием, слот - заголовок (56-битный ключ и байт длины)
+// и InlineBytes байт данных, всего 32 или 64 байта, так что слот целиком
+// лежит в одной строке кэша. Данные длиннее InlineBytes выносятся в
+// отдельный буфер, в слоте остаются указатель и длина. Попадание с
+// короткими данными читает одну строку кэша вместо цепочки индекс ->
+// вектор записей -> строка.
+template <size_t InlineBytes = 24>
+class InlinePayloadStore {
+private:
+    static_assert(InlineBytes == 24 || InlineBytes == 56, "Слот должен занимать 32 или 64 байта");
+    
+    static constexpr uint64_t KEY_MASK = (uint64_t(1) << 56) - 1;
+    static constexpr uint8_t EMPTY = 0xFF;
+    static constexpr uint8_t SPILLED = 0xFE;
+    static constexpr double MAX_LOAD = 0.8;
+    
+    struct Spill {
+        char* data;
+        uint32_t length;
+    };
+    
+    struct alignas(8 + InlineBytes) Slot {
+        uint64_t header;  // длина (или EMPTY/SPILLED) в старшем байте, ключ в младших 56 битах
+        union {
+            char bytes[InlineBytes];
+            Spill spill;
+        };
+        
+        uint8_t tag() const { return static_cast<uint8_t>(header >> 56); }
+        uint64_t key() const { return header & KEY_MASK; }
+    };
+    
+    vector<Slot> slots;
+    size_t mask = 0;
+    size_t count = 0;
+    size_t spilledCount = 0;
+    size_t spilledBytes = 0;
+    
+    static Slot emptySlot() {
+        Slot slot;
+        slot.header = uint64_t(EMPTY) << 56;
+        return slot;
+    }
+    
+    size_t home(uint64_t key) const {
+        return mixHash(key) & mask;
+    }
+    
+    void release(Slot& slot) {
+        if (slot.tag() == SPILLED) {
+            spilledBytes -= slot.spill.length;
+            --spilledCount;
+            delete[] slot.spill.data;
+        }
+    }
+    
+    void store(Slot& slot, uint64_t key, string_view data) {
+        if (data.size() <= InlineBytes) {
+            slot.header = uint64_t(data.size()) << 56 | key;
+            memcpy(slot.bytes, data.data(), data.size());
+        } else {
+            slot.header = uint64_t(SPILLED) << 56 | key;
+            slot.spill.data = new char[data.size()];
+            slot.spill.length = static_cast<uint32_t>(data.size());
+            memcpy(slot.spill.data, data.data(), data.size());
+            spilledBytes += data.size();
+            ++spilledCount;
+        }
+    }
+    
+    void rehash(size_t slotCount) {
+        vector<Slot> old(slotCount, emptySlot());
+        old.swap(slots);
+        mask = slotCount - 1;
+        // Слоты переносятся вместе с указателями вынесенных данных
+        for (const Slot& slot : old) {
+            if (slot.tag() != EMPTY) {
+                size_t pos = home(slot.key());
+                while (slots[pos].tag() != EMPTY) {
+                    pos = (pos + 1) & mask;
+                }
+                slots[pos] = slot;
+            }
+        }
+    }
+    
+public:
+    InlinePayloadStore() {
+        rehash(16);
+    }
+    
+    ~InlinePayloadStore() {
+        clear();
+    }
+    
+    InlinePayloadStore(const InlinePayloadStore&) = delete;
+    InlinePayloadStore& operator=(const InlinePayloadStore&) = delete;
+    
+    void reserve(size_t n) {
+        size_t needed = 16;
+        while (needed * MAX_LOAD < n) {
+            needed <<= 1;
+        }
+        if (needed > slots.size()) {
+            rehash(needed);
+        }
+    }
+    
+    // Вставка или замена данных ключа
+    void insert(uint64_t key, string_view data) {
+        if ((count + 1) > slots.size() * MAX_LOAD) {
+            rehash(slots.size() * 2);
+        }
+        size_t pos = home(key);
+        while (slots[pos].tag() != EMPTY) {
+            if (slots[pos].key() == key) {
+                release(slots[pos]);
+                store(slots[pos], key, data);
+                return;
+            }
+            pos = (pos + 1) & mask;
+        }
+        store(slots[pos], key, data);
+        ++count;
+    }
+    
+    bool find(uint64_t key, string_view& data) const {
+        for (size_t pos = home(key);; pos = (pos + 1) & mask) {
+            const Slot& slot = slots[pos];
+            uint8_t tag = slot.tag();
+            if (tag == EMPTY) {
+                return false;
+            }
+            if (slot.key() == key) {
+                data = tag == SPILLED ? string_view(slot.spill.data, slot.spill.length) : string_view(slot.bytes, tag);
+                return true;
+            }
+        }
+    }
+    
+    // Удаление со сдвигом следующих слотов кластера назад (без надгробий)
+    bool erase(uint64_t key) {
+        size_t pos = home(key);
+        while (slots[pos].key() != key || slots[pos].tag() == EMPTY) {
+            if (slots[pos].tag() == EMPTY) {
+                return false;
+            }
+            pos = (pos + 1) & mask;
+        }
+        release(slots[pos]);
+        size_t hole = pos;
+        for (size_t next = (pos + 1) & mask; slots[next].tag() != EMPTY; next = (next + 1) & mask) {
+            size_t desired = home(slots[next].key());
+            // Слот можно сдвинуть в дыру, если его родной слот не лежит
+            // циклически между дырой и текущей позицией
+            if (((next - desired) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole] = emptySlot();
+        --count;
+        return true;
+    }
+    
+    bool findRecord(const string& uid, string_view& data) const {
+        return uid.length() == 7 && find(packUid(uid), data);
+    }
+    
+    void addRecord(const Record& record) {
+        requireNarrowUid(record.getUid());
+        insert(packUid(record.getUid()), record.getData());
+    }
+    
+    void clear() {
+        for (Slot& slot : slots) {
+            release(slot);
+            slot = emptySlot();
+        }
+        count = 0;
+    }
+    
+    size_t size() const { return count; }
+    size_t spilled() const { return spilledCount; }
+    static constexpr size_t slotBytes() { return sizeof(Slot); }
+    
+    size_t memoryUsage() const {
+        return slots.size() * sizeof(Slot) + spilledBytes;
+    }
+};
+
+// Интернирование данных: одинаковые значения хранятся один раз в блобе
+// со счётчиком ссылок, записи ссылаются на блоб 32-битным номером.
+// Блобы находятся по хэшу содержимого через таблицу с открытой
+// адресацией; номера освободившихся блобов используются повторно.
+class PayloadInterner {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    
+    struct Blob {
+        string data;
+        uint64_t hash = 0;
+        uint32_t refs = 0;
+    };
+    
+    vector<Blob> blobs;
+    vector<uint32_t> freeIds;
+    vector<uint32_t> table;  // номера блобов
+    size_t count = 0;
+    
+    static uint64_t hashData(string_view data) {
+        return mixHash(hash<string_view>()(data));
+    }
+    
+    size_t mask() const { return table.size() - 1; }
+    
+    void place(uint32_t id) {
+        size_t pos = blobs[id].hash & mask();
+        while (table[pos] != EMPTY) {
+            pos = (pos + 1) & mask();
+        }
+        table[pos] = id;
+    }
+    
+    void grow(size_t needed) {
+        size_t size = max<size_t>(table.size(), 16);
+        while (needed * 10 > size * 7) {
+            size <<= 1;
+        }
+        if (size == table.size()) {
+            return;
+        }
+        TRACE_SPAN("перехэширование таблицы блобов");
+        table.assign(size, EMPTY);
+        for (uint32_t id = 0; id < blobs.size(); ++id) {
+            if (blobs[id].refs > 0) {
+                place(id);
+            }
+        }
+    }
+    
+    bool locate(string_view data, uint64_t h, size_t& pos) const {
+        if (table.empty()) {
+            return false;
+        }
+        for (pos = h & mask(); table[pos] != EMPTY; pos = (pos + 1) & mask()) {
+            const Blob& blob = blobs[table[pos]];
+            if (blob.hash == h && blob.data == data) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // refs ссылок на значение data с известным хэшем
+    uint32_t intern(string_view data, uint64_t h, uint32_t refs) {
+        size_t pos;
+        if (locate(data, h, pos)) {
+            blobs[table[pos]].refs += refs;
+            return table[pos];
+        }
+        grow(count + 1);
+        uint32_t id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+        } else {
+            if (blobs.size() == EMPTY) {
+                throw length_error("Исчерпаны номера блобов");
+            }
+            id = static_cast<uint32_t>(blobs.size());
+            blobs.emplace_back();
+        }
+        blobs[id].data.assign(data.data(), data.size());
+        blobs[id].hash = h;
+        blobs[id].refs = refs;
+        place(id);
+        ++count;
+        return id;
+    }
+    
+public:
+    uint32_t intern(string_view data) {
+        return intern(data, hashData(data), 1);
+    }
+    
+    // Массовое интернирование в threads потоков: значения разбиваются по
+    // старшим битам хэша на части, каждая часть дедуплицируется одним
+    // потоком независимо от других, после чего в общую таблицу попадает
+    // только по одному представителю каждого значения
+    vector<uint32_t> internBulk(const vector<string_view>& values, unsigned threads) {
+        TRACE_SPAN("массовое интернирование");
+        const size_t n = values.size();
+        threads = max(threads, 1u);
+        vector<uint64_t> hashes(n);
+        vector<uint32_t> ids(n);
+        vector<size_t> representative(n);
+        vector<uint32_t> refs(n, 0);
+        auto parallel = [&](function<void(unsigned)> body) {
+            vector<thread> workers;
+            for (unsigned t = 1; t < threads; ++t) {
+                workers.emplace_back(body, t);
+            }
+            body(0);
+            for (thread& worker : workers) {
+                worker.join();
+            }
+        };
+        
+        parallel([&](unsigned t) {
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) {
+                hashes[i] = hashData(values[i]);
+            }
+        });
+        // Поток t отвечает за значения, у которых старшие биты хэша дают t
+        parallel([&](unsigned t) {
+            unordered_map<string_view, size_t> first;
+            for (size_t i = 0; i < n; ++i) {
+                if (fastRange(static_cast<uint32_t>(hashes[i] >> 32), threads) != t) {
+                    continue;
+                }
+                auto it = first.emplace(values[i], i).first;
+                representative[i] = it->second;
+                ++refs[it->second];
+            }
+        });
+        
+        grow(count + n);
+        for (size_t i = 0; i < n; ++i) {
+            if (representative[i] == i) {
+                ids[i] = intern(values[i], hashes[i], refs[i]);
+            }
+        }
+        parallel([&](unsigned t) {
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) {
+                ids[i] = ids[representative[i]];
+            }
+        });
+        return ids;
+    }
+    
+    void acquire(uint32_t id) {
+        ++blobs[id].refs;
+    }
+    
+    // Снятие ссылки; блоб без ссылок удаляется со сдвигом следующих
+    // элементов цепочки назад
+    void release(uint32_t id) {
+        if (--blobs[id].refs > 0) {
+            return;
+        }
+        size_t pos = blobs[id].hash & mask();
+        while (table[pos] != id) {
+            pos = (pos + 1) & mask();
+        }
+        size_t hole = pos;
+        for (size_t next = (hole + 1) & mask(); table[next] != EMPTY; next = (next + 1) & mask()) {
+            size_t home = blobs[table[next]].hash & mask();
+            if (((next - home) & mask()) >= ((next - hole) & mask())) {
+                table[hole] = table[next];
+                hole = next;
+            }
+        }
+        table[hole] = EMPTY;
+        string().swap(blobs[id].data);
+        freeIds.push_back(id);
+        --count;
+    }
+    
+    const string& get(uint32_t id) const { return blobs[id].data; }
+    uint32_t refCount(uint32_t id) const { return blobs[id].refs; }
+    
+    void clear() {
+        blobs.clear();
+        freeIds.clear();
+        table.clear();
+        count = 0;
+    }
+    
+    // Число различных значений
+    size_t size() const { return count; }
+    
+    // Таблица, заголовки блобов и память строк вне самих заголовков
+    size_t memoryUsage() const {
+        size_t total = table.size() * sizeof(uint32_t) + blobs.capacity() * sizeof(Blob)
+                     + freeIds.capacity() * sizeof(uint32_t);
+        for (const Blob& blob : blobs) {
+            if (blob.data.capacity() > string().capacity()) {
+                total += blob.data.capacity() + 1;
+            }
+        }
+        return total;
+    }
+};
+
+// Хранилище записей с интернированными данными: индекс отображает UID
+// прямо в номер блоба, так что запись занимает один слот индекса
+template <typename Index = CuckooIndex>
+class InternedRecordStore {
+private:
+    Index index;
+    PayloadInterner interner;
+    
+public:
+    // Добавление или замена записи
+    void addRecord(const Record& record) {
+        requireNarrowUid(record.getUid());
+        uint64_t key = packUid(record.getUid());
+        uint32_t id = interner.intern(record.getData());
+        uint32_t previous;
+        if (index.find(key, previous)) {
+            interner.release(previous);
+        }
+        index.insert(key, id);
+    }
+    
+    // Массовая загрузка: данные дедуплицируются в threads потоков
+    void bulkLoad(const vector<Record>& records, unsigned threads = thread::hardware_concurrency()) {
+        vector<string_view> values;
+        values.reserve(records.size());
+        for (const Record& record : records) {
+            requireNarrowUid(record.getUid());
+            values.push_back(record.getData());
+        }
+        vector<uint32_t> ids = interner.internBulk(values, threads);
+        index.reserve(index.size() + records.size());
+        for (size_t i = 0; i < records.size(); ++i) {
+            uint64_t key = packUid(records[i].getUid());
+            uint32_t previous;
+            if (index.find(key, previous)) {
+                interner.release(previous);
+            }
+            index.insert(key, ids[i]);
+        }
+    }
+    
+    bool updateRecord(const string& uid, const string& data) {
+        uint32_t previous;
+        if (uid.length() != 7 || !index.find(packUid(uid), previous)) {
+            return false;
+        }
+        index.insert(packUid(uid), interner.intern(data));
+        interner.release(previous);
+        return true;
+    }
+    
+    bool eraseRecord(const string& uid) {
+        uint32_t id;
+        if (uid.length() != 7 || !index.find(packUid(uid), id)) {
+            return false;
+        }
+        index.erase(packUid(uid));
+        interner.release(id);
+        return true;
+    }
+    
+    // Данные записи; ссылка действительна до изменения этой записи
+    const string* findData(const string& uid) const {
+        uint32_t id;
+        if (uid.length() == 7 && index.find(packUid(uid), id)) {
+            return &interner.get(id);
+        }
+        return nullptr;
+    }
+    
+    const PayloadInterner& getInterner() const { return interner; }
+    
+    size_t size() const { return index.size(); }
+    
+    size_t memoryUsage() const {
+        return index.memoryUsage() + interner.memoryUsage();
+    }
+};
+
+// Операция пакетной записи (см. Database::applyBatch). Коды операций
+// совпадают с кодами журнала
+struct BatchOp {
+    enum Type : uint8_t { INSERT = 1, UPDATE = 2, ERASE = 3 };
+    
+    Type type;
+    string uid;
+    string data;
+};
+
+// Проверка пакета до первого изменения
+inline void validateBatch(const vector<BatchOp>& ops) {
+    for (const BatchOp& op : ops) {
+        if (op.uid.length() != 7) {
+            throw invalid_argument("UID должен быть длиной ровно 7 байт");
+        }
+        if (op.type != BatchOp::INSERT && op.type != BatchOp::UPDATE && op.type != BatchOp::ERASE) {
+            throw invalid_argument("Неизвестная операция пакета: " + to_string(op.type));
+        }
+    }
+}
+
+// Событие потока изменений. Данные длиннее ChangeFeed::INLINE_BYTES
+// в кольцо не помещаются: такое событие приходит с complete = false,
+// и подписчик должен перечитать запись (или сбросить её из кэша)
+struct ChangeEvent {
+    uint64_t sequence;
+    BatchOp::Type op;
+    bool complete;
+    string uid;
+    string data;
+};
+
+// Поток изменений (CDC): кольцо фиксированного размера, в которое
+// несколько писателей без блокировок публикуют события. Писатель занимает
+// номер события атомарным счётчиком и пишет слот под счётчиком-замком
+// (seqlock): нечётное значение - слот пишется, 2 * номер + 2 - событие
+// с этим номером готово. Подписчики только читают кольцо и хранят свою
+// позицию сами, поэтому медленный подписчик не задерживает писателей:
+// его события перезаписываются, а read() сообщает о переполнении, после
+// чего подписчик восстанавливается по снимку.
+class ChangeFeed {
+public:
+    static constexpr size_t INLINE_BYTES = 40;
+    
+private:
+    static constexpr size_t DATA_WORDS = INLINE_BYTES / sizeof(uint64_t);
+    
+    // Слот занимает одну строку кэша: замок, UID с операцией, длина
+    // данных с признаком полноты и сами данные
+    struct alignas(64) Slot {
+        atomic<uint64_t> stamp{0};
+        atomic<uint64_t> key{0};
+        atomic<uint64_t> length{0};
+        atomic<uint64_t> words[DATA_WORDS];
+    };
+    
+    static constexpr uint64_t COMPLETE_FLAG = uint64_t(1) << 32;
+    
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) atomic<uint64_t> head{0};
+    atomic<uint64_t> lapped{0};
+    
+public:
+    explicit ChangeFeed(size_t capacity = 1 << 16) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+    }
+    
+    ChangeFeed(const ChangeFeed&) = delete;
+    ChangeFeed& operator=(const ChangeFeed&) = delete;
+    
+    void publish(BatchOp::Type op, const string& uid, const string& data) {
+        uint64_t sequence = head.fetch_add(1, memory_order_relaxed);
+        Slot& slot = slots[sequence & mask];
+        uint64_t writing = 2 * sequence + 1;
+        uint64_t current = slot.stamp.load(memory_order_relaxed);
+        for (;;) {
+            // Писатель, обогнанный на целый круг, своё событие теряет;
+            // подписчики увидят более новый номер в слоте как переполнение
+            if (current >= writing) {
+                lapped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            if (current & 1) {
+                this_thread::yield();
+                current = slot.stamp.load(memory_order_relaxed);
+                continue;
+            }
+            if (slot.stamp.compare_exchange_weak(current, writing, memory_order_relaxed)) {
+                break;
+            }
+        }
+        atomic_thread_fence(memory_order_release);
+        
+        bool complete = data.size() <= INLINE_BYTES;
+        size_t length = complete ? data.size() : 0;
+        uint64_t words[DATA_WORDS] = {};
+        memcpy(words, data.data(), length);
+        slot.key.store(uint64_t(op) << 56 | packUid(uid), memory_order_relaxed);
+        slot.length.store(length | (complete ? COMPLETE_FLAG : 0), memory_order_relaxed);
+        for (size_t i = 0; i < (length + 7) / 8; ++i) {
+            slot.words[i].store(words[i], memory_order_relaxed);
+        }
+        slot.stamp.store(writing + 1, memory_order_release);
+    }
+    
+    // Чтение готовых событий начиная с номера next (не более maxEvents),
+    // next сдвигается за прочитанные. Возвращает false, если события
+    // с номером next уже перезаписаны: подписчик должен восстановиться
+    // по снимку и продолжить с headSequence(), взятого до снимка
+    bool read(uint64_t& next, vector<ChangeEvent>& events, size_t maxEvents) const {
+        uint64_t end = head.load(memory_order_acquire);
+        if (end > next + mask + 1) {
+            return false;
+        }
+        for (size_t taken = 0; next < end && taken < maxEvents; ++taken) {
+            const Slot& slot = slots[next & mask];
+            uint64_t ready = 2 * next + 2;
+            uint64_t before = slot.stamp.load(memory_order_acquire);
+            if (before < ready) {
+                break;  // событие ещё пишется
+            }
+            if (before > ready) {
+                return false;
+            }
+            uint64_t key = slot.key.load(memory_order_relaxed);
+            uint64_t length = slot.length.load(memory_order_relaxed);
+            uint64_t words[DATA_WORDS];
+            size_t size = static_cast<uint32_t>(length);
+            for (size_t i = 0; i < (size + 7) / 8 && i < DATA_WORDS; ++i) {
+                words[i] = slot.words[i].load(memory_order_relaxed);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (slot.stamp.load(memory_order_relaxed) != before || size > INLINE_BYTES) {
+                return false;
+            }
+            events.push_back({next, static_cast<BatchOp::Type>(key >> 56), (length & COMPLETE_FLAG) != 0,
+                              unpackUid(key & ((uint64_t(1) << 56) - 1)),
+                              string(reinterpret_cast<const char*>(words), size)});
+            ++next;
+        }
+        return true;
+    }
+    
+    // Номер следующего публикуемого события
+    uint64_t headSequence() const { return head.load(memory_order_acquire); }
+    size_t capacity() const { return mask + 1; }
+    uint64_t lappedCount() const { return lapped.load(memory_order_relaxed); }
+};
+
+// Отложенное освобождение данных записей по эпохам. Читатель закрепляет
+// текущую эпоху (pin) до того, как находит записи, и держит указатели на
+// их данные без блокировки базы, пока ответ не отправлен. Заменённые и
+// удалённые данные уходят в retire() и освобождаются, только когда не
+// осталось читателей, закреплённых не позже их замены.
+// Откладываются данные от PIN_MIN_BYTES: более короткие читатель копирует,
+// а длинные строки всегда лежат в куче, поэтому их буфер не переезжает
+// при росте вектора записей.
+class EpochManager {
+public:
+    static constexpr size_t PIN_MIN_BYTES = 256;
+    
+    // Закрепление эпохи; снимается деструктором или release()
+    class Guard {
+    private:
+        friend class EpochManager;
+        EpochManager* owner = nullptr;
+        uint64_t epoch = 0;
+        
+        Guard(EpochManager* owner, uint64_t epoch) : owner(owner), epoch(epoch) {}
+        
+    public:
+        Guard(Guard&& other) noexcept : owner(other.owner), epoch(other.epoch) {
+            other.owner = nullptr;
+        }
+        
+        Guard& operator=(Guard&& other) noexcept {
+            if (this != &other) {
+                release();
+                owner = other.owner;
+                epoch = other.epoch;
+                other.owner = nullptr;
+            }
+            return *this;
+        }
+        
+        ~Guard() {
+            release();
+        }
+        
+        void release() {
+            if (owner) {
+                owner->unpin(epoch);
+                owner = nullptr;
+            }
+        }
+    };
+    
+private:
+    mutex lock;
+    uint64_t epoch = 1;
+    map<uint64_t, size_t> pinned;  // эпоха -> число читателей
+    deque<pair<uint64_t, string>> retired;  // (эпоха замены, данные)
+    size_t retiredBytes = 0;
+    size_t reclaimedBytes = 0;
+    
+    void reclaim() {
+        uint64_t oldest = pinned.empty() ? UINT64_MAX : pinned.begin()->first;
+        while (!retired.empty() && retired.front().first < oldest) {
+            retiredBytes -= retired.front().second.size();
+            reclaimedBytes += retired.front().second.size();
+            retired.pop_front();
+        }
+    }
+    
+    void unpin(uint64_t pinnedEpoch) {
+        lock_guard<mutex> guard(lock);
+        auto it = pinned.find(pinnedEpoch);
+        if (--it->second == 0) {
+            pinned.erase(it);
+        }
+        reclaim();
+    }
+    
+public:
+    Guard pin() {
+        lock_guard<mutex> guard(lock);
+        ++pinned[epoch];
+        return Guard(this, epoch);
+    }
+    
+    void retire(string&& data) {
+        lock_guard<mutex> guard(lock);
+        retiredBytes += data.size();
+        retired.emplace_back(epoch++, move(data));
+        reclaim();
+    }
+    
+    // Объём данных, ожидающих освобождения, и уже освобождённых
+    size_t pendingBytes() {
+        lock_guard<mutex> guard(lock);
+        return retiredBytes;
+    }
+    
+    size_t reclaimed() {
+        lock_guard<mutex> guard(lock);
+        return reclaimedBytes;
+    }
+};
+
+// Класс для управления базой данных с эффективным поиском.
+// Index задаёт структуру поиска по UID; записи хранятся в векторе,
+// индекс ссылается на них номерами слотов (указатели на элементы вектора
+// становились бы недействительными при его росте).
+template <typename Index = HashMapIndex>
+class Database {
+private:
+    Index index;
+    vector<Record> records;
+    size_t liveCount = 0;
+    unique_ptr<PayloadIndex> payloadIndex;
+    unique_ptr<TrigramIndex> substringIndex;
+    ChangeFeed* changeFeed = nullptr;
+    EpochManager* epochs = nullptr;
+    unique_ptr<QuotientFilter> negativeFilter;
+    
+    // Многоверсионность: каждое изменение получает новую версию, слот
+    // помнит версию последнего изменения. Прежние значения сохраняются
+    // в history только пока открыт снимок, которому они видимы
+    struct OldVersion {
+        uint64_t from;  // версия, в которой значение появилось
+        uint64_t to;    // версия, в которой оно заменено или удалено
+        Record record;
+    };
+    
+    vector<uint64_t> versions;
+    uint64_t currentVersion = 0;
+    map<uint64_t, size_t> openSnapshots;  // версия снимка -> число дескрипторов
+    unordered_map<uint64_t, vector<OldVersion>> history;
+    deque<pair<uint64_t, uint64_t>> historyOrder;  // (to, ключ) в порядке вытеснения
+    bool batchOpen = false;  // все изменения пакета получают одну версию
+    
+    uint64_t nextVersion() {
+        return batchOpen ? currentVersion : ++currentVersion;
+    }
+    
+    // Замена данных слота; длинные прежние данные освобождаются через
+    // менеджер эпох, если он подключён
+    void replaceData(uint32_t slot, string data) {
+        if (epochs && records[slot].getData().size() >= EpochManager::PIN_MIN_BYTES) {
+            epochs->retire(records[slot].releaseData());
+        }
+        records[slot].setData(move(data));
+    }
+    
+    bool findSlot(const string& uid, uint32_t& slot) const {
+        return uid.length() == 7 && index.find(packUid(uid), slot);
+    }
+    
+    // Сохранение значения слота перед изменением в версии newVersion,
+    // если его ещё может увидеть открытый снимок
+    void preserveVersion(uint64_t key, uint32_t slot, uint64_t newVersion) {
+        if (openSnapshots.empty() || openSnapshots.rbegin()->first < versions[slot]) {
+            return;
+        }
+        history[key].push_back({versions[slot], newVersion, records[slot]});
+        historyOrder.emplace_back(newVersion, key);
+    }
+    
+    void releaseSnapshot(uint64_t version) {
+        auto it = openSnapshots.find(version);
+        if (--it->second == 0) {
+            openSnapshots.erase(it);
+        }
+        TRACE_SPAN("сборка старых версий");
+        if (openSnapshots.empty()) {
+            history.clear();
+            historyOrder.clear();
+            return;
+        }
+        // Версии, заменённые не позже самого старого снимка, больше не видимы
+        uint64_t oldest = openSnapshots.begin()->first;
+        while (!historyOrder.empty() && historyOrder.front().first <= oldest) {
+            auto entry = history.find(historyOrder.front().second);
+            entry->second.erase(entry->second.begin());
+            if (entry->second.empty()) {
+                history.erase(entry);
+            }
+            historyOrder.pop_front();
+        }
+    }
+    
+public:
+    // Дескриптор снимка: чтения через него видят базу на момент открытия.
+    // Снимок закрывается деструктором или release()
+    class Snapshot {
+    private:
+        friend class Database;
+        Database* owner = nullptr;
+        uint64_t version = 0;
+        
+        Snapshot(Database* owner, uint64_t version) : owner(owner), version(version) {}
+        
+    public:
+        Snapshot(Snapshot&& other) noexcept : owner(other.owner), version(other.version) {
+            other.owner = nullptr;
+        }
+        
+        Snapshot& operator=(Snapshot&& other) noexcept {
+            if (this != &other) {
+                release();
+                owner = other.owner;
+                version = other.version;
+                other.owner = nullptr;
+            }
+            return *this;
+        }
+        
+        ~Snapshot() {
+            release();
+        }
+        
+        void release() {
+            if (owner) {
+                owner->releaseSnapshot(version);
+                owner = nullptr;
+            }
+        }
+        
+        uint64_t getVersion() const { return version; }
+    };
+    
+    explicit Database(Index index = Index()) : index(move(index)) {}
+    
+    // Резервирование места под ожидаемое число записей
+    void reserve(size_t n) {
+        records.reserve(n);
+        versions.reserve(n);
+        index.reserve(n);
+    }
+    
+    // Добавление записи в базу данных. Запись с уже существующим UID
+    // заменяет прежнюю, слот прежней записи остаётся неиспользуемым.
+    void addRecord(Record&& record) {
+        requireNarrowUid(record.getUid());
+        uint32_t slot = static_cast<uint32_t>(records.size());
+        uint64_t key = packUid(record.getUid());
+        uint64_t version = nextVersion();
+        uint32_t previous;
+        if (index.find(key, previous)) {
+            preserveVersion(key, previous, version);
+            if (payloadIndex) {
+                payloadIndex->erase(records, previous);
+            }
+            replaceData(previous, string());
+        } else {
+            ++liveCount;
+            if (negativeFilter) {
+                negativeFilter->insert(key);
+            }
+        }
+        records.push_back(move(record));
+        versions.push_back(version);
+        index.insert(key, slot);
+        if (payloadIndex) {
+            payloadIndex->insert(records, slot);
+        }
+        if (substringIndex) {
+            substringIndex->add(slot, records[slot].getData());
+        }
+        if (changeFeed) {
+            changeFeed->publish(BatchOp::INSERT, records[slot].getUid(), records[slot].getData());
+        }
+    }
+    
+    // Замена данных существующей записи
+    bool updateRecord(const string& uid, const string& data) {
+        uint32_t slot;
+        if (!findSlot(uid, slot)) {
+            return false;
+        }
+        uint64_t version = nextVersion();
+        preserveVersion(packUid(uid), slot, version);
+        versions[slot] = version;
+        if (payloadIndex) {
+            payloadIndex->erase(records, slot);
+        }
+        replaceData(slot, data);
+        if (payloadIndex) {
+            payloadIndex->insert(records, slot);
+        }
+        if (substringIndex) {
+            substringIndex->markDirty(slot);
+        }
+        if (changeFeed) {
+            changeFeed->publish(BatchOp::UPDATE, uid, data);
+        }
+        return true;
+    }
+    
+    // Удаление записи: слот освобождается от данных и больше не
+    // достижим через индекс
+    bool eraseRecord(const string& uid) {
+        uint32_t slot;
+        if (!findSlot(uid, slot)) {
+            return false;
+        }
+        preserveVersion(packUid(uid), slot, nextVersion());
+        if (payloadIndex) {
+            payloadIndex->erase(records, slot);
+        }
+        index.erase(packUid(uid));
+        if (negativeFilter) {
+            negativeFilter->erase(packUid(uid));
+        }
+        replaceData(slot, string());
+        --liveCount;
+        if (changeFeed) {
+            changeFeed->publish(BatchOp::ERASE, uid, string());
+        }
+        return true;
+    }
+    
+    // Поиск записи по UID
+    Record* findRecord(const string& uid) {
+        if (uid.length() != 7) {
+            return nullptr;
+        }
+        return findPacked(packUid(uid));
+    }
+    
+    // Поиск по упакованному ключу, когда длину UID уже проверил вызывающий
+    Record* findPacked(uint64_t key) {
+        uint32_t slot;
+        if (negativeFilter && !negativeFilter->mayContain(key)) {
+            return nullptr;
+        }
+        if (index.find(key, slot)) {
+            return &records[slot];
+        }
+        return nullptr;
+    }
+    
+    // Включение фильтра отрицательного поиска перед индексом: отсутствующие
+    // UID отсекаются без обращения к индексу. Фильтр поддерживает удаление,
+    // поэтому остаётся точным при изменениях базы
+    void enableNegativeFilter(int fingerprintBits = 32) {
+        vector<uint64_t> keys;
+        keys.reserve(liveCount);
+        forEachRecord([&](const Record& record) {
+            keys.push_back(packUid(record.getUid()));
+        });
+        negativeFilter.reset(new QuotientFilter(QuotientFilter::fromKeys(keys, fingerprintBits)));
+    }
+    
+    const QuotientFilter* getNegativeFilter() const {
+        return negativeFilter.get();
+    }
+    
+    // Подключение менеджера эпох: данные от EpochManager::PIN_MIN_BYTES
+    // освобождаются только после снятия закреплений читателей, которые
+    // могли их видеть (nullptr - освобождение сразу)
+    void attachEpochManager(EpochManager* manager) {
+        epochs = manager;
+    }
+    
+    // Подключение потока изменений: каждое изменение после вызова
+    // публикуется в feed (nullptr отключает поток)
+    void attachChangeFeed(ChangeFeed* feed) {
+        changeFeed = feed;
+    }
+    
+    // Применение группы изменений как одного: UID проверяются до первого
+    // изменения, все изменения получают одну версию, поэтому снимок видит
+    // либо весь пакет, либо ничего из него. Возвращает число операций,
+    // изменивших базу
+    size_t applyBatch(const vector<BatchOp>& ops) {
+        validateBatch(ops);
+        ++currentVersion;
+        batchOpen = true;
+        size_t applied = 0;
+        try {
+            for (const BatchOp& op : ops) {
+                if (op.type == BatchOp::INSERT) {
+                    addRecord(Record(op.uid, op.data));
+                    ++applied;
+                } else if (op.type == BatchOp::UPDATE) {
+                    applied += updateRecord(op.uid, op.data);
+                } else {
+                    applied += eraseRecord(op.uid);
+                }
+            }
+        } catch (...) {
+            batchOpen = false;
+            throw;
+        }
+        batchOpen = false;
+        return applied;
+    }
+    
+    // Открытие снимка на текущую версию
+    Snapshot openSnapshot() {
+        ++openSnapshots[currentVersion];
+        return Snapshot(this, currentVersion);
+    }
+    
+    size_t openSnapshotCount() const {
+        size_t total = 0;
+        for (const auto& entry : openSnapshots) {
+            total += entry.second;
+        }
+        return total;
+    }
+    
+    // Число сохранённых прежних версий
+    size_t historySize() const {
+        return historyOrder.size();
+    }
+    
+    // Поиск записи в том виде, в каком она была на момент снимка.
+    // Указатель действителен до следующего изменения базы
+    const Record* findRecord(const string& uid, const Snapshot& snapshot) const {
+        if (uid.length() != 7) {
+            return nullptr;
+        }
+        uint64_t key = packUid(uid);
+        uint32_t slot;
+        if (index.find(key, slot) && versions[slot] <= snapshot.version) {
+            return &records[slot];
+        }
+        auto entry = history.find(key);
+        if (entry != history.end()) {
+            for (const OldVersion& old : entry->second) {
+                if (old.from <= snapshot.version && snapshot.version < old.to) {
+                    return &old.record;
+                }
+            }
+        }
+        return nullptr;
+    }
+    
+    // Обход всех записей, видимых снимку: актуальные записи не новее
+    // снимка и сохранённые версии, действовавшие на его момент
+    template <typename Visitor>
+    void forEachRecord(const Snapshot& snapshot, Visitor visit) const {
+        forEachSlot([&](uint32_t slot) {
+            if (versions[slot] <= snapshot.version) {
+                visit(records[slot]);
+            }
+        });
+        for (const auto& entry : history) {
+            for (const OldVersion& old : entry.second) {
+                if (old.from <= snapshot.version && snapshot.version < old.to) {
+                    visit(old.record);
+                }
+            }
+        }
+    }
+    
+    // Включение вторичного индекса по данным записей (или по полю,
+    // которое возвращает extract); индекс строится по текущим записям
+    void enablePayloadIndex(PayloadIndex::FieldExtractor extract = [](const string& data) {
+        return string_view(data);
+    }) {
+        payloadIndex.reset(new PayloadIndex(move(extract)));
+        forEachSlot([&](uint32_t slot) {
+            payloadIndex->insert(records, slot);
+        });
+    }
+    
+    // Обратный поиск: все записи, у которых поле данных равно value
+    vector<Record*> findByPayload(string_view value) {
+        vector<Record*> result;
+        if (!payloadIndex) {
+            throw logic_error("Индекс по данным не включён");
+        }
+        vector<uint32_t> slots;
+        payloadIndex->find(records, value, slots);
+        for (uint32_t slot : slots) {
+            result.push_back(&records[slot]);
+        }
+        return result;
+    }
+    
+    const PayloadIndex* getPayloadIndex() const {
+        return payloadIndex.get();
+    }
+    
+    // Включение триграммного индекса для поиска по фрагменту данных;
+    // существующие записи индексируются в threads потоков
+    void enableSubstringIndex(unsigned threads = thread::hardware_concurrency()) {
+        vector<uint32_t> slots;
+        slots.reserve(liveCount);
+        forEachSlot([&](uint32_t slot) {
+            slots.push_back(slot);
+        });
+        substringIndex.reset(new TrigramIndex());
+        substringIndex->build(records, slots, threads);
+    }
+    
+    // Все записи, данные которых содержат fragment
+    vector<Record*> findBySubstring(string_view fragment) {
+        vector<Record*> result;
+        vector<uint32_t> candidates;
+        if (substringIndex && substringIndex->candidates(fragment, candidates)) {
+            for (uint32_t slot : candidates) {
+                if (isLiveSlot(slot) && records[slot].getData().find(fragment) != string::npos) {
+                    result.push_back(&records[slot]);
+                }
+            }
+        } else {
+            forEachSlot([&](uint32_t slot) {
+                if (records[slot].getData().find(fragment) != string::npos) {
+                    result.push_back(&records[slot]);
+                }
+            });
+        }
+        return result;
+    }
+    
+    const TrigramIndex* getSubstringIndex() const {
+        return substringIndex.get();
+    }
+    
+    // Слот содержит актуальную запись (для повторно добавленного UID - последнюю)
+    bool isLiveSlot(uint32_t slot) const {
+        uint32_t current;
+        return index.find(packUid(records[slot].getUid()), current) && current == slot;
+    }
+    
+    template <typename Visitor>
+    void forEachSlot(Visitor visit) const {
+        for (size_t slot = 0; slot < records.size(); ++slot) {
+            if (isLiveSlot(static_cast<uint32_t>(slot))) {
+                visit(static_cast<uint32_t>(slot));
+            }
+        }
+    }
+    
+    template <typename Visitor>
+    void forEachRecord(Visitor visit) const {
+        forEachSlot([&](uint32_t slot) {
+            visit(records[slot]);
+        });
+    }
+    
+    // Завершение массовой загрузки: построение замороженных индексов
+    void freeze() {
+        TRACE_SPAN("построение индекса");
+        index.build();
+    }
+    
+    // Число актуальных записей
+    size_t size() const {
+        return liveCount;
+    }
+    
+    const Index& getIndex() const {
+        return index;
+    }
+    
+    
+    void clear() {
+        if (!openSnapshots.empty()) {
+            throw logic_error("Очистка базы при открытых снимках");
+        }
+        for (uint32_t slot = 0; epochs && slot < records.size(); ++slot) {
+            replaceData(slot, string());
+        }
+        records.clear();
+        versions.clear();
+        index.clear();
+        liveCount = 0;
+        if (payloadIndex) {
+            payloadIndex->clear();
+        }
+        if (substringIndex) {
+            substringIndex->clear();
+        }
+        if (negativeFilter) {
+            negativeFilter.reset(new QuotientFilter(1, negativeFilter->getFingerprintBits()));
+        }
+    }
+};
+
+// 16-байтовый UID, упакованный в два 64-битных слова (big-endian)
+struct WideKey {
+    uint64_t hi;
+    uint64_t lo;
+    
+    bool operator==(const WideKey& other) const { return hi == other.hi && lo == other.lo; }
+};
+
+// Таблица записей с UID одной длины Width: ключ упакован в 64-битное
+// слово (Width <= 8) или в WideKey, открытая адресация с линейным
+// пробированием. Слот хранит ключ и номер строки в records; строки
+// удалённых записей используются повторно.
+template <size_t Width>
+class FixedWidthTable {
+private:
+    static_assert(Width >= 1 && Width <= 16, "Ширина UID от 1 до 16 байт");
+    typedef conditional_t<(Width <= 8), uint64_t, WideKey> Key;
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    
+    struct Slot {
+        Key key;
+        uint32_t row;
+    };
+    
+    vector<Slot> slots;
+    vector<Record> records;
+    vector<uint32_t> freeRows;
+    size_t count = 0;
+    
+    static uint64_t packBytes(const char* bytes, size_t length) {
+        uint64_t word = 0;
+        for (size_t i = 0; i < length; ++i) {
+            word = (word << 8) | static_cast<unsigned char>(bytes[i]);
+        }
+        return word;
+    }
+    
+    static Key pack(const string& uid) {
+        if constexpr (Width <= 8) {
+            return packBytes(uid.data(), Width);
+        } else {
+            return WideKey{packBytes(uid.data(), 8), packBytes(uid.data() + 8, Width - 8)};
+        }
+    }
+    
+    static uint64_t hashKey(uint64_t key) { return mixHash(key); }
+    static uint64_t hashKey(const WideKey& key) { return mixHash(key.hi ^ mixHash(key.lo)); }
+    
+    size_t mask() const { return slots.size() - 1; }
+    
+    void place(const Key& key, uint32_t row) {
+        size_t pos = hashKey(key) & mask();
+        while (slots[pos].row != EMPTY) {
+            pos = (pos + 1) & mask();
+        }
+        slots[pos] = {key, row};
+    }
+    
+    void rehash(size_t slotCount) {
+        vector<Slot> old(slotCount, Slot{Key(), EMPTY});
+        old.swap(slots);
+        for (const Slot& slot : old) {
+            if (slot.row != EMPTY) {
+                place(slot.key, slot.row);
+            }
+        }
+    }
+    
+    bool locate(const Key& key, size_t& pos) const {
+        if (slots.empty()) {
+            return false;
+        }
+        for (pos = hashKey(key) & mask(); slots[pos].row != EMPTY; pos = (pos + 1) & mask()) {
+            if (slots[pos].key == key) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+public:
+    void reserve(size_t n) {
+        size_t needed = 16;
+        while (n * 10 > needed * 7) {
+            needed <<= 1;
+        }
+        if (needed > slots.size()) {
+            rehash(needed);
+        }
+        records.reserve(n);
+    }
+    
+    // Добавление записи; запись с тем же UID заменяется
+    void addRecord(Record&& record) {
+        Key key = pack(record.getUid());
+        size_t pos;
+        if (locate(key, pos)) {
+            records[slots[pos].row] = move(record);
+            return;
+        }
+        if ((count + 1) * 10 > slots.size() * 7) {
+            rehash(max<size_t>(slots.size() * 2, 16));
+        }
+        uint32_t row;
+        if (!freeRows.empty()) {
+            row = freeRows.back();
+            freeRows.pop_back();
+            records[row] = move(record);
+        } else {
+            row = static_cast<uint32_t>(records.size());
+            records.push_back(move(record));
+        }
+        place(key, row);
+        ++count;
+    }
+    
+    Record* findRecord(const string& uid) {
+        size_t pos;
+        return locate(pack(uid), pos) ? &records[slots[pos].row] : nullptr;
+    }
+    
+    // Удаление со сдвигом следующих слотов кластера назад
+    bool eraseRecord(const string& uid) {
+        size_t pos;
+        if (!locate(pack(uid), pos)) {
+            return false;
+        }
+        uint32_t row = slots[pos].row;
+        records[row].setData(string());
+        freeRows.push_back(row);
+        size_t hole = pos;
+        for (size_t next = (pos + 1) & mask(); slots[next].row != EMPTY; next = (next + 1) & mask()) {
+            size_t home = hashKey(slots[next].key) & mask();
+            if (((next - home) & mask()) >= ((next - hole) & mask())) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole].row = EMPTY;
+        --count;
+        return true;
+    }
+    
+    size_t size() const { return count; }
+    
+    size_t memoryUsage() const {
+        return slots.size() * sizeof(Slot) + records.capacity() * sizeof(Record);
+    }
+};
+
+// База с UID разной длины: каждая длина хранится в своей таблице с
+// упакованными ключами, 7-байтовые UID - в обычной Database без
+// изменений. Длина проверяется один раз на поиск: 7-байтовый UID
+// ищется по упакованному ключу без повторной проверки в Database.
+template <typename Index = CuckooIndex>
+class MixedWidthDatabase {
+private:
+    Database<Index> narrow;
+    FixedWidthTable<6> width6;
+    FixedWidthTable<8> width8;
+    FixedWidthTable<16> width16;
+    
+public:
+    // Резервирование по ожидаемому числу записей каждой длины
+    void reserve(size_t count6, size_t count7, size_t count8, size_t count16) {
+        width6.reserve(count6);
+        narrow.reserve(count7);
+        width8.reserve(count8);
+        width16.reserve(count16);
+    }
+    
+    // Резервирование без оценки долей: каждой таблице на n записей
+    void reserve(size_t n) {
+        reserve(n, n, n, n);
+    }
+    
+    void addRecord(Record&& record) {
+        switch (record.getUid().length()) {
+            case 7: narrow.addRecord(move(record)); break;
+            case 6: width6.addRecord(move(record)); break;
+            case 8: width8.addRecord(move(record)); break;
+            default: width16.addRecord(move(record)); break;
+        }
+    }
+    
+    Record* findRecord(const string& uid) {
+        switch (uid.length()) {
+            case 7: return narrow.findPacked(packUid(uid));
+            case 6: return width6.findRecord(uid);
+            case 8: return width8.findRecord(uid);
+            case 16: return width16.findRecord(uid);
+            default: return nullptr;
+        }
+    }
+    
+    bool updateRecord(const string& uid, const string& data) {
+        if (uid.length() == 7) {
+            return narrow.updateRecord(uid, data);
+        }
+        Record* record = findRecord(uid);
+        if (record) {
+            record->setData(data);
+        }
+        return record != nullptr;
+    }
+    
+    bool eraseRecord(const string& uid) {
+        switch (uid.length()) {
+            case 7: return narrow.eraseRecord(uid);
+            case 6: return width6.eraseRecord(uid);
+            case 8: return width8.eraseRecord(uid);
+            case 16: return width16.eraseRecord(uid);
+            default: return false;
+        }
+    }
+    
+    size_t size() const {
+        return narrow.size() + width6.size() + width8.size() + width16.size();
+    }
+    
+    // Основная база с 7-байтовыми UID
+    Database<Index>& getNarrow() { return narrow; }
+};
+
+// База, сама выбирающая индекс по наблюдаемой нагрузке. Поиски считаются
+// и каждый SAMPLE_EVERY-й замеряется; фоновый поток раз в interval
+// сравнивает долю записей и промахов с порогами:
+//   - записи прекратились на QUIET_TICKS интервалов - пробная сборка
+//     замороженных индексов (RMI, radix16) и переход на самый быстрый
+//     на недавних UID, если он выигрывает не меньше MIN_GAIN;
+//   - записи возобновились в замороженном индексе - возврат к кукушечному;
+//   - промахов больше MISS_SHARE_FILTER - пробная сборка с фильтром
+//     отрицательного поиска, который включается по тому же правилу MIN_GAIN.
+// Новая база строится по копии записей без блокировки, изменения за
+// время сборки копятся в delta и применяются перед атомарной заменой.
+// Каждое решение записывается в журнал с задержкой поиска до и после.
+class AdaptiveDatabase {
+public:
+    struct Decision {
+        string from;
+        string to;
+        string reason;
+        double beforeNanos = 0.0;  // средняя задержка поиска до решения
+        double afterNanos = 0.0;   // средняя задержка за интервал после
+        double rebuildMillis = 0.0;
+    };
+    
+private:
+    typedef variant<Database<CuckooIndex>, Database<RmiIndex>, Database<RadixIndex<2>>> Store;
+    enum : size_t { CUCKOO = 0, RMI = 1, RADIX = 2 };
+    
+    static constexpr unsigned SAMPLE_EVERY = 32;
+    static constexpr size_t PROBE_RING = 4096;
+    static constexpr uint64_t MIN_SAMPLES = 100;
+    static constexpr size_t MIN_FREEZE_RECORDS = 10000;
+    static constexpr int QUIET_TICKS = 3;
+    static constexpr double WRITE_SHARE_THAW = 0.01;
+    static constexpr double MISS_SHARE_FILTER = 0.5;
+    static constexpr double MIN_GAIN = 0.1;
+    
+    shared_mutex lock;
+    atomic<int> waitingWriters{0};  // shared_mutex в glibc пропускает читателей вперёд писателей
+    shared_ptr<Store> store;
+    bool rebuilding = false;
+    vector<BatchOp> delta;
+    
+    atomic<uint64_t> reads{0};
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> writes{0};
+    atomic<uint64_t> sampledNanos{0};
+    atomic<uint64_t> samples{0};
+    mutex probeLock;
+    vector<string> probes;  // кольцо недавних UID из замеренных поисков
+    size_t probeNext = 0;
+    
+    // Состояние фонового потока
+    chrono::milliseconds interval;
+    int quietTicks = 0;
+    bool freezeRejected = false;
+    bool filterRejected = false;  // до следующей смены индекса
+    int awaitingAfter = -1;  // решение, ждущее замера задержки после
+    mutex logLock;
+    vector<Decision> decisions;
+    
+    mutex stopLock;
+    condition_variable stopWake;
+    bool stopping = false;
+    thread monitor;
+    
+    static const char* layoutName(const Store& s) {
+        return visit([](const auto& db) { return decay_t<decltype(db.getIndex())>::name(); }, s);
+    }
+    
+    template <typename Visitor>
+    auto apply(Visitor visitor) {
+        return visit(visitor, *store);
+    }
+    
+    void write(BatchOp op) {
+        ++waitingWriters;
+        unique_lock<shared_mutex> guard(lock);
+        --waitingWriters;
+        apply([&](auto& db) {
+            db.applyBatch({op});
+        });
+        if (rebuilding) {
+            delta.push_back(move(op));
+        }
+        ++writes;
+    }
+    
+    // Копия актуальных записей; изменения после начала копирования
+    // попадают в delta
+    vector<Record> copyRecords() {
+        {
+            unique_lock<shared_mutex> guard(lock);
+            rebuilding = true;
+            delta.clear();
+        }
+        vector<Record> records;
+        shared_lock<shared_mutex> guard(lock);
+        apply([&](auto& db) {
+            records.reserve(db.size());
+            db.forEachRecord([&](const Record& record) {
+                records.push_back(record);
+            });
+        });
+        return records;
+    }
+    
+    template <size_t Layout>
+    shared_ptr<Store> buildStore(const vector<Record>& records, bool filter) {
+        TRACE_SPAN("перестройка адаптивной базы");
+        auto next = make_shared<Store>(in_place_index<Layout>);
+        auto& db = get<Layout>(*next);
+        db.reserve(records.size());
+        for (const Record& record : records) {
+            db.addRecord(Record(record));
+        }
+        db.freeze();
+        if (filter) {
+            db.enableNegativeFilter();
+        }
+        return next;
+    }
+    
+    // Средняя задержка поиска по недавним UID
+    static double measure(Store& s, const vector<string>& keys, size_t& found) {
+        found = 0;
+        auto start = chrono::steady_clock::now();
+        visit([&](auto& db) {
+            for (const string& uid : keys) {
+                found += db.findRecord(uid) != nullptr;
+            }
+        }, s);
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / max<size_t>(keys.size(), 1);
+    }
+    
+    // Применение накопленных изменений и замена базы
+    void install(shared_ptr<Store> next) {
+        shared_ptr<Store> old;
+        unique_lock<shared_mutex> guard(lock);
+        if (!delta.empty()) {
+            visit([&](auto& db) {
+                db.applyBatch(delta);
+            }, *next);
+        }
+        old = move(store);
+        store = move(next);
+        rebuilding = false;
+        delta.clear();
+        guard.unlock();
+    }
+    
+    void cancelRebuild() {
+        unique_lock<shared_mutex> guard(lock);
+        rebuilding = false;
+        delta.clear();
+    }
+    
+    bool hasFilter() {
+        shared_lock<shared_mutex> guard(lock);
+        return apply([](auto& db) { return db.getNegativeFilter() != nullptr; });
+    }
+    
+    // Запись решения; замер "после" начинается с чистых счётчиков, чтобы
+    // в него не попали поиски, ждавшие замены базы
+    void record(Decision decision) {
+        lock_guard<mutex> guard(logLock);
+        decisions.push_back(move(decision));
+        awaitingAfter = static_cast<int>(decisions.size()) - 1;
+        samples = 0;
+        sampledNanos = 0;
+    }
+    
+    void thaw(double before) {
+        string from;
+        {
+            shared_lock<shared_mutex> guard(lock);
+            from = layoutName(*store);
+        }
+        auto start = chrono::steady_clock::now();
+        bool filter = hasFilter();
+        vector<Record> records = copyRecords();
+        install(buildStore<CUCKOO>(records, filter));
+        filterRejected = false;
+        Decision decision;
+        decision.from = from;
+        decision.to = CuckooIndex::name();
+        decision.reason = "возобновились записи";
+        decision.beforeNanos = before;
+        decision.rebuildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        record(move(decision));
+    }
+    
+    void tryFreeze(double before) {
+        vector<string> keys;
+        {
+            lock_guard<mutex> guard(probeLock);
+            keys = probes;
+        }
+        if (keys.empty()) {
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        bool filter = hasFilter();
+        vector<Record> records = copyRecords();
+        shared_ptr<Store> candidates[] = {buildStore<RMI>(records, filter), buildStore<RADIX>(records, filter)};
+        double current;
+        size_t found, candidateFound;
+        {
+            shared_lock<shared_mutex> guard(lock);
+            current = measure(*store, keys, found);
+        }
+        ostringstream reason;
+        reason << "записей нет " << quietTicks << " интервалов; проба на " << keys.size()
+               << " UID: cuckoo " << fixed << setprecision(1) << current << " нс";
+        // Кандидат должен находить те же UID и выигрывать не меньше MIN_GAIN
+        int best = -1;
+        double bestNanos = current * (1.0 - MIN_GAIN);
+        for (int i = 0; i < 2; ++i) {
+            double nanos = measure(*candidates[i], keys, candidateFound);
+            reason << ", " << layoutName(*candidates[i]) << " " << nanos << " нс";
+            if (candidateFound == found && nanos < bestNanos) {
+                best = i;
+                bestNanos = nanos;
+            }
+        }
+        if (best < 0) {
+            cancelRebuild();
+            freezeRejected = true;
+            cout << "[адаптация] cuckoo оставлен: " << reason.str() << endl;
+            return;
+        }
+        Decision decision;
+        decision.from = CuckooIndex::name();
+        decision.to = layoutName(*candidates[best]);
+        decision.reason = reason.str();
+        decision.beforeNanos = before;
+        install(move(candidates[best]));
+        filterRejected = false;
+        decision.rebuildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        record(move(decision));
+    }
+    
+    // Фильтр строится в фоне на копии базы того же индекса и включается
+    // атомарной заменой, только если ускоряет поиск недавних UID
+    void tryFilter(double before, double missShare) {
+        vector<string> keys;
+        {
+            lock_guard<mutex> guard(probeLock);
+            keys = probes;
+        }
+        if (keys.empty()) {
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        size_t layout;
+        {
+            shared_lock<shared_mutex> guard(lock);
+            layout = store->index();
+        }
+        vector<Record> records = copyRecords();
+        shared_ptr<Store> candidate = layout == CUCKOO ? buildStore<CUCKOO>(records, true)
+                                    : layout == RMI ? buildStore<RMI>(records, true)
+                                    : buildStore<RADIX>(records, true);
+        // Замеры чередуются и берётся лучший из трёх, чтобы сборка копии
+        // не вытеснила из кэша только текущую базу
+        double current = HUGE_VAL, filtered = HUGE_VAL;
+        size_t found = 0, candidateFound = 0;
+        string name;
+        for (int round = 0; round < 3; ++round) {
+            {
+                shared_lock<shared_mutex> guard(lock);
+                current = min(current, measure(*store, keys, found));
+                name = layoutName(*store);
+            }
+            filtered = min(filtered, measure(*candidate, keys, candidateFound));
+        }
+        ostringstream reason;
+        reason << "фильтр отрицательного поиска: промахов " << fixed << setprecision(0) << missShare * 100
+               << "%; проба на " << keys.size() << " UID: без фильтра " << setprecision(1) << current
+               << " нс, с фильтром " << filtered << " нс";
+        if (candidateFound != found || filtered >= current * (1.0 - MIN_GAIN)) {
+            cancelRebuild();
+            filterRejected = true;
+            cout << "[адаптация] " << name << " без фильтра: " << reason.str() << endl;
+            return;
+        }
+        Decision decision;
+        decision.from = decision.to = name;
+        decision.reason = reason.str();
+        decision.beforeNanos = before;
+        install(move(candidate));
+        decision.rebuildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        record(move(decision));
+    }
+    
+    void tick() {
+        uint64_t r = reads.exchange(0), h = hits.exchange(0), w = writes.exchange(0);
+        uint64_t s = samples.exchange(0), ns = sampledNanos.exchange(0);
+        double nanos = s ? static_cast<double>(ns) / s : 0.0;
+        if (awaitingAfter >= 0) {
+            if (s < MIN_SAMPLES) {
+                return;
+            }
+            lock_guard<mutex> guard(logLock);
+            Decision& decision = decisions[awaitingAfter];
+            decision.afterNanos = nanos;
+            cout << "[адаптация] " << decision.from << " -> " << decision.to << ": " << decision.reason
+                 << "; перестройка " << fixed << setprecision(1) << decision.rebuildMillis << " мс, поиск до "
+                 << decision.beforeNanos << " нс, после " << decision.afterNanos << " нс" << endl;
+            awaitingAfter = -1;
+            return;
+        }
+        if (w > 0) {
+            quietTicks = 0;
+            freezeRejected = false;
+        } else {
+            ++quietTicks;
+        }
+        if (s < MIN_SAMPLES) {
+            return;
+        }
+        size_t layout, records;
+        {
+            shared_lock<shared_mutex> guard(lock);
+            layout = store->index();
+            records = apply([](auto& db) { return db.size(); });
+        }
+        if (layout != CUCKOO && w > WRITE_SHARE_THAW * (r + w)) {
+            thaw(nanos);
+        } else if (layout == CUCKOO && quietTicks >= QUIET_TICKS && !freezeRejected && records >= MIN_FREEZE_RECORDS) {
+            tryFreeze(nanos);
+        } else if (r > 0 && r - h > MISS_SHARE_FILTER * r && !filterRejected && !hasFilter()) {
+            tryFilter(nanos, static_cast<double>(r - h) / r);
+        }
+    }
+    
+    void monitorLoop() {
+        unique_lock<mutex> guard(stopLock);
+        while (!stopWake.wait_for(guard, interval, [&]() { return stopping; })) {
+            guard.unlock();
+            tick();
+            guard.lock();
+        }
+    }
+    
+public:
+    explicit AdaptiveDatabase(chrono::milliseconds interval = chrono::milliseconds(200))
+        : store(make_shared<Store>(in_place_index<CUCKOO>)), interval(interval) {
+        monitor = thread(&AdaptiveDatabase::monitorLoop, this);
+    }
+    
+    ~AdaptiveDatabase() {
+        {
+            lock_guard<mutex> guard(stopLock);
+            stopping = true;
+        }
+        stopWake.notify_one();
+        monitor.join();
+    }
+    
+    AdaptiveDatabase(const AdaptiveDatabase&) = delete;
+    AdaptiveDatabase& operator=(const AdaptiveDatabase&) = delete;
+    
+    void addRecord(const Record& record) {
+        write({BatchOp::INSERT, record.getUid(), record.getData()});
+    }
+    
+    void updateRecord(const string& uid, const string& data) {
+        write({BatchOp::UPDATE, uid, data});
+    }
+    
+    void eraseRecord(const string& uid) {
+        write({BatchOp::ERASE, uid, string()});
+    }
+    
+    // Поиск с копированием данных: после возврата база может быть заменена
+    bool findRecord(const string& uid, string& data) {
+        bool sampled = reads.fetch_add(1, memory_order_relaxed) % SAMPLE_EVERY == 0;
+        auto start = sampled ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+        bool found;
+        while (waitingWriters.load(memory_order_relaxed) > 0) {
+            this_thread::yield();
+        }
+        {
+            shared_lock<shared_mutex> guard(lock);
+            found = apply([&](auto& db) {
+                Record* record = db.findRecord(uid);
+                if (record) {
+                    data = record->getData();
+                }
+                return record != nullptr;
+            });
+        }
+        if (found) {
+            hits.fetch_add(1, memory_order_relaxed);
+        }
+        if (sampled) {
+            sampledNanos += static_cast<uint64_t>(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+            ++samples;
+            lock_guard<mutex> guard(probeLock);
+            if (probes.size() < PROBE_RING) {
+                probes.push_back(uid);
+            } else {
+                probes[probeNext++ % PROBE_RING] = uid;
+            }
+        }
+        return found;
+    }
+    
+    size_t size() {
+        shared_lock<shared_mutex> guard(lock);
+        return apply([](auto& db) { return db.size(); });
+    }
+    
+    string layout() {
+        shared_lock<shared_mutex> guard(lock);
+        return layoutName(*store);
+    }
+    
+    vector<Decision> getDecisions() {
+        lock_guard<mutex> guard(logLock);
+        return decisions;
+    }
+};
+
+// Генератор случайных UID (по умолчанию 7 байт)
+class UidGenerator {
+private:
+    random_device rd;
+    mt19937 gen;
+    uniform_int_distribution<int> dist;
+    
+public:
+    UidGenerator() : gen(rd()), dist(0, 255) {}
+    
+    string generateUid(size_t length = 7) {
+        string uid;
+        uid.reserve(length);
+        
+        for (size_t i = 0; i < length; ++i) {
+            uid += static_cast<char>(dist(gen));
+        }
+        
+        return uid;
+    }
+};
+
+// Двоичная сериализация: числа пишутся в порядке байт машины (x86 - little-endian)
+template <typename T>
+inline void putValue(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Последовательное чтение двоичных данных с проверкой границ
+class ByteReader {
+private:
+    const char* pos;
+    const char* end;
+    
+public:
+    ByteReader(const char* data, size_t size) : pos(data), end(data + size) {}
+    
+    template <typename T>
+    T get() {
+        if (remaining() < sizeof(T)) {
+            throw runtime_error("Повреждённые данные: неожиданный конец");
+        }
+        T value;
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    
+    string getBytes(size_t n) {
+        if (remaining() < n) {
+            throw runtime_error("Повреждённые данные: неожиданный конец");
+        }
+        string bytes(pos, n);
+        pos += n;
+        return bytes;
+    }
+    
+    size_t remaining() const { return end - pos; }
+    bool atEnd() const { return pos == end; }
+};
+
+// CRC32C (полином Кастаньоли). Аппаратная версия использует инструкцию
+// crc32 из SSE4.2 и выбирается во время выполнения; программная -
+// табличная, по 8 байт за шаг. Обе принимают и возвращают готовое
+// значение CRC, поэтому вычисление можно продолжать по частям.
+class Crc32c {
+private:
+    uint32_t table[8][256];
+    
+    Crc32c() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int t = 1; t < 8; ++t) {
+                table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+            }
+        }
+    }
+    
+    static const Crc32c& instance() {
+        static const Crc32c tables;
+        return tables;
+    }
+    
+public:
+    static uint32_t software(uint32_t crc, const char* data, size_t size) {
+        const auto& t = instance().table;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        crc = ~crc;
+        for (; size >= 8; size -= 8, p += 8) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            word ^= crc;
+            crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^ t[5][(word >> 16) & 0xFF]
+                ^ t[4][(word >> 24) & 0xFF] ^ t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF]
+                ^ t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+        }
+        for (; size > 0; --size, ++p) {
+            crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+        }
+        return ~crc;
+    }
+    
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    static uint32_t hardware(uint32_t crc, const char* data, size_t size) {
+        uint64_t state = ~crc;
+        for (; size >= 8; size -= 8, data += 8) {
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+            state = _mm_crc32_u64(state, word);
+        }
+        uint32_t crc32 = static_cast<uint32_t>(state);
+        for (; size > 0; --size, ++data) {
+            crc32 = _mm_crc32_u8(crc32, static_cast<unsigned char>(*data));
+        }
+        return ~crc32;
+    }
+    
+    static bool hasHardware() {
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+    }
+#else
+    static uint32_t hardware(uint32_t crc, const char* data, size_t size) {
+        return software(crc, data, size);
+    }
+    
+    static bool hasHardware() { return false; }
+#endif
+    
+    static uint32_t compute(const char* data, size_t size, uint32_t crc = 0) {
+        return hasHardware() ? hardware(crc, data, size) : software(crc, data, size);
+    }
+};
+
+// Контрольные суммы CRC32C по блокам фиксированного размера.
+// Завершение снимка: CRC каждого блока (u32), u64 размер блока,
+// u64 число блоков, "UIDCRC1\0". Защищаются все байты до этого завершения.
+const char CHECKSUM_MAGIC[8] = {'U', 'I', 'D', 'C', 'R', 'C', '1', '\0'};
+constexpr uint64_t CHECKSUM_BLOCK_SIZE = 64 * 1024;
+
+// Параллельный расчёт контрольных сумм блоков: потоки берут блоки
+// через общий счётчик
+vector<uint32_t> computeBlockChecksums(const char* data, size_t size, uint64_t blockSize,
+                                       unsigned threadCount) {
+    size_t blocks = (size + blockSize - 1) / blockSize;
+    vector<uint32_t> crcs(blocks);
+    atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t block; (block = next.fetch_add(1)) < blocks;) {
+            size_t begin = block * blockSize;
+            crcs[block] = Crc32c::compute(data + begin, min<size_t>(blockSize, size - begin));
+        }
+    };
+    vector<thread> threads;
+    for (unsigned i = 1; i < max(threadCount, 1u); ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (thread& t : threads) {
+        t.join();
+    }
+    return crcs;
+}
+
+// Разбор завершения с контрольными суммами; false - его нет
+bool parseChecksumFooter(const char* data, size_t size, uint64_t& blockSize,
+                         vector<uint32_t>& crcs, size_t& dataSize) {
+    const size_t TAIL = 2 * sizeof(uint64_t) + sizeof(CHECKSUM_MAGIC);
+    if (size < TAIL || memcmp(data + size - sizeof(CHECKSUM_MAGIC), CHECKSUM_MAGIC, sizeof(CHECKSUM_MAGIC)) != 0) {
+        return false;
+    }
+    uint64_t blocks;
+    memcpy(&blockSize, data + size - TAIL, sizeof(blockSize));
+    memcpy(&blocks, data + size - TAIL + sizeof(uint64_t), sizeof(blocks));
+    if (blockSize == 0 || blocks > (size - TAIL) / sizeof(uint32_t)) {
+        throw runtime_error("Повреждённое завершение контрольных сумм");
+    }
+    dataSize = size - TAIL - blocks * sizeof(uint32_t);
+    if ((dataSize + blockSize - 1) / blockSize != blocks) {
+        throw runtime_error("Повреждённое завершение контрольных сумм");
+    }
+    crcs.resize(blocks);
+    memcpy(crcs.data(), data + dataSize, blocks * sizeof(uint32_t));
+    return true;
+}
+
+// Поток записи, считающий CRC блоков по мере записи
+class ChecksummingWriter {
+private:
+    ostream& out;
+    uint64_t blockSize;
+    uint64_t inBlock = 0;
+    uint32_t crc = 0;
+    vector<uint32_t> crcs;
+    
+public:
+    explicit ChecksummingWriter(ostream& out, uint64_t blockSize = CHECKSUM_BLOCK_SIZE)
+        : out(out), blockSize(blockSize) {}
+    
+    void write(const char* data, size_t size) {
+        out.write(data, size);
+        while (size > 0) {
+            size_t chunk = min<size_t>(size, blockSize - inBlock);
+            crc = Crc32c::compute(data, chunk, crc);
+            data += chunk;
+            size -= chunk;
+            inBlock += chunk;
+            if (inBlock == blockSize) {
+                crcs.push_back(crc);
+                crc = 0;
+                inBlock = 0;
+            }
+        }
+    }
+    
+    template <typename T>
+    void writeValue(T value) {
+        write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    
+    // Запись завершения с контрольными суммами
+    void finish() {
+        if (inBlock > 0) {
+            crcs.push_back(crc);
+        }
+        string footer(reinterpret_cast<const char*>(crcs.data()), crcs.size() * sizeof(uint32_t));
+        putValue<uint64_t>(footer, blockSize);
+        putValue<uint64_t>(footer, crcs.size());
+        footer.append(CHECKSUM_MAGIC, sizeof(CHECKSUM_MAGIC));
+        out.write(footer.data(), footer.size());
+    }
+};
+
+// Журнал упреждающей записи (WAL). Формат записи:
+//   u32 длина остатка записи, u32 CRC32C остатка, u64 LSN, u8 операция,
+//   7 байт UID, данные.
+// Пакет (WAL_BATCH) - одна запись с нулевым UID, данные которой содержат
+// операции пакета: u8 операция, 7 байт UID, u32 длина данных, данные.
+// Блоком проверки целостности в журнале служит сама запись: журнал
+// только дописывается, и CRC проверяется при разборе каждой записи.
+// Журнал целиком хранится в памяти (для отправки репликам) и при
+// указании пути дописывается в файл.
+enum WalOp : uint8_t {
+    WAL_INSERT = 1,
+    WAL_UPDATE = 2,
+    WAL_ERASE = 3,
+    WAL_BATCH = 4
+};
+
+struct WalEntry {
+    uint64_t lsn;
+    uint8_t op;
+    string uid;
+    string data;
+};
+
+class WriteAheadLog {
+private:
+    static constexpr size_t ENTRY_HEADER = sizeof(uint64_t) + sizeof(uint8_t) + 7;
+    
+    string buffer;
+    vector<size_t> entryOffsets;  // смещение записи с LSN = i + 1
+    uint64_t lastLsn = 0;
+    FILE* file = nullptr;
+    
+public:
+    explicit WriteAheadLog(const string& path = "") {
+        if (!path.empty()) {
+            file = fopen(path.c_str(), "ab");
+            if (!file) {
+                throw runtime_error("Не удалось открыть журнал " + path);
+            }
+        }
+    }
+    
+    ~WriteAheadLog() {
+        if (file) {
+            fclose(file);
+        }
+    }
+    
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    
+    uint64_t append(uint8_t op, const string& uid, const string& data) {
+        size_t start = buffer.size();
+        putValue<uint32_t>(buffer, static_cast<uint32_t>(ENTRY_HEADER + data.size()));
+        putValue<uint32_t>(buffer, 0);
+        putValue<uint64_t>(buffer, ++lastLsn);
+        putValue<uint8_t>(buffer, op);
+        buffer.append(uid, 0, 7);
+        buffer.append(data);
+        size_t body = start + 2 * sizeof(uint32_t);
+        uint32_t crc = Crc32c::compute(buffer.data() + body, buffer.size() - body);
+        memcpy(&buffer[start + sizeof(uint32_t)], &crc, sizeof(crc));
+        entryOffsets.push_back(start);
+        if (file) {
+            fwrite(buffer.data() + start, 1, buffer.size() - start, file);
+        }
+        return lastLsn;
+    }
+    
+    // Сброс файла журнала на диск
+    void sync() {
+        if (file) {
+            fflush(file);
+            fsync(fileno(file));
+        }
+    }
+    
+    uint64_t getLastLsn() const { return lastLsn; }
+    size_t sizeBytes() const { return buffer.size(); }
+    
+    // Смещение первой записи, следующей за lsn
+    size_t offsetAfter(uint64_t lsn) const {
+        return lsn < entryOffsets.size() ? entryOffsets[lsn] : buffer.size();
+    }
+    
+    // Не более maxBytes журнала начиная с offset, только целые записи
+    // (одна запись возвращается всегда, даже если она больше maxBytes)
+    string read(size_t offset, size_t maxBytes) const {
+        size_t end = offset;
+        while (end < buffer.size()) {
+            uint32_t length;
+            memcpy(&length, buffer.data() + end, sizeof(length));
+            size_t next = end + 2 * sizeof(uint32_t) + length;
+            if (next - offset > maxBytes && end > offset) {
+                break;
+            }
+            end = next;
+        }
+        return buffer.substr(offset, end - offset);
+    }
+    
+    static void decode(const char* data, size_t size, vector<WalEntry>& entries) {
+        ByteReader reader(data, size);
+        while (!reader.atEnd()) {
+            uint32_t length = reader.get<uint32_t>();
+            uint32_t crc = reader.get<uint32_t>();
+            if (length < ENTRY_HEADER || length > reader.remaining()) {
+                throw runtime_error("Повреждённая запись журнала");
+            }
+            const char* body = data + (size - reader.remaining());
+            if (Crc32c::compute(body, length) != crc) {
+                throw runtime_error("Несовпадение CRC записи журнала");
+            }
+            WalEntry entry;
+            entry.lsn = reader.get<uint64_t>();
+            entry.op = reader.get<uint8_t>();
+            entry.uid = reader.getBytes(7);
+            entry.data = reader.getBytes(length - ENTRY_HEADER);
+            entries.push_back(move(entry));
+        }
+    }
+};
+
+string encodeBatch(const vector<BatchOp>& ops) {
+    string data;
+    for (const BatchOp& op : ops) {
+        putValue<uint8_t>(data, op.type);
+        data.append(op.uid, 0, 7);
+        putValue<uint32_t>(data, static_cast<uint32_t>(op.data.size()));
+        data.append(op.data);
+    }
+    return data;
+}
+
+vector<BatchOp> decodeBatch(const string& data) {
+    vector<BatchOp> ops;
+    ByteReader reader(data.data(), data.size());
+    while (!reader.atEnd()) {
+        BatchOp op;
+        op.type = static_cast<BatchOp::Type>(reader.get<uint8_t>());
+        op.uid = reader.getBytes(7);
+        op.data = reader.getBytes(reader.get<uint32_t>());
+        ops.push_back(move(op));
+    }
+    return ops;
+}
+
+template <typename Index>
+void applyWalEntry(Database<Index>& db, WalEntry& entry) {
+    switch (entry.op) {
+    case WAL_BATCH:
+        db.applyBatch(decodeBatch(entry.data));
+        break;
+    case WAL_INSERT:
+        db.addRecord(Record(entry.uid, entry.data));
+        break;
+    case WAL_UPDATE:
+        db.updateRecord(entry.uid, entry.data);
+        break;
+    case WAL_ERASE:
+        db.eraseRecord(entry.uid);
+        break;
+    default:
+        throw runtime_error("Неизвестная операция журнала: " + to_string(entry.op));
+    }
+}
+
+// База, разделённая на сегменты по хэшу ключа, для одновременной работы
+// читателей и писателей. У каждого сегмента своя блокировка чтения-записи.
+// Пакет раскладывается по сегментам, блокирует только затронутые сегменты
+// (в порядке их номеров order, чтобы встречные пакеты не взаимоблокировались)
+// и пишется в журнал одной записью WAL_BATCH до применения.
+//
+// Пространство хэшей поделено на ROUTE_BUCKETS корзин, сегмент владеет
+// непрерывным диапазоном корзин, поэтому сегменты можно делить и сливать
+// на ходу (splitShard, mergeShards). Миграция копирует записи в новые
+// сегменты в фоне; пока она идёт, таблица pending указывает для корзин
+// сегмент-получатель, и писатели применяют изменения к обоим сегментам.
+// Переключение route на новые сегменты происходит под блокировками всех
+// участников. Читатель, захватив сегмент, перепроверяет маршрут и при
+// смене повторяет поиск, поэтому ключ виден всё время миграции.
+template <typename Index>
+class ShardedDatabase {
+public:
+    static constexpr size_t ROUTE_BUCKETS = 4096;
+    
+    // Итоги миграции для журнала и замеров
+    struct ReshardStats {
+        size_t copied = 0;       // записей скопировано в фоне
+        double copyMillis = 0.0;
+        double cutoverMillis = 0.0;  // переключение под блокировками
+    };
+    
+private:
+    struct Shard {
+        shared_mutex lock;
+        Database<Index> db;
+        uint64_t order;  // порядок захвата блокировок: новые сегменты позже
+        uint32_t low, high;  // корзины [low, high)
+        
+        Shard(uint64_t order, uint32_t low, uint32_t high) : order(order), low(low), high(high) {}
+    };
+    
+    // Сегменты не удаляются: читатель мог получить указатель на сегмент
+    // до переключения. Данные выведенного сегмента освобождаются сразу
+    // после переключения
+    vector<unique_ptr<Shard>> allShards;
+    unique_ptr<atomic<Shard*>[]> route;    // владелец корзины
+    unique_ptr<atomic<Shard*>[]> pending;  // получатель при миграции или nullptr
+    mutex topologyLock;
+    vector<Shard*> live;  // действующие сегменты по возрастанию корзин
+    mutex reshardLock;    // одна миграция за раз
+    uint64_t nextOrder = 0;
+    ChangeFeed* changeFeed = nullptr;
+    mutex walLock;
+    WriteAheadLog wal;
+    
+    static uint32_t bucketOf(const string& uid) {
+        return fastRange(static_cast<uint32_t>(mixHash(packUid(uid)) >> 32), ROUTE_BUCKETS);
+    }
+    
+    static bool byOrder(const Shard* a, const Shard* b) {
+        return a->order < b->order;
+    }
+    
+    static void sortShards(vector<Shard*>& shards) {
+        sort(shards.begin(), shards.end(), byOrder);
+        shards.erase(unique(shards.begin(), shards.end()), shards.end());
+    }
+    
+    Shard* newShard(uint32_t low, uint32_t high) {
+        allShards.emplace_back(new Shard(nextOrder++, low, high));
+        return allShards.back().get();
+    }
+    
+    vector<Shard*> liveShards() {
+        lock_guard<mutex> guard(topologyLock);
+        return live;
+    }
+    
+    // Перенос корзин sources в targets: двойная запись, фоновое
+    // копирование, переключение. Вызывается под reshardLock
+    ReshardStats migrate(const vector<Shard*>& sources, const vector<Shard*>& targets) {
+        TRACE_SPAN("миграция сегментов");
+        ReshardStats stats;
+        vector<Shard*> all(sources);
+        all.insert(all.end(), targets.begin(), targets.end());
+        sortShards(all);
+        
+        // С этого момента каждое изменение в sources дублируется в targets
+        {
+            vector<unique_lock<shared_mutex>> guards;
+            for (Shard* shard : sources) {
+                guards.emplace_back(shard->lock);
+            }
+            for (Shard* target : targets) {
+                for (uint32_t b = target->low; b < target->high; ++b) {
+                    pending[b].store(target, memory_order_release);
+                }
+            }
+        }
+        
+        // Копирование порциями: источник блокируется на чтение, поэтому
+        // писатели источника ждут не дольше одной порции, а читатели не ждут.
+        // Ключ, уже попавший в получатель двойной записью, не перезаписывается:
+        // под блокировкой источника его значения в обоих сегментах совпадают.
+        // Ключи, добавленные после сбора списка, приходят двойной записью
+        const size_t CHUNK = 1024;
+        auto copyStart = chrono::steady_clock::now();
+        for (Shard* source : sources) {
+            vector<string> uids;
+            {
+                shared_lock<shared_mutex> guard(source->lock);
+                uids.reserve(source->db.size());
+                source->db.forEachRecord([&](const Record& record) {
+                    uids.push_back(record.getUid());
+                });
+            }
+            for (size_t begin = 0; begin < uids.size(); begin += CHUNK) {
+                shared_lock<shared_mutex> sourceGuard(source->lock);
+                vector<unique_lock<shared_mutex>> guards;
+                for (Shard* target : targets) {
+                    guards.emplace_back(target->lock);
+                }
+                size_t end = min(begin + CHUNK, uids.size());
+                for (size_t i = begin; i < end; ++i) {
+                    Record* record = source->db.findRecord(uids[i]);
+                    Shard* target = pending[bucketOf(uids[i])].load(memory_order_relaxed);
+                    if (record && !target->db.findRecord(uids[i])) {
+                        target->db.addRecord(Record(uids[i], record->getData()));
+                        ++stats.copied;
+                    }
+                }
+            }
+        }
+        stats.copyMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - copyStart).count();
+        
+        // Данные выведенных сегментов освобождаются после снятия блокировок
+        vector<Database<Index>> retired;
+        auto cutoverStart = chrono::steady_clock::now();
+        vector<unique_lock<shared_mutex>> guards;
+        for (Shard* shard : all) {
+            guards.emplace_back(shard->lock);
+        }
+        for (Shard* target : targets) {
+            for (uint32_t b = target->low; b < target->high; ++b) {
+                route[b].store(target, memory_order_release);
+                pending[b].store(nullptr, memory_order_release);
+            }
+            target->db.attachChangeFeed(changeFeed);
+        }
+        {
+            lock_guard<mutex> guard(topologyLock);
+            auto first = find(live.begin(), live.end(), sources.front());
+            size_t position = first - live.begin();
+            live.erase(first, first + sources.size());
+            live.insert(live.begin() + position, targets.begin(), targets.end());
+        }
+        for (Shard* source : sources) {
+            retired.push_back(move(source->db));
+            source->db = Database<Index>();
+        }
+        guards.clear();
+        stats.cutoverMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - cutoverStart).count();
+        return stats;
+    }
+    
+public:
+    explicit ShardedDatabase(size_t shardCount, const string& walPath = "")
+        : route(new atomic<Shard*>[ROUTE_BUCKETS]), pending(new atomic<Shard*>[ROUTE_BUCKETS]), wal(walPath) {
+        if (shardCount == 0 || shardCount > ROUTE_BUCKETS) {
+            throw invalid_argument("Число сегментов должно быть от 1 до " + to_string(ROUTE_BUCKETS));
+        }
+        for (size_t i = 0; i < shardCount; ++i) {
+            Shard* shard = newShard(static_cast<uint32_t>(i * ROUTE_BUCKETS / shardCount),
+                                    static_cast<uint32_t>((i + 1) * ROUTE_BUCKETS / shardCount));
+            for (uint32_t b = shard->low; b < shard->high; ++b) {
+                route[b].store(shard, memory_order_relaxed);
+                pending[b].store(nullptr, memory_order_relaxed);
+            }
+            live.push_back(shard);
+        }
+    }
+    
+    // Атомарное применение пакета: читатели затронутых сегментов видят
+    // либо состояние до пакета, либо после. Возвращает LSN записи журнала
+    uint64_t applyBatch(vector<BatchOp> ops) {
+        TRACE_SPAN("пакет записи");
+        validateBatch(ops);
+        string encoded = encodeBatch(ops);
+        vector<uint32_t> buckets(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i) {
+            buckets[i] = bucketOf(ops[i].uid);
+        }
+        
+        // Сегменты определяются до блокировки и перепроверяются после:
+        // если миграция успела начаться или завершиться, попытка повторяется
+        vector<Shard*> owners(ops.size()), copies(ops.size());
+        for (;;) {
+            vector<Shard*> touched;
+            for (size_t i = 0; i < ops.size(); ++i) {
+                owners[i] = route[buckets[i]].load(memory_order_acquire);
+                copies[i] = pending[buckets[i]].load(memory_order_acquire);
+                touched.push_back(owners[i]);
+                if (copies[i]) {
+                    touched.push_back(copies[i]);
+                }
+            }
+            sortShards(touched);
+            vector<unique_lock<shared_mutex>> guards;
+            for (Shard* shard : touched) {
+                guards.emplace_back(shard->lock);
+            }
+            bool stable = true;
+            for (size_t i = 0; i < ops.size() && stable; ++i) {
+                stable = route[buckets[i]].load(memory_order_acquire) == owners[i] &&
+                         pending[buckets[i]].load(memory_order_acquire) == copies[i];
+            }
+            if (!stable) {
+                continue;
+            }
+            
+            // Порядок операций над одним ключом сохраняется, так как ключ
+            // всегда попадает в один сегмент (и в одного получателя)
+            vector<vector<BatchOp>> perShard(touched.size());
+            auto slotOf = [&](Shard* shard) {
+                return lower_bound(touched.begin(), touched.end(), shard, byOrder) - touched.begin();
+            };
+            for (size_t i = 0; i < ops.size(); ++i) {
+                if (copies[i]) {
+                    perShard[slotOf(copies[i])].push_back(ops[i]);
+                }
+                perShard[slotOf(owners[i])].push_back(move(ops[i]));
+            }
+            uint64_t lsn;
+            {
+                lock_guard<mutex> guard(walLock);
+                lsn = wal.append(WAL_BATCH, string(7, '\0'), encoded);
+            }
+            for (size_t shard = 0; shard < touched.size(); ++shard) {
+                if (!perShard[shard].empty()) {
+                    touched[shard]->db.applyBatch(perShard[shard]);
+                }
+            }
+            return lsn;
+        }
+    }
+    
+    // Чтение одной записи; данные копируются под блокировкой сегмента
+    bool findRecord(const string& uid, string& data) {
+        if (uid.length() != 7) {
+            return false;
+        }
+        atomic<Shard*>& owner = route[bucketOf(uid)];
+        for (;;) {
+            Shard* shard = owner.load(memory_order_acquire);
+            shared_lock<shared_mutex> guard(shard->lock);
+            if (owner.load(memory_order_acquire) != shard) {
+                continue;
+            }
+            Record* record = shard->db.findRecord(uid);
+            if (!record) {
+                return false;
+            }
+            data = record->getData();
+            return true;
+        }
+    }
+    
+    // Согласованное чтение группы UID: все нужные сегменты блокируются
+    // на чтение одновременно, поэтому пакет виден группе целиком или
+    // не виден вовсе. visit(uid, const Record*) получает nullptr для
+    // отсутствующих записей
+    template <typename Visitor>
+    void readConsistent(const vector<string>& uids, Visitor visit) {
+        vector<Shard*> owners(uids.size(), nullptr);
+        for (;;) {
+            vector<Shard*> touched;
+            for (size_t i = 0; i < uids.size(); ++i) {
+                if (uids[i].length() == 7) {
+                    owners[i] = route[bucketOf(uids[i])].load(memory_order_acquire);
+                    touched.push_back(owners[i]);
+                }
+            }
+            sortShards(touched);
+            vector<shared_lock<shared_mutex>> guards;
+            for (Shard* shard : touched) {
+                guards.emplace_back(shard->lock);
+            }
+            bool stable = true;
+            for (size_t i = 0; i < uids.size() && stable; ++i) {
+                stable = !owners[i] || route[bucketOf(uids[i])].load(memory_order_acquire) == owners[i];
+            }
+            if (!stable) {
+                continue;
+            }
+            for (size_t i = 0; i < uids.size(); ++i) {
+                visit(uids[i], owners[i] ? owners[i]->db.findRecord(uids[i]) : nullptr);
+            }
+            return;
+        }
+    }
+    
+    // Число записей по действующим сегментам; сегменты блокируются разом,
+    // чтобы идущее переключение не учло записи дважды
+    size_t size() {
+        for (;;) {
+            vector<Shard*> shards = liveShards();
+            vector<Shard*> ordered(shards);
+            sortShards(ordered);
+            vector<shared_lock<shared_mutex>> guards;
+            for (Shard* shard : ordered) {
+                guards.emplace_back(shard->lock);
+            }
+            if (shards != liveShards()) {
+                continue;
+            }
+            size_t total = 0;
+            for (Shard* shard : shards) {
+                total += shard->db.size();
+            }
+            return total;
+        }
+    }
+    
+    size_t shardCount() {
+        lock_guard<mutex> guard(topologyLock);
+        return live.size();
+    }
+    
+    // Число записей в каждом действующем сегменте по порядку корзин
+    vector<size_t> shardSizes() {
+        vector<size_t> sizes;
+        for (Shard* shard : liveShards()) {
+            shared_lock<shared_mutex> guard(shard->lock);
+            sizes.push_back(shard->db.size());
+        }
+        return sizes;
+    }
+    
+    // Деление сегмента position (по порядку корзин) пополам по корзинам
+    ReshardStats splitShard(size_t position) {
+        lock_guard<mutex> guard(reshardLock);
+        vector<Shard*> shards = liveShards();
+        if (position >= shards.size()) {
+            throw out_of_range("Нет сегмента " + to_string(position));
+        }
+        Shard* source = shards[position];
+        if (source->high - source->low < 2) {
+            throw invalid_argument("Сегмент из одной корзины нельзя разделить");
+        }
+        uint32_t middle = source->low + (source->high - source->low) / 2;
+        return migrate({source}, {newShard(source->low, middle), newShard(middle, source->high)});
+    }
+    
+    // Слияние соседних сегментов position и position + 1
+    ReshardStats mergeShards(size_t position) {
+        lock_guard<mutex> guard(reshardLock);
+        vector<Shard*> shards = liveShards();
+        if (position + 1 >= shards.size()) {
+            throw out_of_range("Нет пары сегментов " + to_string(position) + ", " + to_string(position + 1));
+        }
+        return migrate({shards[position], shards[position + 1]},
+                       {newShard(shards[position]->low, shards[position + 1]->high)});
+    }
+    
+    // Поток изменений общий для всех сегментов: сегменты публикуют в него
+    // одновременно из разных потоков. Получатели миграции подключаются
+    // при переключении, поэтому копирование и двойная запись в поток не идут
+    void attachChangeFeed(ChangeFeed* feed) {
+        lock_guard<mutex> reshardGuard(reshardLock);
+        changeFeed = feed;
+        for (Shard* shard : liveShards()) {
+            unique_lock<shared_mutex> guard(shard->lock);
+            shard->db.attachChangeFeed(feed);
+        }
+    }
+    
+    // Журнал пакетов начиная с начала (для реплик и проверки восстановления)
+    string readWal() {
+        lock_guard<mutex> guard(walLock);
+        return wal.read(0, wal.sizeBytes());
+    }
+    
+    void sync() {
+        lock_guard<mutex> guard(walLock);
+        wal.sync();
+    }
+};
+
+// Снимок базы данных. Формат:
+//   "UIDSNAP1", u64 LSN, u64 число записей N,
+//   N упакованных ключей (по возрастанию), N + 1 смещений данных, данные,
+//   завершение с CRC32C блоков (см. ChecksummingWriter).
+// Ключи и смещения - массивы фиксированной ширины, поэтому снимок можно
+// искать двоичным поиском без разбора, например после mmap.
+const char SNAPSHOT_MAGIC[8] = {'U', 'I', 'D', 'S', 'N', 'A', 'P', '1'};
+
+template <typename Index>
+void writeSnapshot(const Database<Index>& db, uint64_t lsn, ostream& out) {
+    TRACE_SPAN("запись снимка");
+    vector<pair<uint64_t, const Record*>> live;
+    live.reserve(db.size());
+    db.forEachRecord([&](const Record& record) {
+        live.emplace_back(packUid(record.getUid()), &record);
+    });
+    sort(live.begin(), live.end(),
+         [](const pair<uint64_t, const Record*>& a, const pair<uint64_t, const Record*>& b) {
+             return a.first < b.first;
+         });
+    
+    ChecksummingWriter writer(out);
+    writer.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writer.writeValue<uint64_t>(lsn);
+    writer.writeValue<uint64_t>(live.size());
+    
+    for (const auto& entry : live) {
+        writer.writeValue<uint64_t>(entry.first);
+    }
+    uint64_t offset = 0;
+    writer.writeValue<uint64_t>(offset);
+    for (const auto& entry : live) {
+        offset += entry.second->getData().size();
+        writer.writeValue<uint64_t>(offset);
+    }
+    for (const auto& entry : live) {
+        writer.write(entry.second->getData().data(), entry.second->getData().size());
+    }
+    writer.finish();
+    if (!out) {
+        throw runtime_error("Ошибка записи снимка");
+    }
+}
+
+// Загрузка снимка в пустую базу; возвращает LSN снимка. Снимок читается
+// целиком, поэтому все блоки проверяются сразу, параллельно.
+template <typename Index>
+uint64_t loadSnapshot(Database<Index>& db, const char* data, size_t size) {
+    TRACE_SPAN("загрузка снимка");
+    uint64_t blockSize;
+    vector<uint32_t> expected;
+    size_t dataSize;
+    if (parseChecksumFooter(data, size, blockSize, expected, dataSize)) {
+        if (computeBlockChecksums(data, dataSize, blockSize, thread::hardware_concurrency()) != expected) {
+            throw runtime_error("Несовпадение контрольной суммы снимка");
+        }
+        size = dataSize;
+    }
+    
+    ByteReader reader(data, size);
+    if (reader.getBytes(sizeof(SNAPSHOT_MAGIC)) != string(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))) {
+        throw runtime_error("Неверный формат снимка");
+    }
+    uint64_t lsn = reader.get<uint64_t>();
+    uint64_t count = reader.get<uint64_t>();
+    if (count > reader.remaining() / (2 * sizeof(uint64_t))) {
+        throw runtime_error("Повреждённый снимок: неверное число записей");
+    }
+    
+    const char* keys = data + (size - reader.remaining());
+    reader.getBytes(count * sizeof(uint64_t));
+    const char* offsets = keys + count * sizeof(uint64_t);
+    reader.getBytes((count + 1) * sizeof(uint64_t));
+    const char* payload = offsets + (count + 1) * sizeof(uint64_t);
+    
+    db.clear();
+    db.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t key, begin, end;
+        memcpy(&key, keys + i * sizeof(uint64_t), sizeof(key));
+        memcpy(&begin, offsets + i * sizeof(uint64_t), sizeof(begin));
+        memcpy(&end, offsets + (i + 1) * sizeof(uint64_t), sizeof(end));
+        if (begin > end || end > reader.remaining()) {
+            throw runtime_error("Повреждённый снимок: неверное смещение данных");
+        }
+        db.addRecord(Record(unpackUid(key), string(payload + begin, end - begin)));
+    }
+    db.freeze();
+    return lsn;
+}
+
+template <typename Index>
+uint64_t loadSnapshotFile(Database<Index>& db, const string& path) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        throw runtime_error("Не удалось открыть снимок " + path);
+    }
+    string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    return loadSnapshot(db, contents.data(), contents.size());
+}
+
+// Снимок, отображённый в память через mmap: поиск двоичным поиском прямо
+// по массиву ключей без загрузки в Database. Контрольные суммы блоков
+// проверяются лениво - при первом обращении к блоку, поэтому открытие
+// снимка не требует прохода по всему файлу.
+class MappedSnapshot {
+public:
+    // Прогрев отображения (MAP_POPULATE передаётся в конструктор):
+    //   WARMUP_WILLNEED - madvise(MADV_WILLNEED), ядро читает файл
+    //                     асинхронно, область индекса запрашивается первой;
+    //   WARMUP_TOUCH    - потоки читают файл по блокам от начала (ключи и
+    //                     смещения лежат перед данными), проверяя контрольные
+    //                     суммы блоков, так что первые поиски не платят ни за
+    //                     отказы страниц, ни за ленивую проверку.
+    enum Warmup { WARMUP_WILLNEED, WARMUP_TOUCH };
+    
+    // Состояние прогрева: WARMUP_FAILED - чтение наткнулось на повреждённый
+    // блок, ошибку возвращает waitWarmup()
+    enum WarmupState { WARMUP_IDLE, WARMUP_RUNNING, WARMUP_DONE, WARMUP_FAILED };
+    
+private:
+    enum BlockState : uint8_t { UNVERIFIED = 0, VERIFIED = 1, CORRUPTED = 2 };
+    
+    int fd = -1;
+    const char* base = nullptr;
+    size_t mappedSize = 0;  // длина отображения (с завершением контрольных сумм)
+    size_t fileSize = 0;    // длина данных снимка без завершения
+    uint64_t lsn = 0;
+    uint64_t count = 0;
+    const char* keys = nullptr;
+    const char* offsets = nullptr;
+    const char* payload = nullptr;
+    size_t payloadSize = 0;
+    
+    uint64_t blockSize = 0;
+    vector<uint32_t> blockCrcs;
+    unique_ptr<atomic<uint8_t>[]> blockStates;
+    mutable atomic<size_t> verifiedBlocks{0};
+    
+    thread warmer;
+    atomic<bool> stopWarmup{false};
+    atomic<int> warmupStatus{WARMUP_IDLE};
+    mutex warmupErrorLock;
+    exception_ptr warmupError;  // первая ошибка потоков прогрева
+    atomic<size_t> warmedBytes{0};
+    atomic<unsigned> warmSink{0};  // сумма прочитанных байт, чтобы чтение не было выброшено
+    
+    // Чтение участка файла: блоки с контрольными суммами проверяются
+    // (это читает их целиком), иначе читается по байту со страницы
+    void warmRange(size_t begin, size_t length) {
+        if (!blockCrcs.empty()) {
+            verifyRange(base + begin, length);
+        } else {
+            const size_t PAGE = 4096;
+            unsigned char sum = 0;
+            for (size_t offset = begin; offset < begin + length; offset += PAGE) {
+                sum += *reinterpret_cast<const volatile unsigned char*>(base + offset);
+            }
+            warmSink.fetch_add(sum, memory_order_relaxed);
+        }
+        warmedBytes += length;
+    }
+    
+    // Исключения потоков не выходят за их пределы: первое сохраняется
+    // в warmupError, остальные потоки останавливаются
+    void touchAll(unsigned threadCount) {
+        TRACE_SPAN("прогрев снимка");
+        const size_t CHUNK = blockCrcs.empty() ? 1 << 20 : blockSize;
+        size_t chunks = (fileSize + CHUNK - 1) / CHUNK;
+        atomic<size_t> next{0};
+        atomic<bool> failed{false};
+        auto worker = [&] {
+            try {
+                for (size_t chunk; !stopWarmup && !failed && (chunk = next.fetch_add(1)) < chunks;) {
+                    warmRange(chunk * CHUNK, min(CHUNK, fileSize - chunk * CHUNK));
+                }
+            } catch (...) {
+                lock_guard<mutex> guard(warmupErrorLock);
+                if (!warmupError) {
+                    warmupError = current_exception();
+                }
+                failed = true;
+            }
+        };
+        vector<thread> threads;
+        for (unsigned i = 1; i < max(threadCount, 1u); ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (thread& t : threads) {
+            t.join();
+        }
+        warmupStatus = failed ? WARMUP_FAILED : WARMUP_DONE;
+    }
+    
+    void joinWarmer() {
+        if (warmer.joinable()) {
+            warmer.join();
+        }
+    }
+    
+    void verifyBlock(size_t block) const {
+        uint8_t state = blockStates[block].load(memory_order_acquire);
+        if (state == VERIFIED) {
+            return;
+        }
+        if (state == UNVERIFIED) {
+            size_t begin = block * blockSize;
+            size_t length = min<size_t>(blockSize, fileSize - begin);
+            // Гонка двух потоков за один блок безвредна: оба посчитают одно и то же
+            state = Crc32c::compute(base + begin, length) == blockCrcs[block] ? VERIFIED : CORRUPTED;
+            uint8_t expected = UNVERIFIED;
+            if (blockStates[block].compare_exchange_strong(expected, state) && state == VERIFIED) {
+                ++verifiedBlocks;
+            }
+        }
+        if (state == CORRUPTED) {
+            throw runtime_error("Несовпадение контрольной суммы блока " + to_string(block) + " снимка");
+        }
+    }
+    
+    // Проверка всех блоков, покрывающих диапазон байт файла
+    void verifyRange(const char* data, size_t length) const {
+        if (blockCrcs.empty() || length == 0) {
+            return;
+        }
+        size_t begin = data - base;
+        for (size_t block = begin / blockSize; block <= (begin + length - 1) / blockSize; ++block) {
+            verifyBlock(block);
+        }
+    }
+    
+    uint64_t readU64(const char* p) const {
+        verifyRange(p, sizeof(uint64_t));
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+    
+    // Разбор завершения контрольных сумм и заголовка отображённого файла
+    void parseLayout() {
+        size_t dataSize = fileSize;
+        if (parseChecksumFooter(base, fileSize, blockSize, blockCrcs, dataSize)) {
+            blockStates.reset(new atomic<uint8_t>[blockCrcs.size()]);
+            for (size_t i = 0; i < blockCrcs.size(); ++i) {
+                blockStates[i] = UNVERIFIED;
+            }
+            fileSize = dataSize;
+        }
+        
+        const size_t HEADER = sizeof(SNAPSHOT_MAGIC) + 2 * sizeof(uint64_t);
+        if (fileSize < HEADER) {
+            throw runtime_error("Неверный формат снимка");
+        }
+        verifyRange(base, HEADER);
+        if (memcmp(base, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            throw runtime_error("Неверный формат снимка");
+        }
+        memcpy(&lsn, base + sizeof(SNAPSHOT_MAGIC), sizeof(lsn));
+        memcpy(&count, base + sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t), sizeof(count));
+        if (count > (fileSize - HEADER) / (2 * sizeof(uint64_t))) {
+            throw runtime_error("Повреждённый снимок: неверное число записей");
+        }
+        keys = base + HEADER;
+        offsets = keys + count * sizeof(uint64_t);
+        payload = offsets + (count + 1) * sizeof(uint64_t);
+        payloadSize = fileSize - (payload - base);
+    }
+    
+public:
+    explicit MappedSnapshot(const string& path, int mapFlags = 0) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Не удалось открыть снимок " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error(string("fstat не удался: ") + strerror(errno));
+        }
+        mappedSize = fileSize = static_cast<size_t>(st.st_size);
+        void* mapping = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED | mapFlags, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw runtime_error(string("mmap не удался: ") + strerror(errno));
+        }
+        base = static_cast<const char*>(mapping);
+        
+        // Деструктор недостроенного объекта не вызывается: при ошибке
+        // разбора отображение и дескриптор освобождаются здесь
+        try {
+            parseLayout();
+        } catch (...) {
+            munmap(const_cast<char*>(base), mappedSize);
+            close(fd);
+            throw;
+        }
+    }
+    
+    ~MappedSnapshot() {
+        stopWarmup = true;
+        joinWarmer();
+        munmap(const_cast<char*>(base), mappedSize);
+        close(fd);
+    }
+    
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+    
+    // Поиск по UID; data указывает прямо в отображённый файл
+    bool find(const string& uid, string_view& data) const {
+        if (uid.length() != 7) {
+            return false;
+        }
+        uint64_t key = packUid(uid);
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (readU64(keys + mid * sizeof(uint64_t)) < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == count || readU64(keys + lo * sizeof(uint64_t)) != key) {
+            return false;
+        }
+        uint64_t begin = readU64(offsets + lo * sizeof(uint64_t));
+        uint64_t end = readU64(offsets + (lo + 1) * sizeof(uint64_t));
+        if (begin > end || end > payloadSize) {
+            throw runtime_error("Повреждённый снимок: неверное смещение данных");
+        }
+        verifyRange(payload + begin, end - begin);
+        data = string_view(payload + begin, end - begin);
+        return true;
+    }
+    
+    // Проверка всех ещё не проверенных блоков в threadCount потоков;
+    // возвращает число повреждённых блоков
+    size_t verifyAll(unsigned threadCount) const {
+        TRACE_SPAN("проверка снимка");
+        atomic<size_t> next{0}, corrupted{0};
+        auto worker = [&] {
+            TRACE_SPAN("проверка блоков снимка");
+            for (size_t block; (block = next.fetch_add(1)) < blockCrcs.size();) {
+                try {
+                    verifyBlock(block);
+                } catch (const runtime_error&) {
+                    ++corrupted;
+                }
+            }
+        };
+        vector<thread> threads;
+        for (unsigned i = 1; i < max(threadCount, 1u); ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (thread& t : threads) {
+            t.join();
+        }
+        return corrupted;
+    }
+    
+    // Массив отсортированных ключей целиком (с проверкой его блоков)
+    const uint64_t* keyArray() const {
+        verifyRange(keys, count * sizeof(uint64_t));
+        return reinterpret_cast<const uint64_t*>(keys);
+    }
+    
+    // Запуск прогрева; при background = true поиск можно начинать сразу,
+    // прогрев продолжается в фоновом потоке (waitWarmup() дожидается его).
+    // Повреждённый блок останавливает прогрев: в переднем плане ошибка
+    // выбрасывается отсюда, в фоне - из waitWarmup()
+    void warmup(Warmup mode, unsigned threadCount, bool background) {
+        joinWarmer();
+        warmupError = nullptr;
+        if (mode == WARMUP_WILLNEED) {
+            const char* pageBase = base + (keys - base) / 4096 * 4096;
+            madvise(const_cast<char*>(pageBase), payload - pageBase, MADV_WILLNEED);
+            madvise(const_cast<char*>(base), fileSize, MADV_WILLNEED);
+            warmupStatus = WARMUP_DONE;
+            return;
+        }
+        warmedBytes = 0;
+        warmupStatus = WARMUP_RUNNING;
+        if (background) {
+            warmer = thread(&MappedSnapshot::touchAll, this, threadCount);
+        } else {
+            touchAll(threadCount);
+            waitWarmup();
+        }
+    }
+    
+    // Ожидание фонового прогрева; ошибка прогрева выбрасывается здесь
+    void waitWarmup() {
+        joinWarmer();
+        if (warmupError) {
+            rethrow_exception(warmupError);
+        }
+    }
+    
+    WarmupState warmupState() const {
+        return static_cast<WarmupState>(warmupStatus.load());
+    }
+    
+    // Доля файла, прочитанная прогревом WARMUP_TOUCH
+    double warmupProgress() const {
+        return fileSize ? min(1.0, static_cast<double>(warmedBytes) / fileSize) : 1.0;
+    }
+    
+    // Доля страниц отображения, находящихся в памяти (mincore)
+    double residentShare() const {
+        const size_t PAGE = 4096;
+        size_t pages = (fileSize + PAGE - 1) / PAGE;
+        vector<unsigned char> resident(pages);
+        if (pages == 0 || mincore(const_cast<char*>(base), fileSize, resident.data()) != 0) {
+            return 0.0;
+        }
+        size_t inMemory = 0;
+        for (unsigned char page : resident) {
+            inMemory += page & 1;
+        }
+        return static_cast<double>(inMemory) / pages;
+    }
+    
+    size_t size() const { return count; }
+    uint64_t getLsn() const { return lsn; }
+    size_t bytes() const { return fileSize; }
+    size_t blockCount() const { return blockCrcs.size(); }
+    size_t verifiedBlockCount() const { return verifiedBlocks; }
+};
+
+// Массовая проверка присутствия UID (полусоединение) против
+// отсортированного массива упакованных ключей (снимка или базы).
+// Две стратегии:
+//   - секционированный хэш-поиск: ключи базы раскладываются по небольшим
+//     хэш-таблицам (секциям, помещающимся в кэш L2), входной пакет
+//     раскладывается по тем же секциям и проверяется секция за секцией;
+//   - слияние с сортировкой: отсортированный (или отсортированный здесь)
+//     пакет проходит по массиву ключей галопирующим поиском.
+// Стратегия выбирается по оценке стоимости, пакет обрабатывается
+// несколькими потоками.
+class BulkMembership {
+public:
+    enum Strategy { HASH_PROBE, SORT_MERGE };
+    
+private:
+    static constexpr size_t KEYS_PER_PARTITION = 4096;
+    
+    const uint64_t* keys;
+    size_t count;
+    unsigned threadCount;
+    
+    int partitionBits = -1;
+    vector<size_t> partitionOffsets;  // начало таблицы каждой секции
+    vector<uint64_t> tables;          // ключ + 1; 0 - свободная позиция
+    
+    size_t partitionOf(uint64_t h) const {
+        return partitionBits == 0 ? 0 : static_cast<size_t>(h >> (64 - partitionBits));
+    }
+    
+    void buildPartitions() {
+        partitionBits = 0;
+        while ((count >> partitionBits) > KEYS_PER_PARTITION) {
+            ++partitionBits;
+        }
+        size_t partitions = size_t(1) << partitionBits;
+        vector<size_t> sizes(partitions, 0);
+        for (size_t i = 0; i < count; ++i) {
+            ++sizes[partitionOf(mixHash(keys[i]))];
+        }
+        // Таблица секции - степень двойки не меньше удвоенного числа ключей
+        partitionOffsets.assign(partitions + 1, 0);
+        for (size_t p = 0; p < partitions; ++p) {
+            size_t capacity = 16;
+            while (capacity < sizes[p] * 2) {
+                capacity *= 2;
+            }
+            partitionOffsets[p + 1] = partitionOffsets[p] + capacity;
+        }
+        tables.assign(partitionOffsets[partitions], 0);
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t h = mixHash(keys[i]);
+            size_t p = partitionOf(h);
+            size_t mask = partitionOffsets[p + 1] - partitionOffsets[p] - 1;
+            uint64_t* table = &tables[partitionOffsets[p]];
+            size_t pos = h & mask;
+            while (table[pos] != 0 && table[pos] != keys[i] + 1) {
+                pos = (pos + 1) & mask;
+            }
+            table[pos] = keys[i] + 1;
+        }
+    }
+    
+    bool probePartition(uint64_t key, uint64_t h) const {
+        size_t p = partitionOf(h);
+        size_t mask = partitionOffsets[p + 1] - partitionOffsets[p] - 1;
+        const uint64_t* table = &tables[partitionOffsets[p]];
+        for (size_t pos = h & mask; table[pos] != 0; pos = (pos + 1) & mask) {
+            if (table[pos] == key + 1) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    template <typename Worker>
+    void parallelFor(size_t n, Worker work) const {
+        unsigned threads = static_cast<unsigned>(min<size_t>(max(threadCount, 1u), max<size_t>(n / 65536, 1)));
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; ++t) {
+            pool.emplace_back(work, n * t / threads, n * (t + 1) / threads);
+        }
+        work(0, n / threads);
+        for (thread& worker : pool) {
+            worker.join();
+        }
+    }
+    
+    void probeHash(const vector<uint64_t>& input, vector<uint8_t>& found) {
+        if (partitionBits < 0) {
+            buildPartitions();
+        }
+        // Раскладка пакета по секциям подсчётом
+        size_t partitions = size_t(1) << partitionBits;
+        vector<uint64_t> hashes(input.size());
+        vector<size_t> starts(partitions + 1, 0);
+        for (size_t i = 0; i < input.size(); ++i) {
+            hashes[i] = mixHash(input[i]);
+            ++starts[partitionOf(hashes[i]) + 1];
+        }
+        for (size_t p = 0; p < partitions; ++p) {
+            starts[p + 1] += starts[p];
+        }
+        vector<uint32_t> order(input.size());
+        for (size_t i = 0; i < input.size(); ++i) {
+            order[starts[partitionOf(hashes[i])]++] = static_cast<uint32_t>(i);
+        }
+        parallelFor(order.size(), [&](size_t from, size_t to) {
+            for (size_t j = from; j < to; ++j) {
+                uint32_t i = order[j];
+                found[i] = probePartition(input[i], hashes[i]);
+            }
+        });
+    }
+    
+    // Первая позиция не меньше key, начиная с from (экспоненциальный поиск)
+    size_t gallop(size_t from, uint64_t key) const {
+        size_t step = 1, hi = from;
+        while (hi < count && keys[hi] < key) {
+            from = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        return lower_bound(keys + from, keys + min(hi, count), key) - keys;
+    }
+    
+    void probeSorted(const vector<uint64_t>& input, bool sorted, vector<uint8_t>& found) {
+        parallelFor(input.size(), [&](size_t from, size_t to) {
+            vector<pair<uint64_t, uint32_t>> order;
+            order.reserve(sorted ? 0 : to - from);
+            if (!sorted) {
+                for (size_t i = from; i < to; ++i) {
+                    order.emplace_back(input[i], static_cast<uint32_t>(i));
+                }
+                sort(order.begin(), order.end());
+            }
+            size_t pos = 0;
+            for (size_t j = from; j < to; ++j) {
+                uint64_t key = sorted ? input[j] : order[j - from].first;
+                size_t i = sorted ? j : order[j - from].second;
+                pos = gallop(pos, key);
+                found[i] = pos < count && keys[pos] == key;
+            }
+        });
+    }
+    
+public:
+    BulkMembership(const uint64_t* sortedKeys, size_t count, unsigned threadCount)
+        : keys(sortedKeys), count(count), threadCount(threadCount) {}
+    
+    // Оценка стоимости в наносекундах на весь вход из inputKeys ключей,
+    // обрабатываемый пакетами по chunkKeys. Константы - однопоточные
+    // замеры на x86-64: построение секций ~50 нс на ключ базы, раскладка
+    // и поиск ~80 нс на входной ключ, сортировка ~5 нс на сравнение,
+    // галопирующий шаг ~3 нс.
+    double estimateCost(Strategy strategy, size_t inputKeys, size_t chunkKeys, bool sorted) const {
+        double m = static_cast<double>(inputKeys);
+        if (strategy == HASH_PROBE) {
+            double build = partitionBits < 0 ? count * 50.0 : 0.0;
+            return build + m * 80.0;
+        }
+        double sortCost = sorted ? 0.0 : m * log2(max<double>(chunkKeys, 2)) * 5.0;
+        double gap = static_cast<double>(count) / max<double>(chunkKeys, 1);
+        return sortCost + m * (log2(gap + 1) * 3.0 + 8.0);
+    }
+    
+    Strategy choose(size_t inputKeys, size_t chunkKeys, bool sorted) const {
+        return estimateCost(HASH_PROBE, inputKeys, chunkKeys, sorted)
+             < estimateCost(SORT_MERGE, inputKeys, chunkKeys, sorted) ? HASH_PROBE : SORT_MERGE;
+    }
+    
+    // found[i] - присутствует ли input[i]
+    void probe(const vector<uint64_t>& input, Strategy strategy, vector<uint8_t>& found) {
+        found.assign(input.size(), 0);
+        if (strategy == HASH_PROBE) {
+            probeHash(input, found);
+        } else {
+            probeSorted(input, is_sorted(input.begin(), input.end()), found);
+        }
+    }
+};
+
+// Разбор и запись UID в текстовом виде: 14 шестнадцатеричных цифр в строке
+inline bool parseHexUid(const char* text, size_t length, uint64_t& key) {
+    if (length != 14) {
+        return false;
+    }
+    key = 0;
+    for (size_t i = 0; i < length; ++i) {
+        char c = text[i];
+        int digit = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return false;
+        }
+        key = (key << 4) | static_cast<uint64_t>(digit);
+    }
+    return true;
+}
+
+inline void appendHexUid(string& out, uint64_t key) {
+    static const char digits[] = "0123456789abcdef";
+    for (int shift = 52; shift >= 0; shift -= 4) {
+        out += digits[(key >> shift) & 0xF];
+    }
+    out += '\n';
+}
+
+// Потоковое полусоединение: вход читается пакетами, в выход попадают
+// присутствующие UID в порядке входа
+struct SemiJoinStats {
+    size_t inputKeys = 0;
+    size_t foundKeys = 0;
+    size_t chunks = 0;
+    bool sortedInput = true;
+    BulkMembership::Strategy strategy = BulkMembership::SORT_MERGE;
+    double seconds = 0.0;
+};
+
+SemiJoinStats runSemiJoin(BulkMembership& membership, FILE* in, FILE* out, size_t expectedKeys,
+                          size_t chunkKeys = 1 << 20) {
+    TRACE_SPAN("полусоединение");
+    SemiJoinStats stats;
+    auto start = chrono::steady_clock::now();
+    
+    vector<uint64_t> chunk;
+    vector<uint8_t> found;
+    string outBuffer;
+    char line[64];
+    bool decided = false;
+    uint64_t previous = 0;
+    bool eof = false;
+    while (!eof) {
+        chunk.clear();
+        while (chunk.size() < chunkKeys) {
+            if (!fgets(line, sizeof(line), in)) {
+                eof = true;
+                break;
+            }
+            size_t length = strcspn(line, "\r\n");
+            if (length == 0) {
+                continue;
+            }
+            uint64_t key;
+            if (!parseHexUid(line, length, key)) {
+                throw runtime_error("Неверный UID во входных данных: " + string(line, length));
+            }
+            if (key < previous) {
+                stats.sortedInput = false;
+            }
+            previous = key;
+            chunk.push_back(key);
+        }
+        if (chunk.empty()) {
+            break;
+        }
+        // Стратегия выбирается по первому пакету; если вход позже
+        // окажется неотсортированным, слияние само отсортирует пакет
+        if (!decided) {
+            stats.strategy = membership.choose(max(expectedKeys, chunk.size()), chunkKeys, stats.sortedInput);
+            decided = true;
+        }
+        membership.probe(chunk, stats.strategy, found);
+        
+        outBuffer.clear();
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            if (found[i]) {
+                appendHexUid(outBuffer, chunk[i]);
+                ++stats.foundKeys;
+            }
+        }
+        if (out && fwrite(outBuffer.data(), 1, outBuffer.size(), out) != outBuffer.size()) {
+            throw runtime_error("Ошибка записи результата");
+        }
+        stats.inputKeys += chunk.size();
+        ++stats.chunks;
+    }
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// Сжатое множество UID в духе Roaring: 56-битный ключ делится на старшие
+// 40 бит (номер контейнера) и младшие 16 бит, которые хранятся
+// в контейнере одного из трёх видов:
+//   - массив: отсортированные 16-битные значения (до 4096 штук);
+//   - битовая карта: 65536 бит (1024 слова);
+//   - серии: пары (начало, длина - 1) для плотных непрерывных диапазонов.
+// Данные всех контейнеров лежат в двух общих пулах, сам контейнер
+// занимает 16 байт. Операции над картами идут по 128 бит за инструкцию
+// SSE2, мощность считается инструкцией popcnt (при её наличии).
+// Для равномерно случайных UID на контейнер приходится в среднем меньше
+// одного ключа, поэтому контейнеры из одного значения не заводятся:
+// такие ключи лежат целиком в плоском отсортированном массиве sparse
+// (8 байт на UID). Номер контейнера встречается либо в containers, либо
+// в sparse. Участки sparse, между которыми нет контейнеров ни в одном
+// из операндов, обрабатываются целиком: пересечение и разность - блоками
+// по 4 ключа сравнением AVX2 (при его наличии) или галопом при большом
+// перекосе размеров, объединение - слиянием.
+class UidSet {
+private:
+    enum ContainerType : uint32_t { ARRAY = 0, BITMAP = 1, RUN = 2 };
+    enum Operation { AND, OR, ANDNOT };
+    
+    static constexpr size_t ARRAY_LIMIT = 4096;
+    static constexpr size_t BITMAP_WORDS = 1024;
+    static constexpr uint32_t COUNT_MASK = (1u << 30) - 1;
+    
+    struct Container {
+        uint64_t high;
+        uint32_t offset;  // в arrays (массив, серии) или в bitmaps (номер карты)
+        uint32_t meta;    // вид в двух старших битах; число значений, бит или серий
+        
+        ContainerType type() const { return static_cast<ContainerType>(meta >> 30); }
+        uint32_t count() const { return meta & COUNT_MASK; }
+    };
+    
+    vector<Container> containers;
+    vector<uint16_t> arrays;
+    vector<uint64_t> bitmaps;
+    vector<uint64_t> sparse;  // ключи единственных значений своих контейнеров
+    
+    // Содержимое контейнера в виде массива или карты
+    struct View {
+        const uint16_t* values = nullptr;
+        size_t size = 0;
+        const uint64_t* words = nullptr;
+    };
+    
+    static size_t countBitsGeneric(const uint64_t* words, size_t n) {
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            total += __builtin_popcountll(words[i]);
+        }
+        return total;
+    }
+    
+#if defined(__x86_64__)
+    __attribute__((target("popcnt")))
+    static size_t countBitsHardware(const uint64_t* words, size_t n) {
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            total += __builtin_popcountll(words[i]);
+        }
+        return total;
+    }
+    
+    static size_t countBits(const uint64_t* words, size_t n) {
+        static const bool hardware = __builtin_cpu_supports("popcnt");
+        return hardware ? countBitsHardware(words, n) : countBitsGeneric(words, n);
+    }
+#else
+    static size_t countBits(const uint64_t* words, size_t n) {
+        return countBitsGeneric(words, n);
+    }
+#endif
+    
+    static void setBit(uint64_t* words, uint16_t value) {
+        words[value >> 6] |= uint64_t(1) << (value & 63);
+    }
+    
+    // Установка бит [first, last] целыми словами
+    static void setRange(uint64_t* words, uint32_t first, uint32_t last) {
+        uint32_t firstWord = first >> 6, lastWord = last >> 6;
+        uint64_t firstMask = ~uint64_t(0) << (first & 63);
+        uint64_t lastMask = ~uint64_t(0) >> (63 - (last & 63));
+        if (firstWord == lastWord) {
+            words[firstWord] |= firstMask & lastMask;
+            return;
+        }
+        words[firstWord] |= firstMask;
+        for (uint32_t w = firstWord + 1; w < lastWord; ++w) {
+            words[w] = ~uint64_t(0);
+        }
+        words[lastWord] |= lastMask;
+    }
+    
+    static bool testBit(const uint64_t* words, uint16_t value) {
+        return (words[value >> 6] >> (value & 63)) & 1;
+    }
+    
+    // Пословная операция над картами
+    static void combineBitmaps(const uint64_t* a, const uint64_t* b, uint64_t* out, Operation op) {
+#ifdef __SSE2__
+        for (size_t i = 0; i < BITMAP_WORDS; i += 2) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            __m128i r = op == AND ? _mm_and_si128(x, y) : op == OR ? _mm_or_si128(x, y) : _mm_andnot_si128(y, x);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), r);
+        }
+#else
+        for (size_t i = 0; i < BITMAP_WORDS; ++i) {
+            out[i] = op == AND ? a[i] & b[i] : op == OR ? a[i] | b[i] : a[i] & ~b[i];
+        }
+#endif
+    }
+    
+    View view(const Container& c, vector<uint16_t>& scratchValues, vector<uint64_t>& scratchWords) const {
+        View v;
+        if (c.type() == ARRAY) {
+            v.values = &arrays[c.offset];
+            v.size = c.count();
+        } else if (c.type() == BITMAP) {
+            v.words = &bitmaps[size_t(c.offset) * BITMAP_WORDS];
+        } else {
+            // Серии разворачиваются в массив или карту
+            const uint16_t* runs = &arrays[c.offset];
+            size_t total = 0;
+            for (uint32_t r = 0; r < c.count(); ++r) {
+                total += size_t(runs[2 * r + 1]) + 1;
+            }
+            if (total <= ARRAY_LIMIT) {
+                scratchValues.clear();
+                for (uint32_t r = 0; r < c.count(); ++r) {
+                    for (uint32_t value = runs[2 * r]; value <= uint32_t(runs[2 * r]) + runs[2 * r + 1]; ++value) {
+                        scratchValues.push_back(static_cast<uint16_t>(value));
+                    }
+                }
+                v.values = scratchValues.data();
+                v.size = scratchValues.size();
+            } else {
+                scratchWords.assign(BITMAP_WORDS, 0);
+                for (uint32_t r = 0; r < c.count(); ++r) {
+                    setRange(scratchWords.data(), runs[2 * r], uint32_t(runs[2 * r]) + runs[2 * r + 1]);
+                }
+                v.words = scratchWords.data();
+            }
+        }
+        return v;
+    }
+    
+    void appendArray(uint64_t high, const uint16_t* values, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        if (n == 1) {
+            sparse.push_back(high << 16 | values[0]);
+            return;
+        }
+        containers.push_back({high, static_cast<uint32_t>(arrays.size()), ARRAY << 30 | static_cast<uint32_t>(n)});
+        arrays.insert(arrays.end(), values, values + n);
+    }
+    
+    // Карта с малым числом бит сохраняется массивом
+    void appendBitmap(uint64_t high, const uint64_t* words) {
+        size_t bits = countBits(words, BITMAP_WORDS);
+        if (bits == 0) {
+            return;
+        }
+        if (bits == 1) {
+            for (size_t w = 0;; ++w) {
+                if (words[w]) {
+                    sparse.push_back(high << 16 | (w * 64 + __builtin_ctzll(words[w])));
+                    return;
+                }
+            }
+        }
+        if (bits <= ARRAY_LIMIT) {
+            containers.push_back({high, static_cast<uint32_t>(arrays.size()), ARRAY << 30 | static_cast<uint32_t>(bits)});
+            for (size_t w = 0; w < BITMAP_WORDS; ++w) {
+                for (uint64_t word = words[w]; word; word &= word - 1) {
+                    arrays.push_back(static_cast<uint16_t>(w * 64 + __builtin_ctzll(word)));
+                }
+            }
+            return;
+        }
+        containers.push_back({high, static_cast<uint32_t>(bitmaps.size() / BITMAP_WORDS),
+                              BITMAP << 30 | static_cast<uint32_t>(bits)});
+        bitmaps.insert(bitmaps.end(), words, words + BITMAP_WORDS);
+    }
+    
+    void appendCopy(const UidSet& source, const Container& c) {
+        Container copy = c;
+        if (c.type() == BITMAP) {
+            copy.offset = static_cast<uint32_t>(bitmaps.size() / BITMAP_WORDS);
+            const uint64_t* words = &source.bitmaps[size_t(c.offset) * BITMAP_WORDS];
+            bitmaps.insert(bitmaps.end(), words, words + BITMAP_WORDS);
+        } else {
+            copy.offset = static_cast<uint32_t>(arrays.size());
+            size_t n = c.type() == ARRAY ? c.count() : 2 * size_t(c.count());
+            arrays.insert(arrays.end(), &source.arrays[c.offset], &source.arrays[c.offset] + n);
+        }
+        containers.push_back(copy);
+    }
+    
+    // Пересечение отсортированных массивов; при большом перекосе размеров
+    // короткий массив ищется в длинном галопом
+    static void intersectArrays(const uint16_t* a, size_t na, const uint16_t* b, size_t nb,
+                                vector<uint16_t>& out) {
+        out.clear();
+        if (na > nb) {
+            swap(a, b);
+            swap(na, nb);
+        }
+        if (na * 32 < nb) {
+            const uint16_t* pos = b;
+            for (size_t i = 0; i < na && pos < b + nb; ++i) {
+                pos = lower_bound(pos, b + nb, a[i]);
+                if (pos < b + nb && *pos == a[i]) {
+                    out.push_back(a[i]);
+                }
+            }
+            return;
+        }
+        set_intersection(a, a + na, b, b + nb, back_inserter(out));
+    }
+    
+    // Первая позиция в [from, end), где ключ не меньше key: экспоненциальный
+    // шаг от from, затем двоичный поиск
+    static const uint64_t* gallop(const uint64_t* from, const uint64_t* end, uint64_t key) {
+        size_t step = 1;
+        const uint64_t* lo = from;
+        while (lo + step < end && lo[step] < key) {
+            lo += step;
+            step *= 2;
+        }
+        return lower_bound(lo, min(lo + step + 1, end), key);
+    }
+    
+    // Отбор ключей a, которые есть (keepMatched) или которых нет в b;
+    // результат пишется в out, возвращается число ключей
+    static size_t filterKeysScalar(const uint64_t* a, size_t na, const uint64_t* b, size_t nb, bool keepMatched,
+                                   uint64_t* out) {
+        size_t j = 0, k = 0;
+        for (size_t i = 0; i < na; ++i) {
+            while (j < nb && b[j] < a[i]) {
+                ++j;
+            }
+            out[k] = a[i];
+            k += (j < nb && b[j] == a[i]) == keepMatched;
+        }
+        return k;
+    }
+    
+#if defined(__x86_64__)
+    // Блок из 4 ключей a сравнивается со всеми 4 ключами блока b за четыре
+    // сравнения с циклическими перестановками b; продвигается блок с меньшим
+    // максимумом, совпадения блока a копятся до его продвижения. Отобранные
+    // ключи блока сдвигаются к началу перестановкой по таблице и пишутся
+    // целым блоком без ветвлений (out нужен запас в 4 ключа)
+    __attribute__((target("avx2")))
+    static size_t filterKeysAvx2(const uint64_t* a, size_t na, const uint64_t* b, size_t nb, bool keepMatched,
+                                 uint64_t* out) {
+        static const struct Compress {
+            alignas(32) uint32_t lanes[16][8];
+            Compress() {
+                for (int mask = 0; mask < 16; ++mask) {
+                    int n = 0;
+                    for (int lane = 0; lane < 4; ++lane) {
+                        if (mask >> lane & 1) {
+                            lanes[mask][2 * n] = 2 * lane;
+                            lanes[mask][2 * n + 1] = 2 * lane + 1;
+                            ++n;
+                        }
+                    }
+                    for (; n < 4; ++n) {
+                        lanes[mask][2 * n] = lanes[mask][2 * n + 1] = 0;
+                    }
+                }
+            }
+        } compress;
+        size_t i = 0, j = 0, k = 0;
+        int matched = 0;
+        int flip = keepMatched ? 0 : 15;
+        while (i + 4 <= na && j + 4 <= nb) {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+            __m256i hits = _mm256_cmpeq_epi64(va, vb);
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4E)));
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+            matched |= _mm256_movemask_pd(_mm256_castsi256_pd(hits));
+            uint64_t maxA = a[i + 3], maxB = b[j + 3];
+            bool advanceA = maxA <= maxB, advanceB = maxB <= maxA;
+            int keep = matched ^ flip;
+            __m256i index = _mm256_load_si256(reinterpret_cast<const __m256i*>(compress.lanes[keep]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), _mm256_permutevar8x32_epi32(va, index));
+            k += advanceA ? __builtin_popcount(keep) : 0;
+            matched = advanceA ? 0 : matched;
+            i += advanceA ? 4 : 0;
+            j += advanceB ? 4 : 0;
+        }
+        // Остаток: совпадения текущего блока a с уже пройденными блоками b
+        // учтены в matched
+        for (size_t r = i; r < na; ++r) {
+            while (j < nb && b[j] < a[r]) {
+                ++j;
+            }
+            bool found = (r < i + 4 && (matched >> (r - i)) & 1) || (j < nb && b[j] == a[r]);
+            out[k] = a[r];
+            k += found == keepMatched;
+        }
+        return k;
+    }
+#endif
+    
+    // Отбор ключей a по присутствию в b с дописыванием в конец out
+    static void filterKeys(const uint64_t* a, size_t na, const uint64_t* b, size_t nb, bool keepMatched,
+                           vector<uint64_t>& out) {
+        if (nb == 0) {
+            if (!keepMatched) {
+                out.insert(out.end(), a, a + na);
+            }
+            return;
+        }
+        // Перекос размеров: короткий массив ищется в длинном галопом
+        if (na * 32 < nb) {
+            const uint64_t* pos = b;
+            for (size_t i = 0; i < na; ++i) {
+                pos = gallop(pos, b + nb, a[i]);
+                if ((pos < b + nb && *pos == a[i]) == keepMatched) {
+                    out.push_back(a[i]);
+                }
+            }
+            return;
+        }
+        if (nb * 32 < na) {
+            const uint64_t* from = a;
+            for (size_t j = 0; j < nb && from < a + na; ++j) {
+                const uint64_t* pos = gallop(from, a + na, b[j]);
+                bool hit = pos < a + na && *pos == b[j];
+                if (keepMatched) {
+                    if (hit) {
+                        out.push_back(*pos);
+                    }
+                } else {
+                    out.insert(out.end(), from, pos);
+                }
+                from = pos + hit;
+            }
+            if (!keepMatched) {
+                out.insert(out.end(), from, a + na);
+            }
+            return;
+        }
+        size_t base = out.size();
+        out.resize(base + na + 4);
+#if defined(__x86_64__)
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (avx2) {
+            out.resize(base + filterKeysAvx2(a, na, b, nb, keepMatched, out.data() + base));
+            return;
+        }
+#endif
+        out.resize(base + filterKeysScalar(a, na, b, nb, keepMatched, out.data() + base));
+    }
+    
+    // Операция над участками sparse, в пределах которых у операндов нет
+    // контейнеров
+    void combineSparse(const uint64_t* a, size_t na, const uint64_t* b, size_t nb, Operation op) {
+        if (op == AND) {
+            if (na <= nb) {
+                filterKeys(a, na, b, nb, true, sparse);
+            } else {
+                filterKeys(b, nb, a, na, true, sparse);
+            }
+            return;
+        }
+        if (op == ANDNOT) {
+            filterKeys(a, na, b, nb, false, sparse);
+            return;
+        }
+        // Слияние без ветвлений по сравнению ключей
+        size_t base = sparse.size();
+        sparse.resize(base + na + nb);
+        uint64_t* out = sparse.data() + base;
+        size_t i = 0, j = 0, k = 0;
+        while (i < na && j < nb) {
+            uint64_t x = a[i], y = b[j];
+            out[k++] = x < y ? x : y;
+            i += x <= y;
+            j += y <= x;
+        }
+        k = copy(b + j, b + nb, copy(a + i, a + na, out + k)) - out;
+        
+        // Два одиночных ключа разных операндов с общим номером контейнера
+        // становятся контейнером-массивом из двух значений
+        size_t kept = 0;
+        for (size_t r = 0; r < k; ++r) {
+            if (r + 1 < k && out[r] >> 16 == out[r + 1] >> 16) {
+                uint16_t pair[2] = {static_cast<uint16_t>(out[r]), static_cast<uint16_t>(out[r + 1])};
+                appendArray(out[r] >> 16, pair, 2);
+                ++r;
+            } else {
+                out[kept++] = out[r];
+            }
+        }
+        sparse.resize(base + kept);
+    }
+    
+    void combineContainers(uint64_t high, const View& a, const View& b, Operation op,
+                           vector<uint16_t>& values, vector<uint64_t>& words) {
+        if (a.words && b.words) {
+            words.resize(BITMAP_WORDS);
+            combineBitmaps(a.words, b.words, words.data(), op);
+            appendBitmap(high, words.data());
+        } else if (!a.words && !b.words) {
+            values.clear();
+            if (op == AND) {
+                intersectArrays(a.values, a.size, b.values, b.size, values);
+            } else if (op == OR) {
+                set_union(a.values, a.values + a.size, b.values, b.values + b.size, back_inserter(values));
+            } else {
+                set_difference(a.values, a.values + a.size, b.values, b.values + b.size, back_inserter(values));
+            }
+            if (values.size() > ARRAY_LIMIT) {
+                words.assign(BITMAP_WORDS, 0);
+                for (uint16_t value : values) {
+                    setBit(words.data(), value);
+                }
+                appendBitmap(high, words.data());
+            } else {
+                appendArray(high, values.data(), values.size());
+            }
+        } else if (op == AND) {
+            const View& array = a.words ? b : a;
+            const View& bitmap = a.words ? a : b;
+            values.clear();
+            for (size_t i = 0; i < array.size; ++i) {
+                if (testBit(bitmap.words, array.values[i])) {
+                    values.push_back(array.values[i]);
+                }
+            }
+            appendArray(high, values.data(), values.size());
+        } else if (op == OR) {
+            const View& array = a.words ? b : a;
+            const View& bitmap = a.words ? a : b;
+            words.assign(bitmap.words, bitmap.words + BITMAP_WORDS);
+            for (size_t i = 0; i < array.size; ++i) {
+                setBit(words.data(), array.values[i]);
+            }
+            appendBitmap(high, words.data());
+        } else if (a.words) {
+            words.assign(a.words, a.words + BITMAP_WORDS);
+            for (size_t i = 0; i < b.size; ++i) {
+                words[b.values[i] >> 6] &= ~(uint64_t(1) << (b.values[i] & 63));
+            }
+            appendBitmap(high, words.data());
+        } else {
+            values.clear();
+            for (size_t i = 0; i < a.size; ++i) {
+                if (!testBit(b.words, a.values[i])) {
+                    values.push_back(a.values[i]);
+                }
+            }
+            appendArray(high, values.data(), values.size());
+        }
+    }
+    
+    // Курсор по номерам контейнеров множества: следующий номер берётся
+    // из containers или из sparse, смотря где он меньше
+    struct Cursor {
+        const UidSet& set;
+        size_t container = 0;
+        size_t single = 0;
+        
+        explicit Cursor(const UidSet& set) : set(set) {}
+        
+        uint64_t nextContainerHigh() const {
+            return container < set.containers.size() ? set.containers[container].high : UINT64_MAX;
+        }
+        
+        bool atSparse() const {
+            return single < set.sparse.size() && (set.sparse[single] >> 16) < nextContainerHigh();
+        }
+        
+        uint64_t high() const {
+            return atSparse() ? set.sparse[single] >> 16 : nextContainerHigh();
+        }
+        
+        // Конец участка sparse перед номером контейнера limit
+        size_t sparseEnd(uint64_t limit) const {
+            const uint64_t* begin = set.sparse.data() + single;
+            const uint64_t* end = set.sparse.data() + set.sparse.size();
+            return limit == UINT64_MAX ? set.sparse.size() : gallop(begin, end, limit << 16) - set.sparse.data();
+        }
+    };
+    
+    void appendUnit(const Cursor& cursor) {
+        if (cursor.atSparse()) {
+            sparse.push_back(cursor.set.sparse[cursor.single]);
+        } else {
+            appendCopy(cursor.set, cursor.set.containers[cursor.container]);
+        }
+    }
+    
+    static void advance(Cursor& cursor) {
+        if (cursor.atSparse()) {
+            ++cursor.single;
+        } else {
+            ++cursor.container;
+        }
+    }
+    
+    static UidSet combine(const UidSet& a, const UidSet& b, Operation op) {
+        TRACE_SPAN("операция над множествами UID");
+        UidSet result;
+        vector<uint16_t> scratchA, scratchB, values;
+        vector<uint64_t> wordsA, wordsB, words;
+        result.sparse.reserve(4 + (op == AND ? min(a.sparse.size(), b.sparse.size())
+                                   : op == OR ? a.sparse.size() + b.sparse.size() : a.sparse.size()));
+        Cursor ca(a), cb(b);
+        for (;;) {
+            uint64_t ha = ca.high(), hb = cb.high();
+            if (ha == UINT64_MAX && hb == UINT64_MAX) {
+                break;
+            }
+            bool sparseA = ca.atSparse(), sparseB = cb.atSparse();
+            if ((sparseA || ha == UINT64_MAX) && (sparseB || hb == UINT64_MAX)) {
+                // Участок, где у обоих операндов только одиночные ключи
+                uint64_t limit = min(ca.nextContainerHigh(), cb.nextContainerHigh());
+                size_t endA = ca.sparseEnd(limit), endB = cb.sparseEnd(limit);
+                result.combineSparse(a.sparse.data() + ca.single, endA - ca.single,
+                                     b.sparse.data() + cb.single, endB - cb.single, op);
+                ca.single = endA;
+                cb.single = endB;
+            } else if (ha < hb) {
+                if (op != AND) {
+                    result.appendUnit(ca);
+                }
+                advance(ca);
+            } else if (hb < ha) {
+                if (op == OR) {
+                    result.appendUnit(cb);
+                }
+                advance(cb);
+            } else {
+                // Одиночный ключ против контейнера: массив из одного значения
+                uint16_t lowA = static_cast<uint16_t>(sparseA ? a.sparse[ca.single] : 0);
+                uint16_t lowB = static_cast<uint16_t>(sparseB ? b.sparse[cb.single] : 0);
+                View va, vb;
+                if (sparseA) {
+                    va.values = &lowA;
+                    va.size = 1;
+                } else {
+                    va = a.view(a.containers[ca.container], scratchA, wordsA);
+                }
+                if (sparseB) {
+                    vb.values = &lowB;
+                    vb.size = 1;
+                } else {
+                    vb = b.view(b.containers[cb.container], scratchB, wordsB);
+                }
+                result.combineContainers(ha, va, vb, op, values, words);
+                advance(ca);
+                advance(cb);
+            }
+        }
+        return result;
+    }
+    
+public:
+    // Построение из возрастающей последовательности упакованных ключей
+    static UidSet fromSortedKeys(const uint64_t* keys, size_t n) {
+        UidSet set;
+        vector<uint16_t> values;
+        vector<uint64_t> words;
+        for (size_t i = 0; i < n;) {
+            uint64_t high = keys[i] >> 16;
+            values.clear();
+            for (; i < n && (keys[i] >> 16) == high; ++i) {
+                if (values.empty() || values.back() != static_cast<uint16_t>(keys[i])) {
+                    values.push_back(static_cast<uint16_t>(keys[i]));
+                }
+            }
+            if (values.size() > ARRAY_LIMIT) {
+                words.assign(BITMAP_WORDS, 0);
+                for (uint16_t value : values) {
+                    setBit(words.data(), value);
+                }
+                set.appendBitmap(high, words.data());
+            } else {
+                set.appendArray(high, values.data(), values.size());
+            }
+        }
+        return set;
+    }
+    
+    template <typename Index>
+    static UidSet fromDatabase(const Database<Index>& db) {
+        vector<uint64_t> keys;
+        keys.reserve(db.size());
+        db.forEachRecord([&](const Record& record) {
+            keys.push_back(packUid(record.getUid()));
+        });
+        sort(keys.begin(), keys.end());
+        return fromSortedKeys(keys.data(), keys.size());
+    }
+    
+    static UidSet intersect(const UidSet& a, const UidSet& b) { return combine(a, b, AND); }
+    static UidSet unite(const UidSet& a, const UidSet& b) { return combine(a, b, OR); }
+    static UidSet subtract(const UidSet& a, const UidSet& b) { return combine(a, b, ANDNOT); }
+    
+    bool contains(uint64_t key) const {
+        auto it = lower_bound(containers.begin(), containers.end(), key >> 16,
+                              [](const Container& c, uint64_t high) { return c.high < high; });
+        if (it == containers.end() || it->high != key >> 16) {
+            return binary_search(sparse.begin(), sparse.end(), key);
+        }
+        uint16_t low = static_cast<uint16_t>(key);
+        if (it->type() == BITMAP) {
+            return testBit(&bitmaps[size_t(it->offset) * BITMAP_WORDS], low);
+        }
+        const uint16_t* data = &arrays[it->offset];
+        if (it->type() == ARRAY) {
+            return binary_search(data, data + it->count(), low);
+        }
+        for (uint32_t r = 0; r < it->count(); ++r) {
+            if (low >= data[2 * r] && low <= uint32_t(data[2 * r]) + data[2 * r + 1]) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    uint64_t cardinality() const {
+        uint64_t total = sparse.size();
+        for (const Container& c : containers) {
+            if (c.type() != RUN) {
+                total += c.count();
+            } else {
+                for (uint32_t r = 0; r < c.count(); ++r) {
+                    total += size_t(arrays[c.offset + 2 * r + 1]) + 1;
+                }
+            }
+        }
+        return total;
+    }
+    
+    // Перевод контейнеров в серии там, где это компактнее
+    void runOptimize() {
+        UidSet optimized;
+        vector<uint16_t> scratch, runs;
+        vector<uint64_t> scratchWords;
+        for (const Container& c : containers) {
+            View v = view(c, scratch, scratchWords);
+            runs.clear();
+            if (v.words) {
+                for (uint32_t value = 0; value < 65536; ++value) {
+                    if (testBit(v.words, static_cast<uint16_t>(value))) {
+                        if (!runs.empty() && uint32_t(runs[runs.size() - 2]) + runs.back() + 1 == value) {
+                            ++runs.back();
+                        } else {
+                            runs.push_back(static_cast<uint16_t>(value));
+                            runs.push_back(0);
+                        }
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < v.size; ++i) {
+                    if (!runs.empty() && uint32_t(runs[runs.size() - 2]) + runs.back() + 1 == v.values[i]) {
+                        ++runs.back();
+                    } else {
+                        runs.push_back(v.values[i]);
+                        runs.push_back(0);
+                    }
+                }
+            }
+            size_t current = v.words ? BITMAP_WORDS * sizeof(uint64_t) : v.size * sizeof(uint16_t);
+            if (runs.size() * sizeof(uint16_t) < current) {
+                optimized.containers.push_back({c.high, static_cast<uint32_t>(optimized.arrays.size()),
+                                                RUN << 30 | static_cast<uint32_t>(runs.size() / 2)});
+                optimized.arrays.insert(optimized.arrays.end(), runs.begin(), runs.end());
+            } else if (v.words) {
+                optimized.appendBitmap(c.high, v.words);
+            } else {
+                optimized.appendArray(c.high, v.values, v.size);
+            }
+        }
+        optimized.sparse = move(sparse);
+        *this = move(optimized);
+    }
+    
+    size_t containerCount() const { return containers.size(); }
+    size_t sparseCount() const { return sparse.size(); }
+    
+    size_t memoryUsage() const {
+        return containers.size() * sizeof(Container) + arrays.size() * sizeof(uint16_t)
+             + bitmaps.size() * sizeof(uint64_t) + sparse.size() * sizeof(uint64_t);
+    }
+};
+
+// Фоновое сохранение снимка (аналог BGSAVE): дочерний процесс получает
+// копию адресного пространства на момент fork() и пишет снимок, пока
+// родитель продолжает обслуживать запросы. Страницы копируются ядром
+// только при записи в них родителем, поэтому поиск (только чтение)
+// не увеличивает потребление памяти. Чтобы вставки во время сохранения
+// не перестраивали индекс и вектор записей целиком, место под них
+// стоит зарезервировать заранее (Database::reserve).
+// Снимок пишется во временный файл и атомарно переименовывается.
+template <typename Index>
+pid_t startBackgroundSave(const Database<Index>& db, uint64_t lsn, const string& path) {
+    TRACE_SPAN("запуск фонового сохранения");
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw runtime_error(string("fork не удался: ") + strerror(errno));
+    }
+    if (pid == 0) {
+        int code = 0;
+        try {
+            string temporary = path + ".tmp";
+            {
+                ofstream out(temporary, ios::binary | ios::trunc);
+                writeSnapshot(db, lsn, out);
+                out.flush();
+                if (!out) {
+                    throw runtime_error("Ошибка записи " + temporary);
+                }
+            }
+            if (rename(temporary.c_str(), path.c_str()) != 0) {
+                throw runtime_error("Не удалось переименовать " + temporary);
+            }
+        } catch (const exception& e) {
+            cerr << "[фоновое сохранение] " << e.what() << endl;
+            code = 1;
+        }
+        _exit(code);
+    }
+    return pid;
+}
+
+// Ожидание процесса сохранения. block = false - только проверка;
+// возвращает true, если процесс завершился, success - результат
+bool pollBackgroundSave(pid_t pid, bool block, bool& success) {
+    int status = 0;
+    pid_t result = waitpid(pid, &status, block ? 0 : WNOHANG);
+    if (result == 0) {
+        return false;
+    }
+    success = result == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return true;
+}
+
+// Значение поля (в КБ) из /proc/<pid>/status или smaps_rollup
+size_t readProcKb(pid_t pid, const string& file, const string& field) {
+    ifstream in("/proc/" + to_string(pid) + "/" + file);
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, field.size(), field) == 0 && line.size() > field.size()
+            && line[field.size()] == ':') {
+            return stoull(line.substr(field.size() + 1));
+        }
+    }
+    return 0;
+}
+
+// Сетевые сокеты. Адрес задаётся как "unix:/путь/к/сокету" или
+// "tcp:порт" (только localhost); строка без префикса - путь Unix-сокета.
+int openSocket(const string& address, sockaddr_storage& addr, socklen_t& length) {
+    memset(&addr, 0, sizeof(addr));
+    if (address.compare(0, 4, "tcp:") == 0) {
+        sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&addr);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(static_cast<uint16_t>(stoi(address.substr(4))));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof(sockaddr_in);
+    } else {
+        string path = address.compare(0, 5, "unix:") == 0 ? address.substr(5) : address;
+        sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&addr);
+        if (path.size() >= sizeof(un->sun_path)) {
+            throw invalid_argument("Слишком длинный путь сокета: " + path);
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        length = sizeof(sockaddr_un);
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw runtime_error(string("Не удалось создать сокет: ") + strerror(errno));
+    }
+    if (addr.ss_family == AF_INET) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+int listenOn(const string& address) {
+    sockaddr_storage addr;
+    socklen_t length;
+    int fd = openSocket(address, addr, length);
+    if (addr.ss_family == AF_UNIX) {
+        unlink(reinterpret_cast<sockaddr_un*>(&addr)->sun_path);
+    } else {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), length) < 0 || listen(fd, 64) < 0) {
+        close(fd);
+        throw runtime_error("Не удалось открыть " + address + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// Подключение с повторными попытками, пока сервер запускается
+int connectTo(const string& address, int attempts = 50) {
+    for (int attempt = 0;; ++attempt) {
+        sockaddr_storage addr;
+        socklen_t length;
+        int fd = openSocket(address, addr, length);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), length) == 0) {
+            return fd;
+        }
+        close(fd);
+        if (attempt + 1 >= attempts) {
+            throw runtime_error("Не удалось подключиться к " + address + ": " + strerror(errno));
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+}
+
+void sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error(string("Ошибка отправки: ") + strerror(errno));
+        }
+        data += sent;
+        size -= sent;
+    }
+}
+
+// Возвращает false, если соединение закрыто до начала данных
+bool recvAll(int fd, char* data, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t n = recv(fd, data + received, size - received, 0);
+        if (n == 0 && received == 0) {
+            return false;
+        }
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            throw runtime_error("Соединение прервано");
+        }
+        received += n;
+    }
+    return true;
+}
+
+// Кадр протокола: u8 тип, u32 длина, содержимое
+void sendFrame(int fd, uint8_t type, const string& payload) {
+    string header;
+    putValue<uint8_t>(header, type);
+    putValue<uint32_t>(header, static_cast<uint32_t>(payload.size()));
+    sendAll(fd, header.data(), header.size());
+    sendAll(fd, payload.data(), payload.size());
+}
+
+// Отправка набора буферов целиком одним или несколькими sendmsg (после
+// частичной отправки - с места остановки); iov изменяется. С флагом
+// MSG_ZEROCOPY возвращает число вызовов, о завершении которых ядро
+// пришлёт уведомление (см. awaitZeroCopy)
+size_t sendAllv(int fd, vector<iovec>& iov, int flags = 0) {
+    size_t first = 0, zeroCopyCalls = 0;
+    while (true) {
+        while (first < iov.size() && iov[first].iov_len == 0) {
+            ++first;
+        }
+        if (first == iov.size()) {
+            return zeroCopyCalls;
+        }
+        msghdr msg = {};
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+#ifdef MSG_ZEROCOPY
+            // Исчерпан лимит закреплённой памяти сокета: обычная отправка
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+#endif
+            throw runtime_error(string("Ошибка отправки: ") + strerror(errno));
+        }
+#ifdef MSG_ZEROCOPY
+        zeroCopyCalls += (flags & MSG_ZEROCOPY) != 0;
+#endif
+        size_t left = sent;
+        while (left > 0 && left >= iov[first].iov_len) {
+            left -= iov[first].iov_len;
+            ++first;
+        }
+        if (left > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+            iov[first].iov_len -= left;
+        }
+    }
+}
+
+// Включение MSG_ZEROCOPY на TCP-сокете
+bool enableZeroCopy(int fd) {
+#if defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    int one = 1;
+    return getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) == 0
+        && (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)
+        && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+// Ожидание уведомлений о завершении calls отправок с MSG_ZEROCOPY: до
+// них ядро ещё читает отправленные буферы. Возвращает число отправок,
+// которые ядро всё же выполнило копированием
+size_t awaitZeroCopy(int fd, size_t calls) {
+    size_t copied = 0;
+#if defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while (calls > 0) {
+        char control[256];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                throw runtime_error(string("Ошибка очереди уведомлений: ") + strerror(errno));
+            }
+            pollfd pfd = {fd, 0, 0};
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            bool recvErr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                        || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            const sock_extended_err* err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            if (recvErr && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                // Одно уведомление покрывает отправки с номерами [ee_info, ee_data]
+                size_t completed = err->ee_data - err->ee_info + 1;
+                calls -= min(calls, completed);
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    copied += completed;
+                }
+            }
+        }
+    }
+#else
+    (void)fd;
+    (void)calls;
+#endif
+    return copied;
+}
+
+bool recvFrame(int fd, uint8_t& type, string& payload) {
+    char header[5];
+    if (!recvAll(fd, header, sizeof(header))) {
+        return false;
+    }
+    uint32_t length;
+    type = static_cast<uint8_t>(header[0]);
+    memcpy(&length, header + 1, sizeof(length));
+    payload.resize(length);
+    if (length > 0 && !recvAll(fd, &payload[0], length)) {
+        throw runtime_error("Соединение прервано");
+    }
+    return true;
+}
+
+// Процессорное время текущего потока
+inline uint64_t threadCpuNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline int64_t wallClockMicros() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Репликация лидер -> реплики передачей журнала.
+// Реплика подключается и сообщает последний применённый LSN (0 - пустая);
+// пустая реплика сначала получает снимок, затем лидер отправляет журнал
+// пакетами с места снимка. Пакет содержит LSN лидера и время отправки,
+// по ним реплика считает отставание.
+enum ReplicationFrame : uint8_t {
+    REPL_HELLO = 1,
+    REPL_SNAPSHOT = 2,
+    REPL_WAL_BATCH = 3,
+    REPL_HEARTBEAT = 4
+};
+
+template <typename Index>
+class ReplicationLeader {
+private:
+    static constexpr size_t MAX_BATCH_BYTES = 1 << 20;
+    
+    Database<Index>& db;
+    WriteAheadLog& wal;
+    mutable mutex lock;
+    condition_variable walGrown;
+    int listenFd;
+    atomic<bool> stopping{false};
+    thread acceptThread;
+    vector<thread> followerThreads;
+    atomic<int> followers{0};
+    
+    void acceptLoop() {
+        while (!stopping) {
+            pollfd pfd = {listenFd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            lock_guard<mutex> guard(lock);
+            followerThreads.emplace_back(&ReplicationLeader::serveFollower, this, fd);
+        }
+    }
+    
+    void serveFollower(int fd) {
+        ++followers;
+        try {
+            uint8_t type;
+            string payload;
+            if (!recvFrame(fd, type, payload) || type != REPL_HELLO) {
+                throw runtime_error("Ожидалось приветствие реплики");
+            }
+            ByteReader hello(payload.data(), payload.size());
+            uint64_t appliedLsn = hello.get<uint64_t>();
+            
+            size_t offset;
+            if (appliedLsn == 0) {
+                ostringstream snapshot;
+                {
+                    lock_guard<mutex> guard(lock);
+                    writeSnapshot(db, wal.getLastLsn(), snapshot);
+                    offset = wal.sizeBytes();
+                }
+                sendFrame(fd, REPL_SNAPSHOT, snapshot.str());
+            } else {
+                lock_guard<mutex> guard(lock);
+                offset = wal.offsetAfter(appliedLsn);
+            }
+            
+            for (;;) {
+                string chunk;
+                uint64_t leaderLsn;
+                bool finished;
+                {
+                    unique_lock<mutex> guard(lock);
+                    walGrown.wait_for(guard, chrono::milliseconds(100), [&] {
+                        return wal.sizeBytes() > offset || stopping;
+                    });
+                    chunk = wal.read(offset, MAX_BATCH_BYTES);
+                    leaderLsn = wal.getLastLsn();
+                    finished = stopping && offset + chunk.size() == wal.sizeBytes();
+                }
+                string frame;
+                putValue<uint64_t>(frame, leaderLsn);
+                putValue<int64_t>(frame, wallClockMicros());
+                frame += chunk;
+                sendFrame(fd, chunk.empty() ? REPL_HEARTBEAT : REPL_WAL_BATCH, frame);
+                offset += chunk.size();
+                if (finished) {
+                    break;
+                }
+            }
+        } catch (const exception& e) {
+            cerr << "[лидер] Реплика отключена: " << e.what() << endl;
+        }
+        close(fd);
+        --followers;
+    }
+    
+public:
+    ReplicationLeader(Database<Index>& db, WriteAheadLog& wal, const string& address)
+        : db(db), wal(wal), listenFd(listenOn(address)) {
+        acceptThread = thread(&ReplicationLeader::acceptLoop, this);
+    }
+    
+    ~ReplicationLeader() {
+        stop();
+    }
+    
+    // Запись сначала попадает в журнал, затем в базу
+    void addRecord(Record&& record) {
+        {
+            lock_guard<mutex> guard(lock);
+            wal.append(WAL_INSERT, record.getUid(), record.getData());
+            db.addRecord(move(record));
+        }
+        walGrown.notify_all();
+    }
+    
+    // Остановка: реплики получают остаток журнала, после чего соединения закрываются
+    void stop() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        walGrown.notify_all();
+        acceptThread.join();
+        for (thread& follower : followerThreads) {
+            follower.join();
+        }
+        close(listenFd);
+    }
+    
+    uint64_t lastLsn() const {
+        lock_guard<mutex> guard(lock);
+        return wal.getLastLsn();
+    }
+    
+    int followerCount() const { return followers; }
+};
+
+template <typename Index>
+class ReplicationFollower {
+private:
+    Database<Index> db;
+    mutable shared_mutex lock;
+    int fd;
+    thread receiver;
+    atomic<uint64_t> appliedLsn{0};
+    atomic<uint64_t> leaderLsn{0};
+    atomic<int64_t> applyDelayMicros{0};
+    atomic<size_t> batchCount{0};
+    atomic<bool> bootstrapped{false};
+    atomic<bool> connected{true};
+    
+    void receiveLoop() {
+        try {
+            string hello;
+            putValue<uint64_t>(hello, appliedLsn);
+            sendFrame(fd, REPL_HELLO, hello);
+            
+            uint8_t type;
+            string payload;
+            vector<WalEntry> entries;
+            while (recvFrame(fd, type, payload)) {
+                if (type == REPL_SNAPSHOT) {
+                    unique_lock<shared_mutex> guard(lock);
+                    uint64_t lsn = loadSnapshot(db, payload.data(), payload.size());
+                    appliedLsn = lsn;
+                    bootstrapped = true;
+                    continue;
+                }
+                ByteReader reader(payload.data(), payload.size());
+                leaderLsn = reader.get<uint64_t>();
+                int64_t sentAt = reader.get<int64_t>();
+                if (type == REPL_WAL_BATCH) {
+                    entries.clear();
+                    WriteAheadLog::decode(payload.data() + 2 * sizeof(uint64_t),
+                                          payload.size() - 2 * sizeof(uint64_t), entries);
+                    // Пакет применяется под одной эксклюзивной блокировкой
+                    unique_lock<shared_mutex> guard(lock);
+                    for (WalEntry& entry : entries) {
+                        if (entry.lsn > appliedLsn) {
+                            applyWalEntry(db, entry);
+                        }
+                    }
+                    if (!entries.empty()) {
+                        appliedLsn = entries.back().lsn;
+                    }
+                    ++batchCount;
+                }
+                applyDelayMicros = wallClockMicros() - sentAt;
+            }
+        } catch (const exception& e) {
+            cerr << "[реплика] Ошибка репликации: " << e.what() << endl;
+        }
+        connected = false;
+    }
+    
+public:
+    explicit ReplicationFollower(const string& address) : fd(connectTo(address)) {
+        receiver = thread(&ReplicationFollower::receiveLoop, this);
+    }
+    
+    ~ReplicationFollower() {
+        shutdown(fd, SHUT_RDWR);
+        if (receiver.joinable()) {
+            receiver.join();
+        }
+        close(fd);
+    }
+    
+    // Чтение с реплики; данные копируются, так как запись может быть
+    // изменена следующим пакетом журнала
+    bool findRecord(const string& uid, string& data) {
+        shared_lock<shared_mutex> guard(lock);
+        Record* record = db.findRecord(uid);
+        if (!record) {
+            return false;
+        }
+        data = record->getData();
+        return true;
+    }
+    
+    // Ожидание закрытия соединения лидером
+    void waitForDisconnect() {
+        if (receiver.joinable()) {
+            receiver.join();
+        }
+    }
+    
+    size_t size() const {
+        shared_lock<shared_mutex> guard(lock);
+        return db.size();
+    }
+    
+    // Отставание в записях журнала
+    uint64_t replicationLag() const {
+        uint64_t leader = leaderLsn, applied = appliedLsn;
+        return leader > applied ? leader - applied : 0;
+    }
+    
+    uint64_t getAppliedLsn() const { return appliedLsn; }
+    uint64_t getLeaderLsn() const { return leaderLsn; }
+    int64_t getApplyDelayMicros() const { return applyDelayMicros; }
+    size_t getBatchCount() const { return batchCount; }
+    bool isBootstrapped() const { return bootstrapped; }
+    bool isConnected() const { return connected; }
+};
+
+// Удалённые подписчики потока изменений. Сервер сначала отправляет
+// подписчику снимок базы (CDC_RESYNC: u64 номер первого следующего
+// события, снимок), затем события пакетами (CDC_EVENTS: N x (u64 номер,
+// u8 операция, u8 полнота, 7 байт UID, u32 длина, данные)). Если
+// подписчик отстал больше чем на размер кольца, он снова получает снимок.
+// snapshotSource вызывается из потоков сервера и должен сам
+// синхронизироваться с писателями базы.
+enum ChangeFeedFrame : uint8_t {
+    CDC_RESYNC = 1,
+    CDC_EVENTS = 2,
+    CDC_HEARTBEAT = 3
+};
+
+class ChangeFeedServer {
+private:
+    static constexpr size_t MAX_BATCH_EVENTS = 4096;
+    
+    ChangeFeed& feed;
+    function<string()> snapshotSource;
+    int listenFd;
+    atomic<bool> stopping{false};
+    thread acceptThread;
+    mutex lock;
+    vector<thread> subscriberThreads;
+    atomic<int> subscribers{0};
+    atomic<size_t> resyncs{0};
+    
+    void acceptLoop() {
+        while (!stopping) {
+            pollfd pfd = {listenFd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            lock_guard<mutex> guard(lock);
+            subscriberThreads.emplace_back(&ChangeFeedServer::serveSubscriber, this, fd);
+        }
+    }
+    
+    void serveSubscriber(int fd) {
+        ++subscribers;
+        try {
+            uint64_t next = 0;
+            auto resync = [&]() {
+                next = feed.headSequence();
+                string frame;
+                putValue<uint64_t>(frame, next);
+                frame += snapshotSource();
+                sendFrame(fd, CDC_RESYNC, frame);
+                ++resyncs;
+            };
+            resync();
+            
+            vector<ChangeEvent> events;
+            auto lastSent = chrono::steady_clock::now();
+            for (;;) {
+                bool finishing = stopping;
+                events.clear();
+                if (!feed.read(next, events, MAX_BATCH_EVENTS)) {
+                    resync();
+                    continue;
+                }
+                if (events.empty()) {
+                    if (finishing && next == feed.headSequence()) {
+                        break;
+                    }
+                    if (chrono::steady_clock::now() - lastSent > chrono::milliseconds(100)) {
+                        sendFrame(fd, CDC_HEARTBEAT, string());
+                        lastSent = chrono::steady_clock::now();
+                    }
+                    this_thread::sleep_for(chrono::microseconds(200));
+                    continue;
+                }
+                string frame;
+                for (const ChangeEvent& event : events) {
+                    putValue<uint64_t>(frame, event.sequence);
+                    putValue<uint8_t>(frame, event.op);
+                    putValue<uint8_t>(frame, event.complete);
+                    frame.append(event.uid);
+                    putValue<uint32_t>(frame, static_cast<uint32_t>(event.data.size()));
+                    frame.append(event.data);
+                }
+                sendFrame(fd, CDC_EVENTS, frame);
+                lastSent = chrono::steady_clock::now();
+            }
+        } catch (const exception& e) {
+            cerr << "[поток изменений] Подписчик отключён: " << e.what() << endl;
+        }
+        close(fd);
+        --subscribers;
+    }
+    
+public:
+    ChangeFeedServer(ChangeFeed& feed, function<string()> snapshotSource, const string& address)
+        : feed(feed), snapshotSource(move(snapshotSource)), listenFd(listenOn(address)) {
+        acceptThread = thread(&ChangeFeedServer::acceptLoop, this);
+    }
+    
+    ~ChangeFeedServer() {
+        stop();
+    }
+    
+    // Остановка: подписчики получают события, опубликованные до вызова
+    void stop() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        acceptThread.join();
+        for (thread& subscriber : subscriberThreads) {
+            subscriber.join();
+        }
+        close(listenFd);
+    }
+    
+    int subscriberCount() const { return subscribers; }
+    size_t resyncCount() const { return resyncs; }
+};
+
+// Удалённый подписчик: поддерживает локальную копию базы (кэш) по снимку
+// и событиям. Событие без данных (complete = false) сбрасывает запись из
+// копии, её нужно перечитать с основной базы
+template <typename Index>
+class ChangeFeedSubscriber {
+private:
+    Database<Index> cache;
+    mutable shared_mutex lock;
+    int fd;
+    thread receiver;
+    atomic<uint64_t> nextSequence{0};
+    atomic<size_t> appliedEvents{0};
+    atomic<size_t> resyncs{0};
+    atomic<size_t> frames{0};
+    
+    void receiveLoop() {
+        try {
+            uint8_t type;
+            string payload;
+            while (recvFrame(fd, type, payload)) {
+                ByteReader reader(payload.data(), payload.size());
+                if (type == CDC_RESYNC) {
+                    uint64_t sequence = reader.get<uint64_t>();
+                    unique_lock<shared_mutex> guard(lock);
+                    loadSnapshot(cache, payload.data() + sizeof(uint64_t), payload.size() - sizeof(uint64_t));
+                    nextSequence = sequence;
+                    ++resyncs;
+                } else if (type == CDC_EVENTS) {
+                    unique_lock<shared_mutex> guard(lock);
+                    while (!reader.atEnd()) {
+                        uint64_t sequence = reader.get<uint64_t>();
+                        uint8_t op = reader.get<uint8_t>();
+                        bool complete = reader.get<uint8_t>() != 0;
+                        string uid = reader.getBytes(7);
+                        string data = reader.getBytes(reader.get<uint32_t>());
+                        if (op == BatchOp::ERASE || !complete) {
+                            cache.eraseRecord(uid);
+                        } else if (op == BatchOp::INSERT || !cache.updateRecord(uid, data)) {
+                            cache.addRecord(Record(uid, data));
+                        }
+                        nextSequence = sequence + 1;
+                        ++appliedEvents;
+                    }
+                    ++frames;
+                }
+            }
+        } catch (const exception& e) {
+            cerr << "[подписчик] Ошибка потока изменений: " << e.what() << endl;
+        }
+    }
+    
+public:
+    explicit ChangeFeedSubscriber(const string& address) : fd(connectTo(address)) {
+        receiver = thread(&ChangeFeedSubscriber::receiveLoop, this);
+    }
+    
+    ~ChangeFeedSubscriber() {
+        shutdown(fd, SHUT_RDWR);
+        if (receiver.joinable()) {
+            receiver.join();
+        }
+        close(fd);
+    }
+    
+    bool findRecord(const string& uid, string& data) {
+        shared_lock<shared_mutex> guard(lock);
+        Record* record = cache.findRecord(uid);
+        if (!record) {
+            return false;
+        }
+        data = record->getData();
+        return true;
+    }
+    
+    // Ожидание закрытия соединения сервером
+    void waitForDisconnect() {
+        if (receiver.joinable()) {
+            receiver.join();
+        }
+    }
+    
+    size_t size() const {
+        shared_lock<shared_mutex> guard(lock);
+        return cache.size();
+    }
+    
+    uint64_t getNextSequence() const { return nextSequence; }
+    size_t getAppliedEvents() const { return appliedEvents; }
+    size_t getResyncCount() const { return resyncs; }
+    size_t getFrameCount() const { return frames; }
+};
+
+// Кластерный режим: каждый серверный процесс владеет частью UID,
+// распределение задаётся кольцом согласованного хэширования
+// с виртуальными узлами. Протокол - кадры sendFrame/recvFrame:
+//   PUT:  u32 N, N x (7 байт UID, u32 длина, данные)       -> OK
+//   GET:  u32 N, N x 7 байт UID                           -> RESULT
+//   RESULT: N x (u8 найдено, u32 длина, данные)
+//   STATS: -> u64 записей, u64 байт индекса
+enum ClusterFrame : uint8_t {
+    CLUSTER_PUT = 16,
+    CLUSTER_GET = 17,
+    CLUSTER_RESULT = 18,
+    CLUSTER_STATS = 19,
+    CLUSTER_SHUTDOWN = 20,
+    CLUSTER_OK = 21
+};
+
+// Кольцо согласованного хэширования: каждый узел представлен
+// virtualNodes точками, ключ принадлежит первой точке по часовой стрелке
+class HashRing {
+private:
+    vector<pair<uint64_t, uint32_t>> points;
+    
+public:
+    HashRing(size_t shards, size_t virtualNodes) {
+        points.reserve(shards * virtualNodes);
+        for (size_t shard = 0; shard < shards; ++shard) {
+            for (size_t v = 0; v < virtualNodes; ++v) {
+                points.emplace_back(mixHash((uint64_t(shard) << 32) | v), static_cast<uint32_t>(shard));
+            }
+        }
+        sort(points.begin(), points.end());
+    }
+    
+    uint32_t shardFor(uint64_t key) const {
+        uint64_t h = mixHash(key);
+        auto it = upper_bound(points.begin(), points.end(), make_pair(h, UINT32_MAX));
+        return it == points.end() ? points.front().second : it->second;
+    }
+};
+
+// Сборка ответа на пакетный поиск
+enum ResponsePath {
+    RESPONSE_COPY,      // данные копируются в буфер ответа
+    RESPONSE_SCATTER,   // длинные данные отправляются прямо из записей
+    RESPONSE_ZEROCOPY   // то же, крупные ответы по TCP - с MSG_ZEROCOPY
+};
+
+class ClusterServer {
+private:
+    static constexpr size_t ZEROCOPY_MIN_REPLY = 64 * 1024;
+    
+    Database<CuckooIndex> db;
+    EpochManager epochs;
+    shared_mutex lock;
+    int listenFd;
+    ResponsePath path;
+    atomic<bool> stopping{false};
+    vector<thread> connections;
+    atomic<uint64_t> getCpuNanos{0};
+    atomic<uint64_t> getBytes{0};
+    atomic<uint64_t> zeroCopySends{0};
+    atomic<uint64_t> copiedSends{0};
+    
+    // Ответ без копирования длинных данных: заголовки и короткие данные
+    // собираются в буфер, длинные данные отправляются из записей. Эпоха
+    // закреплена до конца отправки, поэтому одновременная замена записи
+    // не освобождает отправляемые данные
+    size_t sendScattered(int fd, ByteReader& reader, uint32_t count, bool zeroCopy) {
+        struct Segment {
+            const char* external;  // nullptr - участок буфера inlineBytes
+            size_t offset;
+            size_t length;
+        };
+        string inlineBytes(5, '\0');  // место под заголовок кадра
+        vector<Segment> segments;
+        EpochManager::Guard pin = epochs.pin();
+        {
+            shared_lock<shared_mutex> guard(lock);
+            size_t inlineStart = 0;
+            for (uint32_t i = 0; i < count; ++i) {
+                Record* record = db.findRecord(reader.getBytes(7));
+                putValue<uint8_t>(inlineBytes, record != nullptr);
+                putValue<uint32_t>(inlineBytes, record ? static_cast<uint32_t>(record->getData().size()) : 0);
+                if (!record) {
+                    continue;
+                }
+                const string& data = record->getData();
+                if (data.size() >= EpochManager::PIN_MIN_BYTES) {
+                    segments.push_back({nullptr, inlineStart, inlineBytes.size() - inlineStart});
+                    segments.push_back({data.data(), 0, data.size()});
+                    inlineStart = inlineBytes.size();
+                } else {
+                    inlineBytes += data;
+                }
+            }
+            segments.push_back({nullptr, inlineStart, inlineBytes.size() - inlineStart});
+        }
+        
+        size_t total = 0;
+        vector<iovec> iov;
+        iov.reserve(segments.size());
+        for (const Segment& segment : segments) {
+            const char* base = segment.external ? segment.external : inlineBytes.data() + segment.offset;
+            iov.push_back({const_cast<char*>(base), segment.length});
+            total += segment.length;
+        }
+        inlineBytes[0] = static_cast<char>(CLUSTER_RESULT);
+        uint32_t length = static_cast<uint32_t>(total - 5);
+        memcpy(&inlineBytes[1], &length, sizeof(length));
+        
+        int flags = 0;
+#ifdef MSG_ZEROCOPY
+        if (zeroCopy && total >= ZEROCOPY_MIN_REPLY) {
+            flags = MSG_ZEROCOPY;
+        }
+#endif
+        size_t calls = sendAllv(fd, iov, flags);
+        if (calls > 0) {
+            zeroCopySends += calls;
+            copiedSends += awaitZeroCopy(fd, calls);
+        }
+        return total;
+    }
+    
+    void serve(int fd) {
+        try {
+            uint8_t type;
+            string payload;
+            bool zeroCopy = path == RESPONSE_ZEROCOPY && enableZeroCopy(fd);
+            while (!stopping && recvFrame(fd, type, payload)) {
+                ByteReader reader(payload.data(), payload.size());
+                string response;
+                if (type == CLUSTER_PUT) {
+                    uint32_t count = reader.get<uint32_t>();
+                    unique_lock<shared_mutex> guard(lock);
+                    for (uint32_t i = 0; i < count; ++i) {
+                        string uid = reader.getBytes(7);
+                        string data = reader.getBytes(reader.get<uint32_t>());
+                        db.addRecord(Record(uid, data));
+                    }
+                    sendFrame(fd, CLUSTER_OK, response);
+                } else if (type == CLUSTER_GET) {
+                    uint64_t cpuStart = threadCpuNanos();
+                    uint32_t count = reader.get<uint32_t>();
+                    if (path == RESPONSE_COPY) {
+                        shared_lock<shared_mutex> guard(lock);
+                        for (uint32_t i = 0; i < count; ++i) {
+                            Record* record = db.findRecord(reader.getBytes(7));
+                            putValue<uint8_t>(response, record != nullptr);
+                            putValue<uint32_t>(response, record ? static_cast<uint32_t>(record->getData().size()) : 0);
+                            if (record) {
+                                response += record->getData();
+                            }
+                        }
+                        guard.unlock();
+                        sendFrame(fd, CLUSTER_RESULT, response);
+                        getBytes += response.size() + 5;
+                    } else {
+                        getBytes += sendScattered(fd, reader, count, zeroCopy);
+                    }
+                    getCpuNanos += threadCpuNanos() - cpuStart;
+                } else if (type == CLUSTER_STATS) {
+                    shared_lock<shared_mutex> guard(lock);
+                    putValue<uint64_t>(response, db.size());
+                    putValue<uint64_t>(response, db.getIndex().memoryUsage());
+                    guard.unlock();
+                    sendFrame(fd, CLUSTER_OK, response);
+                } else if (type == CLUSTER_SHUTDOWN) {
+                    stopping = true;
+                    sendFrame(fd, CLUSTER_OK, response);
+                } else {
+                    throw runtime_error("Неизвестный тип кадра: " + to_string(type));
+                }
+            }
+        } catch (const exception& e) {
+            cerr << "[сервер] Соединение закрыто: " << e.what() << endl;
+        }
+        close(fd);
+    }
+    
+public:
+    explicit ClusterServer(const string& address, ResponsePath path = RESPONSE_ZEROCOPY)
+        : listenFd(listenOn(address)), path(path) {
+        db.attachEpochManager(&epochs);
+    }
+    
+    ~ClusterServer() {
+        close(listenFd);
+    }
+    
+    // Обслуживание клиентов до получения команды SHUTDOWN
+    void run() {
+        while (!stopping) {
+            pollfd pfd = {listenFd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0) {
+                connections.emplace_back(&ClusterServer::serve, this, fd);
+            }
+        }
+        for (thread& connection : connections) {
+            connection.join();
+        }
+    }    
+    // Процессорное время и объём ответов на пакетный поиск
+    uint64_t responseCpuNanos() const { return getCpuNanos; }
+    uint64_t responseBytes() const { return getBytes; }
+    uint64_t zeroCopySendCount() const { return zeroCopySends; }
+    uint64_t copiedZeroCopySends() const { return copiedSends; }
+    EpochManager& getEpochManager() { return epochs; }
+};
+
+// Клиент кластера: пакет разбивается по шардам, запросы отправляются
+// всем шардам сразу (серверы обрабатывают их одновременно), затем ответы
+// собираются в исходном порядке ключей
+class ClusterClient {
+private:
+    vector<int> fds;
+    HashRing ring;
+    
+    // Разбиение ключей по шардам: позиции ключей в исходном пакете
+    vector<vector<uint32_t>> partition(const vector<string>& uids) const {
+        vector<vector<uint32_t>> positions(fds.size());
+        for (size_t i = 0; i < uids.size(); ++i) {
+            positions[ring.shardFor(packUid(uids[i]))].push_back(static_cast<uint32_t>(i));
+        }
+        return positions;
+    }
+    
+    string receive(int fd, uint8_t expected) {
+        uint8_t type;
+        string payload;
+        if (!recvFrame(fd, type, payload) || type != expected) {
+            throw runtime_error("Неожиданный ответ сервера кластера");
+        }
+        return payload;
+    }
+    
+public:
+    ClusterClient(const vector<string>& addresses, size_t virtualNodes = 128)
+        : ring(addresses.size(), virtualNodes) {
+        for (const string& address : addresses) {
+            fds.push_back(connectTo(address));
+        }
+    }
+    
+    ~ClusterClient() {
+        for (int fd : fds) {
+            close(fd);
+        }
+    }
+    
+    ClusterClient(const ClusterClient&) = delete;
+    ClusterClient& operator=(const ClusterClient&) = delete;
+    
+    void put(const vector<Record>& records) {
+        vector<string> uids;
+        uids.reserve(records.size());
+        for (const Record& record : records) {
+            uids.push_back(record.getUid());
+        }
+        vector<vector<uint32_t>> positions = partition(uids);
+        for (size_t shard = 0; shard < fds.size(); ++shard) {
+            if (positions[shard].empty()) {
+                continue;
+            }
+            string request;
+            putValue<uint32_t>(request, static_cast<uint32_t>(positions[shard].size()));
+            for (uint32_t i : positions[shard]) {
+                request += records[i].getUid();
+                putValue<uint32_t>(request, static_cast<uint32_t>(records[i].getData().size()));
+                request += records[i].getData();
+            }
+            sendFrame(fds[shard], CLUSTER_PUT, request);
+        }
+        for (size_t shard = 0; shard < fds.size(); ++shard) {
+            if (!positions[shard].empty()) {
+                receive(fds[shard], CLUSTER_OK);
+            }
+        }
+    }
+    
+    // found[i] и data[i] соответствуют uids[i]
+    void multiGet(const vector<string>& uids, vector<uint8_t>& found, vector<string>& data) {
+        vector<vector<uint32_t>> positions = partition(uids);
+        for (size_t shard = 0; shard < fds.size(); ++shard) {
+            if (positions[shard].empty()) {
+                continue;
+            }
+            string request;
+            putValue<uint32_t>(request, static_cast<uint32_t>(positions[shard].size()));
+            for (uint32_t i : positions[shard]) {
+                request += uids[i];
+            }
+            sendFrame(fds[shard], CLUSTER_GET, request);
+        }
+        
+        found.assign(uids.size(), 0);
+        data.assign(uids.size(), string());
+        for (size_t shard = 0; shard < fds.size(); ++shard) {
+            if (positions[shard].empty()) {
+                continue;
+            }
+            string response = receive(fds[shard], CLUSTER_RESULT);
+            ByteReader reader(response.data(), response.size());
+            for (uint32_t i : positions[shard]) {
+                found[i] = reader.get<uint8_t>();
+                data[i] = reader.getBytes(reader.get<uint32_t>());
+            }
+        }
+    }
+    
+    // Число записей и память индекса по шардам
+    vector<pair<uint64_t, uint64_t>> stats() {
+        vector<pair<uint64_t, uint64_t>> result;
+        for (int fd : fds) {
+            sendFrame(fd, CLUSTER_STATS, string());
+        }
+        for (int fd : fds) {
+            string response = receive(fd, CLUSTER_OK);
+            ByteReader reader(response.data(), response.size());
+            uint64_t records = reader.get<uint64_t>();
+            result.emplace_back(records, reader.get<uint64_t>());
+        }
+        return result;
+    }
+    
+    void shutdownServers() {
+        for (int fd : fds) {
+            sendFrame(fd, CLUSTER_SHUTDOWN, string());
+        }
+        for (int fd : fds) {
+            receive(fd, CLUSTER_OK);
+        }
+    }
+    
+    size_t shardCount() const { return fds.size(); }
+};
+
+
+// Клиент с объединением запросов: одиночные поиски из многих потоков
+// собираются в пакеты, которые уходят на серверы, как только набралось
+// maxBatch ключей или прошло window с первого ожидающего запроса. Пока
+// пакет в пути, следующие запросы копятся в очереди. Ответы раздаются
+// по future каждого вызова.
+class CoalescingClient {
+public:
+    struct Result {
+        bool found = false;
+        string data;
+    };
+    
+private:
+    struct Pending {
+        string uid;
+        promise<Result> result;
+    };
+    
+    ClusterClient client;
+    size_t maxBatch;
+    chrono::microseconds window;
+    mutex lock;
+    condition_variable wake;
+    vector<Pending> pending;
+    chrono::steady_clock::time_point oldest;
+    bool stopping = false;
+    size_t batches = 0;
+    size_t keys = 0;
+    thread flusher;
+    
+    void send(vector<Pending>& batch) {
+        vector<string> uids;
+        uids.reserve(batch.size());
+        for (const Pending& request : batch) {
+            uids.push_back(request.uid);
+        }
+        vector<uint8_t> found;
+        vector<string> data;
+        try {
+            client.multiGet(uids, found, data);
+        } catch (...) {
+            for (Pending& request : batch) {
+                request.result.set_exception(current_exception());
+            }
+            return;
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i].result.set_value(Result{found[i] != 0, move(data[i])});
+        }
+    }
+    
+    void flushLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&]() { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            wake.wait_until(guard, oldest + window, [&]() { return stopping || pending.size() >= maxBatch; });
+            vector<Pending> ready;
+            ready.swap(pending);
+            batches += (ready.size() + maxBatch - 1) / maxBatch;
+            keys += ready.size();
+            guard.unlock();
+            // Набравшееся сверх maxBatch за время предыдущей отправки
+            // уходит несколькими кадрами
+            for (size_t begin = 0; begin < ready.size(); begin += maxBatch) {
+                vector<Pending> batch(make_move_iterator(ready.begin() + begin),
+                                      make_move_iterator(ready.begin() + min(begin + maxBatch, ready.size())));
+                send(batch);
+            }
+            guard.lock();
+        }
+    }
+    
+public:
+    CoalescingClient(const vector<string>& addresses, size_t maxBatch = 256,
+                     chrono::microseconds window = chrono::microseconds(50))
+        : client(addresses), maxBatch(max<size_t>(maxBatch, 1)), window(window) {
+        flusher = thread(&CoalescingClient::flushLoop, this);
+    }
+    
+    ~CoalescingClient() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+    }
+    
+    CoalescingClient(const CoalescingClient&) = delete;
+    CoalescingClient& operator=(const CoalescingClient&) = delete;
+    
+    future<Result> findAsync(const string& uid) {
+        promise<Result> result;
+        future<Result> answer = result.get_future();
+        if (uid.length() != 7) {
+            result.set_value(Result());
+            return answer;
+        }
+        lock_guard<mutex> guard(lock);
+        if (stopping) {
+            throw logic_error("Клиент остановлен");
+        }
+        if (pending.empty()) {
+            oldest = chrono::steady_clock::now();
+            wake.notify_one();
+        }
+        pending.push_back({uid, move(result)});
+        if (pending.size() == maxBatch) {
+            wake.notify_one();
+        }
+        return answer;
+    }
+    
+    bool findRecord(const string& uid, string& data) {
+        Result result = findAsync(uid).get();
+        data = move(result.data);
+        return result.found;
+    }
+    
+    // Число отправленных пакетов и ключей в них
+    size_t batchCount() {
+        lock_guard<mutex> guard(lock);
+        return batches;
+    }
+    
+    size_t keyCount() {
+        lock_guard<mutex> guard(lock);
+        return keys;
+    }
+};
+
+string formatNumber(size_t number) {
+    string str = to_string(number);
+    int n = str.length() - 3;
+    while (n > 0) {
+        str.insert(n, " ");
+        n -= 3;
+    }
+    return str;
+}
+
+// Микробенчмарки отдельных компонентов. Тело замера выполняет заданное
+// число операций; число операций подбирается так, чтобы повтор длился
+// около TARGET_MILLIS. После прогрева выполняется REPETITIONS повторов,
+// повторы дальше трёх медианных отклонений от медианы отбрасываются
+// (вытеснение потока, прерывания), отчёт - по оставшимся.
+
+// Барьеры оптимизатора: значение считается использованным, память -
+// прочитанной и изменённой
+template <typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void clobberMemory() {
+    asm volatile("" : : : "memory");
+}
+
+class MicroBenchmarkSuite {
+public:
+    using Setup = function<void(size_t operations)>;
+    using Body = function<void(size_t operations)>;
+    
+private:
+    static constexpr double TARGET_MILLIS = 10;
+    static constexpr int WARMUP = 2;
+    static constexpr int REPETITIONS = 15;
+    
+    string filter;
+    size_t executed = 0;
+    
+    // Дополнение пробелами до width символов (UTF-8)
+    static string pad(const string& text, size_t width, bool alignRight) {
+        size_t length = 0;
+        for (unsigned char c : text) {
+            length += (c & 0xC0) != 0x80;
+        }
+        string padding(width > length ? width - length : 0, ' ');
+        return alignRight ? padding + text : text + padding;
+    }
+    
+    static string formatValue(double value, int precision) {
+        ostringstream out;
+        out << fixed << setprecision(precision) << value;
+        return out.str();
+    }
+    
+    static double timeOnce(const Setup& setup, const Body& body, size_t operations) {
+        if (setup) {
+            setup(operations);
+        }
+        clobberMemory();
+        auto start = chrono::steady_clock::now();
+        body(operations);
+        clobberMemory();
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    }
+    
+public:
+    explicit MicroBenchmarkSuite(string filter = "") : filter(move(filter)) {
+        cout << pad("Замер", 44, false) << pad("нс/оп", 14, true) << pad("млн оп/с", 12, true)
+             << pad("разброс", 10, true) << pad("отброшено", 12, true) << endl;
+    }
+    
+    // Замер операции; maxOperations ограничивает подбор числа операций
+    // для тел, работающих с заранее подготовленным массивом, setup
+    // выполняется перед каждым повтором вне замера, unitsPerOperation
+    // переводит время операции в время на единицу (например, на запись)
+    void add(const string& name, const Body& body, size_t maxOperations = SIZE_MAX, const Setup& setup = nullptr,
+             size_t unitsPerOperation = 1) {
+        if (!filter.empty() && name.find(filter) == string::npos) {
+            return;
+        }
+        ++executed;
+        
+        size_t operations = 1;
+        double nanos = timeOnce(setup, body, operations);
+        while (nanos < TARGET_MILLIS * 1e5 && operations < maxOperations) {
+            operations = min(maxOperations, operations * 4);
+            nanos = timeOnce(setup, body, operations);
+        }
+        if (nanos > 0 && operations < maxOperations) {
+            operations = min(maxOperations, max<size_t>(1, static_cast<size_t>(operations * TARGET_MILLIS * 1e6 / nanos)));
+        }
+        for (int i = 0; i < WARMUP; ++i) {
+            timeOnce(setup, body, operations);
+        }
+        
+        vector<double> perOperation(REPETITIONS);
+        for (double& value : perOperation) {
+            value = timeOnce(setup, body, operations) / operations / unitsPerOperation;
+        }
+        vector<double> sorted = perOperation;
+        sort(sorted.begin(), sorted.end());
+        double median = sorted[REPETITIONS / 2];
+        vector<double> deviations;
+        for (double value : sorted) {
+            deviations.push_back(fabs(value - median));
+        }
+        sort(deviations.begin(), deviations.end());
+        double mad = deviations[REPETITIONS / 2];
+        
+        double sum = 0, low = 1e300, high = 0;
+        size_t kept = 0;
+        for (double value : perOperation) {
+            if (fabs(value - median) <= max(3 * mad, median * 0.01)) {
+                sum += value;
+                low = min(low, value);
+                high = max(high, value);
+                ++kept;
+            }
+        }
+        double mean = sum / kept;
+        cout << pad(name, 44, false) << pad(formatValue(mean, 2), 14, true)
+             << pad(formatValue(1e3 / mean, 2), 12, true) << pad(formatValue((high - low) / mean * 100, 1) + "%", 10, true)
+             << pad(to_string(REPETITIONS - kept), 12, true) << endl;
+    }
+    
+    size_t executedCount() const { return executed; }
+};
+
+// Дополнительная статистика индекса в отчёте о тестировании
+template <typename Index>
+void printIndexStats(const Index&) {}
+
+void printIndexStats(const CuckooIndex& index) {
+    cout << "  Загрузка кукушечной таблицы: " << fixed << setprecision(1)
+         << index.loadFactor() * 100 << "%" << endl;
+}
+
+void printIndexStats(const RmiIndex& index) {
+    cout << "  Построение модели: " << fixed << setprecision(1) << index.getBuildMillis() << " мс, "
+         << formatNumber(index.leafCount()) << " листовых моделей ("
+         << formatNumber(index.modelMemory()) << " байт)" << endl;
+    cout << "  Максимальная ошибка предсказания: " << index.getMaxError()
+         << " позиций, среднее окно поиска: " << setprecision(1) << index.getMeanWindow() << endl;
+}
+
+
+template <typename Index>
+void runPerformanceTest() {
+    const int TOTAL_RECORDS = 100000;
+    const int SEARCH_TESTS = 10000;
+    
+    Database<Index> db;
+    UidGenerator uidGen;
+    
+    cout << "\n=== ТЕСТИРОВАНИЕ БАЗЫ ДАННЫХ (индекс: " << Index::name() << ") ===" << endl;
+    cout << "Генерация " << formatNumber(TOTAL_RECORDS) << " записей..." << endl;
+    
+    // Генерация уникальных UID
+    unordered_map<string, bool> usedUids;
+    auto startTime = chrono::high_resolution_clock::now();
+    
+    {
+        TRACE_SPAN("генерация записей");
+        for (int i = 0; i < TOTAL_RECORDS; ++i) {
+            string uid;
+       
+            do {
+                uid = uidGen.generateUid();
+            } while (usedUids.count(uid) > 0);
+        
+            usedUids[uid] = true;
+            string data = "Данные для записи " + to_string(i + 1);
+            db.addRecord(Record(uid, data));
+        
+        
+            if ((i + 1) % 10000 == 0) {
+                cout << "Сгенерировано записей: " << formatNumber(i + 1) << endl;
+            }
+        }
+    }
+    
+    db.freeze();
+    
+    auto endTime = chrono::high_resolution_clock::now();
+    auto generationTime = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+    cout << "Генерация завершена за " << generationTime.count() << " мс" << endl;
+    
+    
+    cout << "\nПодготовка тестовых ключей для поиска..." << endl;
+    vector<string> searchKeys;
+    vector<string> existingUids;
+    
+    
+    for (const auto& pair : usedUids) {
+        existingUids.push_back(pair.first);
+    }
+    
+    // 70% существующих ключей, 30% случайных (несуществующих)
+    random_device rd;
+    mt19937 gen(rd());
+    uniform_int_distribution<int> existDist(0, existingUids.size() - 1);
+    
+    for (int i = 0; i < SEARCH_TESTS; ++i) {
+        if (i < SEARCH_TESTS * 0.7) {
+           
+            searchKeys.push_back(existingUids[existDist(gen)]);
+        } else {
+            
+            searchKeys.push_back(uidGen.generateUid());
+        }
+    }
+    
+    
+    shuffle(searchKeys.begin(), searchKeys.end(), gen);
+    
+    
+    cout << "Тестирование поиска " << formatNumber(SEARCH_TESTS) << " ключей..." << endl;
+    
+    int foundCount = 0;
+    int notFoundCount = 0;
+    
+    startTime = chrono::high_resolution_clock::now();
+    
+    {
+        TRACE_SPAN("пакет поиска");
+        for (int i = 0; i < SEARCH_TESTS; ++i) {
+            Record* record = db.findRecord(searchKeys[i]);
+            if (record) {
+                foundCount++;
+            } else {
+                notFoundCount++;
+            }
+        
+        
+            if (SEARCH_TESTS > 1000 && (i + 1) % 1000 == 0) {
+                cout << "Выполнено поисков: " << formatNumber(i + 1) << endl;
+            }
+        }
+    }
+    
+    endTime = chrono::high_resolution_clock::now();
+    auto searchTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    
+    // Статистика
+    cout << "\n=== РЕЗУЛЬТАТЫ ТЕСТИРОВАНИЯ ===" << endl;
+    cout << "Общая статистика:" << endl;
+    cout << "  Всего записей в базе: " << formatNumber(db.size()) << endl;
+    cout << "  Выполнено тестов поиска: " << formatNumber(SEARCH_TESTS) << endl;
+    cout << "  Найдено записей: " << formatNumber(foundCount) << endl;
+    cout << "  Не найдено записей: " << formatNumber(notFoundCount) << endl;
+    cout << "  Память индекса: " << formatNumber(db.getIndex().memoryUsage()) << " байт ("
+              << fixed << setprecision(1)
+              << static_cast<double>(db.getIndex().memoryUsage()) / db.size() << " байт на ключ)" << endl;
+    printIndexStats(db.getIndex());
+    
+    cout << "\nПроизводительность поиска:" << endl;
+    cout << "  Общее время поиска: " << searchTime.count() << " мкс" << endl;
+    cout << "  Среднее время на поиск: " 
+              << fixed << setprecision(3) 
+              << (static_cast<double>(searchTime.count()) / SEARCH_TESTS) 
+              << " мкс" << endl;
+    cout << "  Поисков в секунду: " 
+              << formatNumber(static_cast<long long>((SEARCH_TESTS * 1000000.0) / searchTime.count()))
+              << endl;
+    
+    cout << "\nЭффективность:" << endl;
+    double speed = (SEARCH_TESTS * 1000000.0) / searchTime.count();
+    cout << "  Скорость обработки: " << fixed << setprecision(0) << speed << " операций/сек" << endl;
+    
+    // Сравнение с линейным поиском
+    double linearSearchTime = (TOTAL_RECORDS / 2.0) * SEARCH_TESTS * 0.0001; // примерная оценка
+    double speedup = linearSearchTime / (searchTime.count() / 1000000.0);
+    cout << "  Ускорение относительно линейного поиска: ~" << formatNumber(static_cast<size_t>(speedup)) << " раз" << endl;
+}
+
+
+// Вставка в кукушечный индекс вплоть до предельной загрузки: пропускная
+// способность измеряется по каждому десятому интервалу заполнения, чтобы
+// было видно поведение вытеснений вблизи 95%
+void runCuckooLoadTest(size_t totalKeys, double loadFactor) {
+    cout << "\n=== ЗАПОЛНЕНИЕ КУКУШЕЧНОГО ИНДЕКСА ===" << endl;
+    cout << "Ключей: " << formatNumber(totalKeys)
+         << ", предельная загрузка: " << fixed << setprecision(2) << loadFactor << endl;
+    
+    UidGenerator uidGen;
+    vector<uint64_t> keys;
+    keys.reserve(totalKeys);
+    for (size_t i = 0; i < totalKeys; ++i) {
+        keys.push_back(packUid(uidGen.generateUid()));
+    }
+    
+    CuckooIndex index(loadFactor);
+    index.reserve(totalKeys);
+    
+    const int STEPS = 10;
+    auto totalStart = chrono::high_resolution_clock::now();
+    for (int step = 0; step < STEPS; ++step) {
+        size_t from = totalKeys * step / STEPS;
+        size_t to = totalKeys * (step + 1) / STEPS;
+        auto start = chrono::high_resolution_clock::now();
+        for (size_t i = from; i < to; ++i) {
+            index.insert(keys[i], static_cast<uint32_t>(i));
+        }
+        auto end = chrono::high_resolution_clock::now();
+        double seconds = chrono::duration<double>(end - start).count();
+        cout << "  Загрузка " << setw(5) << setprecision(1) << index.loadFactor() * 100 << "%: "
+             << formatNumber(static_cast<size_t>((to - from) / seconds)) << " вставок/с" << endl;
+    }
+    auto totalEnd = chrono::high_resolution_clock::now();
+    double totalSeconds = chrono::duration<double>(totalEnd - totalStart).count();
+    
+    HashMapIndex reference;
+    reference.reserve(totalKeys);
+    for (size_t i = 0; i < totalKeys; ++i) {
+        reference.insert(keys[i], static_cast<uint32_t>(i));
+    }
+    
+    cout << "Итог:" << endl;
+    cout << "  Средняя скорость вставки: "
+         << formatNumber(static_cast<size_t>(totalKeys / totalSeconds)) << " вставок/с" << endl;
+    cout << "  Итоговая загрузка: " << setprecision(1) << index.loadFactor() * 100 << "%" << endl;
+    cout << "  Память кукушечного индекса: " << setprecision(1)
+         << static_cast<double>(index.memoryUsage()) / index.size() << " байт на ключ" << endl;
+    cout << "  Память unordered_map (оценка): " << setprecision(1)
+         << static_cast<double>(reference.memoryUsage()) / reference.size() << " байт на ключ" << endl;
+}
+
+
+// Время одного поиска в наносекундах на заданном наборе ключей
+template <typename Index>
+double measureLookups(const Index& index, const vector<uint64_t>& probes, size_t& found) {
+    TRACE_SPAN("пакет поиска");
+    found = 0;
+    auto start = chrono::high_resolution_clock::now();
+    for (uint64_t key : probes) {
+        uint32_t slot;
+        if (index.find(key, slot)) {
+            ++found;
+        }
+    }
+    auto end = chrono::high_resolution_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / probes.size();
+}
+
+template <typename Index>
+void benchmarkIndex(Index& index, const vector<uint64_t>& keys, const vector<uint64_t>& probes) {
+    auto start = chrono::high_resolution_clock::now();
+    index.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        index.insert(keys[i], static_cast<uint32_t>(i));
+    }
+    index.build();
+    auto end = chrono::high_resolution_clock::now();
+    double buildSeconds = chrono::duration<double>(end - start).count();
+    
+    size_t found;
+    double nanos = measureLookups(index, probes, found);
+    cout << "  " << left << setw(14) << Index::name() << right
+         << " построение: " << setw(8) << fixed << setprecision(0) << buildSeconds * 1000 << " мс"
+         << ", поиск: " << setw(6) << setprecision(1) << nanos << " нс"
+         << ", найдено: " << formatNumber(found)
+         << ", память: " << setprecision(1)
+         << static_cast<double>(index.memoryUsage()) / keys.size() << " байт на ключ" << endl;
+}
+
+// Сравнение таблицы прямой адресации с хэш-таблицей. Половина пробных
+// ключей присутствует в индексе, половина - случайные промахи.
+void runRadixBenchmark(size_t totalKeys) {
+    cout << "\n=== ТАБЛИЦА ПРЯМОЙ АДРЕСАЦИИ ПРОТИВ ХЭШ-ТАБЛИЦЫ ===" << endl;
+    cout << "Ключей: " << formatNumber(totalKeys) << endl;
+    
+    mt19937_64 gen(random_device{}());
+    vector<uint64_t> keys(totalKeys);
+    for (uint64_t& key : keys) {
+        key = gen() & ((uint64_t(1) << 56) - 1);
+    }
+    const size_t PROBES = 1000000;
+    vector<uint64_t> probes(PROBES);
+    for (size_t i = 0; i < PROBES; ++i) {
+        probes[i] = i % 2 ? keys[gen() % totalKeys] : gen() & ((uint64_t(1) << 56) - 1);
+    }
+    
+    {
+        HashMapIndex index;
+        benchmarkIndex(index, keys, probes);
+    }
+    {
+        RadixIndex<2> index;
+        benchmarkIndex(index, keys, probes);
+    }
+    {
+        RadixIndex<3> index;
+        benchmarkIndex(index, keys, probes);
+    }
+}
+
+
+// Лидер репликации: предварительная загрузка и постоянный поток вставок
+// в течение заданного времени, затем передача остатка журнала репликам
+void runReplicationLeader(const string& address, int seconds, const string& walPath) {
+    const size_t PRELOAD = 200000;
+    
+    Database<CuckooIndex> db;
+    WriteAheadLog wal(walPath);
+    ReplicationLeader<CuckooIndex> leader(db, wal, address);
+    UidGenerator uidGen;
+    
+    cout << "[лидер] Ожидание реплик на " << address << endl;
+    size_t inserted = 0;
+    for (; inserted < PRELOAD; ++inserted) {
+        leader.addRecord(Record(uidGen.generateUid(), "Данные для записи " + to_string(inserted + 1)));
+    }
+    cout << "[лидер] Предварительно загружено " << formatNumber(PRELOAD) << " записей" << endl;
+    
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::seconds(seconds);
+    auto nextReport = start + chrono::seconds(1);
+    while (chrono::steady_clock::now() < deadline) {
+        for (int i = 0; i < 1000; ++i, ++inserted) {
+            leader.addRecord(Record(uidGen.generateUid(), "Данные для записи " + to_string(inserted + 1)));
+        }
+        if (chrono::steady_clock::now() >= nextReport) {
+            cout << "[лидер] LSN " << formatNumber(leader.lastLsn())
+                 << ", реплик: " << leader.followerCount() << endl;
+            nextReport += chrono::seconds(1);
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "[лидер] Нагрузка завершена: " << formatNumber(inserted - PRELOAD) << " вставок, "
+         << formatNumber(static_cast<size_t>((inserted - PRELOAD) / elapsed)) << " вставок/с" << endl;
+    
+    wal.sync();
+    leader.stop();
+    cout << "[лидер] Итоговый LSN " << formatNumber(leader.lastLsn()) << endl;
+}
+
+// Реплика: начальная загрузка со снимка, догоняющее применение журнала,
+// периодический отчёт об отставании. Возвращает 0, если к моменту
+// отключения лидера применён весь журнал.
+int runReplicationFollower(const string& address) {
+    ReplicationFollower<CuckooIndex> follower(address);
+    cout << "[реплика] Подключено к " << address << endl;
+    
+    UidGenerator uidGen;
+    size_t reads = 0;
+    auto nextReport = chrono::steady_clock::now() + chrono::milliseconds(500);
+    while (follower.isConnected()) {
+        // Чтения обслуживаются параллельно с применением журнала
+        string data;
+        follower.findRecord(uidGen.generateUid(), data);
+        ++reads;
+        if (chrono::steady_clock::now() >= nextReport) {
+            cout << "[реплика] " << (follower.isBootstrapped() ? "применено" : "загрузка снимка, применено")
+                 << " LSN " << formatNumber(follower.getAppliedLsn())
+                 << ", отставание: " << formatNumber(follower.replicationLag()) << " записей, "
+                 << formatNumber(static_cast<size_t>(max<int64_t>(follower.getApplyDelayMicros(), 0)))
+                 << " мкс" << endl;
+            nextReport += chrono::milliseconds(500);
+        }
+    }
+    follower.waitForDisconnect();
+    
+    bool caughtUp = follower.getAppliedLsn() == follower.getLeaderLsn();
+    cout << "[реплика] Итог: LSN " << formatNumber(follower.getAppliedLsn())
+         << " из " << formatNumber(follower.getLeaderLsn())
+         << ", записей: " << formatNumber(follower.size())
+         << ", пакетов журнала: " << formatNumber(follower.getBatchCount())
+         << ", чтений: " << formatNumber(reads)
+         << (caughtUp ? " - реплика догнала лидера" : " - РЕПЛИКА ОТСТАЛА") << endl;
+    return caughtUp ? 0 : 1;
+}
+
+// Лидер и реплика в отдельных процессах на одном узле
+bool runReplicationDemo(int seconds) {
+    cout << "\n=== РЕПЛИКАЦИЯ ЖУРНАЛА ===" << endl;
+    string address = "unix:/tmp/testuid-repl-" + to_string(getpid()) + ".sock";
+    
+    cout.flush();
+    pid_t child = fork();
+    if (child < 0) {
+        throw runtime_error("fork не удался");
+    }
+    if (child == 0) {
+        int code = 1;
+        try {
+            code = runReplicationFollower(address);
+        } catch (const exception& e) {
+            cerr << "[реплика] " << e.what() << endl;
+        }
+        cout.flush();
+        _exit(code);
+    }
+    
+    runReplicationLeader(address, seconds, "");
+    int status = 0;
+    waitpid(child, &status, 0);
+    unlink(address.substr(5).c_str());
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Запуск серверов кластера в дочерних процессах
+vector<pid_t> spawnClusterServers(const vector<string>& addresses) {
+    vector<pid_t> servers;
+    cout.flush();
+    for (const string& address : addresses) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw runtime_error("fork не удался");
+        }
+        if (pid == 0) {
+            int code = 0;
+            try {
+                ClusterServer server(address);
+                server.run();
+            } catch (const exception& e) {
+                cerr << "[сервер] " << e.what() << endl;
+                code = 1;
+            }
+            _exit(code);
+        }
+        servers.push_back(pid);
+    }
+    return servers;
+}
+
+// Масштабирование кластера: одинаковая нагрузка на 1, 2, 4... шарда
+void runClusterBenchmark(size_t totalRecords, const vector<int>& shardCounts) {
+    const size_t BATCH = 1000;
+    
+    cout << "\n=== КЛАСТЕР С СОГЛАСОВАННЫМ ХЭШИРОВАНИЕМ ===" << endl;
+    cout << "Записей: " << formatNumber(totalRecords)
+         << ", аппаратных потоков: " << thread::hardware_concurrency() << endl;
+    
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    for (string& uid : uids) {
+        uid = uidGen.generateUid();
+    }
+    // 70% существующих ключей, 30% случайных
+    mt19937 gen(random_device{}());
+    vector<string> lookups(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        lookups[i] = i % 10 < 7 ? uids[gen() % totalRecords] : uidGen.generateUid();
+    }
+    
+    for (int shards : shardCounts) {
+        vector<string> addresses;
+        for (int i = 0; i < shards; ++i) {
+            addresses.push_back("unix:/tmp/testuid-shard-" + to_string(getpid()) + "-" + to_string(i) + ".sock");
+        }
+        vector<pid_t> servers = spawnClusterServers(addresses);
+        
+        {
+            ClusterClient client(addresses);
+            
+            auto start = chrono::high_resolution_clock::now();
+            vector<Record> batch;
+            for (size_t i = 0; i < totalRecords; ++i) {
+                batch.emplace_back(uids[i], "Данные для записи " + to_string(i + 1));
+                if (batch.size() == BATCH || i + 1 == totalRecords) {
+                    client.put(batch);
+                    batch.clear();
+                }
+            }
+            double putSeconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+            
+            size_t found = 0;
+            vector<uint8_t> hits;
+            vector<string> data;
+            start = chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < totalRecords; i += BATCH) {
+                vector<string> keys(lookups.begin() + i, lookups.begin() + min(i + BATCH, totalRecords));
+                client.multiGet(keys, hits, data);
+                found += count(hits.begin(), hits.end(), 1);
+            }
+            double getSeconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+            
+            vector<pair<uint64_t, uint64_t>> stats = client.stats();
+            uint64_t largest = 0, memory = 0;
+            for (const auto& shard : stats) {
+                largest = max(largest, shard.first);
+                memory += shard.second;
+            }
+            
+            cout << "Шардов: " << shards << endl;
+            cout << "  Вставка: " << formatNumber(static_cast<size_t>(totalRecords / putSeconds)) << " записей/с" << endl;
+            cout << "  Пакетный поиск: " << formatNumber(static_cast<size_t>(totalRecords / getSeconds))
+                 << " ключей/с, найдено " << formatNumber(found) << endl;
+            cout << "  Крупнейший шард: " << formatNumber(largest) << " записей ("
+                 << fixed << setprecision(2) << static_cast<double>(largest) * shards / totalRecords
+                 << " от среднего), память индексов: " << formatNumber(memory) << " байт" << endl;
+            
+            client.shutdownServers();
+        }
+        for (pid_t pid : servers) {
+            waitpid(pid, nullptr, 0);
+        }
+        for (const string& address : addresses) {
+            unlink(address.substr(5).c_str());
+        }
+    }
+}
+
+// Перцентили задержек в наносекундах
+void printLatencies(const string& title, vector<double>& nanos) {
+    if (nanos.empty()) {
+        return;
+    }
+    sort(nanos.begin(), nanos.end());
+    cout << "  " << title << ": p50 " << fixed << setprecision(0) << nanos[nanos.size() / 2]
+         << " нс, p99 " << nanos[nanos.size() * 99 / 100]
+         << " нс, p99.9 " << nanos[nanos.size() * 999 / 1000]
+         << " нс, максимум " << nanos.back() << " нс" << endl;
+}
+
+// Фоновое сохранение под нагрузкой: задержки поиска в родителе до и во
+// время сохранения, время fork() и дополнительная физическая память
+// (сумма PSS родителя и потомка относительно RSS до сохранения)
+void runBackgroundSaveTest(size_t totalRecords) {
+    cout << "\n=== ФОНОВОЕ СОХРАНЕНИЕ СНИМКА ===" << endl;
+    
+    UidGenerator uidGen;
+    Database<CuckooIndex> db;
+    db.reserve(totalRecords * 2);
+    vector<string> uids(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        uids[i] = uidGen.generateUid();
+        db.addRecord(Record(uids[i], "Данные для записи " + to_string(i + 1)));
+    }
+    cout << "Записей: " << formatNumber(db.size()) << endl;
+    
+    mt19937 gen(random_device{}());
+    auto timedLookup = [&](vector<double>& latencies) {
+        const string& uid = uids[gen() % totalRecords];
+        auto start = chrono::steady_clock::now();
+        Record* record = db.findRecord(uid);
+        auto end = chrono::steady_clock::now();
+        if (!record) {
+            throw runtime_error("Запись не найдена во время сохранения");
+        }
+        latencies.push_back(chrono::duration<double, nano>(end - start).count());
+    };
+    
+    vector<double> before;
+    for (int i = 0; i < 200000; ++i) {
+        timedLookup(before);
+    }
+    
+    string path = "/tmp/testuid-bgsave-" + to_string(getpid()) + ".snap";
+    size_t rssBefore = readProcKb(getpid(), "status", "VmRSS");
+    
+    auto forkStart = chrono::steady_clock::now();
+    pid_t child = startBackgroundSave(db, 0, path);
+    auto forkEnd = chrono::steady_clock::now();
+    
+    // Родитель продолжает поиск и понемногу вставляет новые записи
+    vector<double> during;
+    size_t inserted = 0;
+    size_t peakExtraKb = 0;
+    bool success = false;
+    auto nextSample = forkEnd;
+    for (;;) {
+        for (int i = 0; i < 1000; ++i) {
+            timedLookup(during);
+        }
+        for (int i = 0; i < 10; ++i, ++inserted) {
+            db.addRecord(Record(uidGen.generateUid(), "Новая запись " + to_string(inserted)));
+        }
+        if (chrono::steady_clock::now() >= nextSample) {
+            size_t pss = readProcKb(getpid(), "smaps_rollup", "Pss") + readProcKb(child, "smaps_rollup", "Pss");
+            if (pss > rssBefore) {
+                peakExtraKb = max(peakExtraKb, pss - rssBefore);
+            }
+            nextSample += chrono::milliseconds(10);
+        }
+        if (pollBackgroundSave(child, false, success)) {
+            break;
+        }
+    }
+    auto saveEnd = chrono::steady_clock::now();
+    if (!success) {
+        throw runtime_error("Фоновое сохранение завершилось с ошибкой");
+    }
+    
+    Database<CuckooIndex> restored;
+    loadSnapshotFile(restored, path);
+    ifstream snapshot(path, ios::binary | ios::ate);
+    size_t snapshotBytes = static_cast<size_t>(snapshot.tellg());
+    unlink(path.c_str());
+    
+    cout << "  fork(): " << fixed << setprecision(2)
+         << chrono::duration<double, milli>(forkEnd - forkStart).count() << " мс" << endl;
+    cout << "  Сохранение: " << setprecision(0)
+         << chrono::duration<double, milli>(saveEnd - forkEnd).count() << " мс, снимок "
+         << formatNumber(snapshotBytes) << " байт, восстановлено записей: "
+         << formatNumber(restored.size()) << endl;
+    cout << "  Вставлено во время сохранения: " << formatNumber(inserted)
+         << ", выполнено поисков: " << formatNumber(during.size()) << endl;
+    cout << "  RSS до сохранения: " << formatNumber(rssBefore) << " КБ, пик дополнительной памяти: "
+         << formatNumber(peakExtraKb) << " КБ" << endl;
+    printLatencies("Поиск до сохранения", before);
+    printLatencies("Поиск во время сохранения", during);
+}
+
+// Скорость CRC32C и проверка снимка: программная и аппаратная версии,
+// параллельная проверка всего файла и ленивая проверка по блокам
+void runChecksumBenchmark(size_t totalRecords) {
+    cout << "\n=== КОНТРОЛЬНЫЕ СУММЫ СНИМКОВ ===" << endl;
+    
+    UidGenerator uidGen;
+    Database<CuckooIndex> db;
+    db.reserve(totalRecords);
+    vector<string> uids(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        uids[i] = uidGen.generateUid();
+        db.addRecord(Record(uids[i], "Данные для записи " + to_string(i + 1)));
+    }
+    string path = "/tmp/testuid-crc-" + to_string(getpid()) + ".snap";
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        writeSnapshot(db, 0, out);
+    }
+    
+    auto gbPerSecond = [](size_t bytes, chrono::steady_clock::duration elapsed) {
+        return bytes / chrono::duration<double>(elapsed).count() / 1e9;
+    };
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    
+    {
+        MappedSnapshot snapshot(path);
+        ifstream in(path, ios::binary);
+        string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        const char* data = contents.data();
+        
+        auto start = chrono::steady_clock::now();
+        uint32_t softwareCrc = Crc32c::software(0, data, contents.size());
+        double software = gbPerSecond(contents.size(), chrono::steady_clock::now() - start);
+        start = chrono::steady_clock::now();
+        uint32_t hardwareCrc = Crc32c::hardware(0, data, contents.size());
+        double hardware = gbPerSecond(contents.size(), chrono::steady_clock::now() - start);
+        if (softwareCrc != hardwareCrc) {
+            throw runtime_error("Программный и аппаратный CRC32C не совпадают");
+        }
+        
+        cout << "Снимок: " << formatNumber(snapshot.bytes()) << " байт, "
+             << formatNumber(snapshot.blockCount()) << " блоков по "
+             << formatNumber(CHECKSUM_BLOCK_SIZE) << " байт" << endl;
+        cout << "  SSE4.2 доступен: " << (Crc32c::hasHardware() ? "да" : "нет") << endl;
+        cout << "  Программный CRC32C: " << fixed << setprecision(2) << software << " ГБ/с" << endl;
+        cout << "  Аппаратный CRC32C:  " << hardware << " ГБ/с" << endl;
+        
+        start = chrono::steady_clock::now();
+        size_t corrupted = snapshot.verifyAll(threads);
+        cout << "  Полная проверка в " << threads << " поток(ах): "
+             << gbPerSecond(snapshot.bytes(), chrono::steady_clock::now() - start) << " ГБ/с, повреждено блоков: "
+             << corrupted << endl;
+    }
+    
+    {
+        auto start = chrono::steady_clock::now();
+        MappedSnapshot snapshot(path);
+        double openMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        
+        const int LOOKUPS = 1000;
+        string_view data;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < LOOKUPS; ++i) {
+            if (!snapshot.find(uids[i * 7919 % totalRecords], data)) {
+                throw runtime_error("Запись не найдена в снимке");
+            }
+        }
+        double lookupMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        cout << "  Ленивая проверка: открытие " << setprecision(1) << openMicros << " мкс, "
+             << LOOKUPS << " поисков за " << lookupMicros << " мкс, проверено блоков: "
+             << formatNumber(snapshot.verifiedBlockCount()) << " из " << formatNumber(snapshot.blockCount()) << endl;
+    }
+    
+    // Повреждение одного байта в области данных обнаруживается при
+    // первом обращении к содержащему его блоку
+    {
+        fstream file(path, ios::binary | ios::in | ios::out);
+        file.seekp(-static_cast<streamoff>(CHECKSUM_BLOCK_SIZE), ios::end);
+        file.put('\xFF');
+    }
+    MappedSnapshot damaged(path);
+    size_t corrupted = damaged.verifyAll(threads);
+    cout << "  После порчи одного байта повреждено блоков: " << corrupted << endl;
+    
+    // Повреждённый заголовок: открытие отказывает, не оставляя ни
+    // дескриптора, ни отображения
+    {
+        fstream file(path, ios::binary | ios::in | ios::out);
+        file.seekp(0);
+        file.put('\xFF');
+    }
+    auto openDescriptors = []() {
+        long n = 0;
+        DIR* dir = opendir("/proc/self/fd");
+        while (dir && readdir(dir)) {
+            ++n;
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        return n;
+    };
+    long descriptorsBefore = openDescriptors();
+    int rejected = 0;
+    for (int i = 0; i < 100; ++i) {
+        try {
+            MappedSnapshot broken(path);
+        } catch (const runtime_error&) {
+            ++rejected;
+        }
+    }
+    cout << "  Повреждённый заголовок: отклонено открытий " << rejected << " из 100, утекло дескрипторов: "
+         << openDescriptors() - descriptorsBefore << endl;
+    unlink(path.c_str());
+}
+
+// Обратный поиск UID по данным: вторичный индекс против линейного
+// просмотра, память индекса и согласованность после изменений
+void runPayloadIndexTest(size_t totalRecords) {
+    cout << "\n=== ОБРАТНЫЙ ПОИСК ПО ДАННЫМ ===" << endl;
+    
+    // Данные вида "клиент-N;порядковый номер": поле "клиент" общее
+    // для четырёх записей
+    const size_t CLIENTS = max<size_t>(totalRecords / 4, 1);
+    auto clientField = [](const string& data) {
+        return string_view(data).substr(0, data.find(';'));
+    };
+    
+    UidGenerator uidGen;
+    Database<CuckooIndex> db;
+    db.reserve(totalRecords);
+    vector<string> uids(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        uids[i] = uidGen.generateUid();
+        db.addRecord(Record(uids[i], "client-" + to_string(i % CLIENTS) + ";" + to_string(i)));
+    }
+    
+    auto start = chrono::steady_clock::now();
+    db.enablePayloadIndex(clientField);
+    double buildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    mt19937 gen(random_device{}());
+    const int LOOKUPS = 100000;
+    size_t matches = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < LOOKUPS; ++i) {
+        matches += db.findByPayload("client-" + to_string(gen() % CLIENTS)).size();
+    }
+    double indexNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / LOOKUPS;
+    
+    // Линейный просмотр для сравнения (прежний способ)
+    const int SCANS = 20;
+    size_t scanMatches = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < SCANS; ++i) {
+        string value = "client-" + to_string(gen() % CLIENTS);
+        db.forEachRecord([&](const Record& record) {
+            scanMatches += clientField(record.getData()) == value;
+        });
+    }
+    double scanNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / SCANS;
+    
+    // Изменения: каждая десятая запись переходит к клиенту "moved",
+    // каждая десятая (со сдвигом) удаляется
+    size_t moved = 0, erased = 0;
+    for (size_t i = 0; i < totalRecords; i += 10) {
+        moved += db.updateRecord(uids[i], "moved;" + to_string(i));
+        if (i + 5 < totalRecords) {
+            erased += db.eraseRecord(uids[i + 5]);
+        }
+    }
+    bool consistent = db.findByPayload("moved").size() == moved;
+    for (size_t client = 0; client < min<size_t>(CLIENTS, 1000) && consistent; ++client) {
+        size_t expected = 0;
+        for (size_t i = client; i < totalRecords; i += CLIENTS) {
+            expected += i % 10 != 0 && i % 10 != 5;
+        }
+        consistent = db.findByPayload("client-" + to_string(client)).size() == expected;
+    }
+    
+    const PayloadIndex* index = db.getPayloadIndex();
+    cout << "Записей: " << formatNumber(totalRecords) << ", значений поля: " << formatNumber(CLIENTS) << endl;
+    cout << "  Построение индекса: " << fixed << setprecision(1) << buildMillis << " мс" << endl;
+    cout << "  Память индекса: " << formatNumber(index->memoryUsage()) << " байт ("
+         << static_cast<double>(index->memoryUsage()) / index->size() << " байт на запись)" << endl;
+    cout << "  Поиск по индексу: " << indexNanos << " нс, в среднем "
+         << static_cast<double>(matches) / LOOKUPS << " записей" << endl;
+    cout << "  Линейный просмотр: " << setprecision(0) << scanNanos << " нс ("
+         << formatNumber(static_cast<size_t>(scanNanos / indexNanos)) << " раз медленнее)" << endl;
+    cout << "  После " << formatNumber(moved) << " изменений и " << formatNumber(erased)
+         << " удалений индекс " << (consistent ? "согласован" : "НЕ СОГЛАСОВАН") << endl;
+    if (!consistent) {
+        throw runtime_error("Индекс по данным разошёлся с записями");
+    }
+}
+
+// Поиск по фрагменту данных: сборка триграммного индекса, задержка
+// запросов и сравнение с полным просмотром
+void runSubstringSearchTest(size_t totalRecords) {
+    cout << "\n=== ПОИСК ПО ФРАГМЕНТУ ДАННЫХ ===" << endl;
+    
+    // Данные из трёх случайных "слов" и номера
+    mt19937 gen(random_device{}());
+    auto randomWord = [&]() {
+        static const char* syllables[] = {"ka", "ro", "mi", "te", "su", "no", "vo", "li", "da", "ze",
+                                          "pra", "sto", "gri", "ven", "tol", "mar"};
+        string word;
+        for (int i = 0, n = 2 + gen() % 3; i < n; ++i) {
+            word += syllables[gen() % 16];
+        }
+        return word;
+    };
+    
+    UidGenerator uidGen;
+    Database<CuckooIndex> db;
+    db.reserve(totalRecords);
+    vector<string> samples;
+    for (size_t i = 0; i < totalRecords; ++i) {
+        string data = randomWord() + " " + randomWord() + " " + randomWord() + "-" + to_string(gen() % 1000000);
+        if (i % 1000 == 0) {
+            samples.push_back(data);
+        }
+        db.addRecord(Record(uidGen.generateUid(), data));
+    }
+    
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    auto start = chrono::steady_clock::now();
+    db.enableSubstringIndex(threads);
+    double buildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    // Инкрементальное добавление после сборки
+    const size_t EXTRA = totalRecords / 10;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < EXTRA; ++i) {
+        db.addRecord(Record(uidGen.generateUid(), randomWord() + " " + randomWord() + " " + randomWord()));
+    }
+    double addMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / EXTRA;
+    
+    const int QUERIES = 1000;
+    vector<string> queries;
+    for (int i = 0; i < QUERIES; ++i) {
+        const string& data = samples[gen() % samples.size()];
+        size_t length = 5 + gen() % 4;
+        queries.push_back(data.substr(gen() % (data.size() - length + 1), length));
+    }
+    vector<double> latencies;
+    size_t matches = 0;
+    for (const string& query : queries) {
+        auto queryStart = chrono::steady_clock::now();
+        matches += db.findBySubstring(query).size();
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - queryStart).count());
+    }
+    
+    // Полный просмотр тех же запросов (без индекса) на нескольких примерах
+    const int SCANS = 5;
+    size_t scanMatches = 0, indexMatches = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < SCANS; ++i) {
+        db.forEachRecord([&](const Record& record) {
+            scanMatches += record.getData().find(queries[i]) != string::npos;
+        });
+    }
+    double scanMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / SCANS;
+    for (int i = 0; i < SCANS; ++i) {
+        indexMatches += db.findBySubstring(queries[i]).size();
+    }
+    
+    const TrigramIndex* index = db.getSubstringIndex();
+    cout << "Записей: " << formatNumber(db.size()) << ", потоков сборки: " << threads << endl;
+    cout << "  Сборка индекса: " << fixed << setprecision(0) << buildMillis << " мс, триграмм: "
+         << formatNumber(index->trigramCount()) << ", память: "
+         << setprecision(1) << static_cast<double>(index->memoryUsage()) / db.size() << " байт на запись" << endl;
+    cout << "  Инкрементальное добавление: " << setprecision(2) << addMicros << " мкс на запись" << endl;
+    cout << "  Запросы: в среднем " << setprecision(1) << static_cast<double>(matches) / QUERIES
+         << " совпадений" << endl;
+    printLatencies("Задержка запроса", latencies);
+    cout << "  Полный просмотр: " << setprecision(1) << scanMillis << " мс на запрос, совпадения "
+         << (scanMatches == indexMatches ? "совпадают с индексом" : "РАСХОДЯТСЯ С ИНДЕКСОМ") << endl;
+    if (scanMatches != indexMatches) {
+        throw runtime_error("Результаты поиска по индексу и просмотром расходятся");
+    }
+}
+
+void printSemiJoinStats(const string& title, const SemiJoinStats& stats) {
+    cout << "  " << title << ": " << (stats.strategy == BulkMembership::HASH_PROBE
+                                         ? "секционированный хэш-поиск" : "слияние")
+         << ", вход " << (stats.sortedInput ? "отсортирован" : "не отсортирован")
+         << ", ключей: " << formatNumber(stats.inputKeys)
+         << ", найдено: " << formatNumber(stats.foundKeys)
+         << ", " << formatNumber(static_cast<size_t>(stats.inputKeys / stats.seconds)) << " ключей/с" << endl;
+}
+
+// Полусоединение файла UID со снимком (режим командной строки)
+void runSemiJoinCommand(const string& inputPath, const string& snapshotPath, const string& outputPath) {
+    MappedSnapshot snapshot(snapshotPath);
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    if (snapshot.verifyAll(threads) > 0) {
+        throw runtime_error("Снимок повреждён");
+    }
+    BulkMembership membership(snapshot.keyArray(), snapshot.size(), threads);
+    
+    FILE* in = inputPath == "-" ? stdin : fopen(inputPath.c_str(), "r");
+    if (!in) {
+        throw runtime_error("Не удалось открыть " + inputPath);
+    }
+    FILE* out = outputPath.empty() || outputPath == "-" ? stdout : fopen(outputPath.c_str(), "w");
+    if (!out) {
+        throw runtime_error("Не удалось открыть " + outputPath);
+    }
+    struct stat st;
+    size_t expected = fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) ? st.st_size / 15 : 0;
+    
+    SemiJoinStats stats = runSemiJoin(membership, in, out, expected);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    // Результат может идти в stdout, поэтому статистика - в stderr
+    cerr << (stats.strategy == BulkMembership::HASH_PROBE ? "хэш-поиск" : "слияние")
+         << ": " << stats.inputKeys << " ключей, найдено " << stats.foundKeys << ", "
+         << static_cast<size_t>(stats.inputKeys / stats.seconds) << " ключей/с" << endl;
+}
+
+// Полусоединение на синтетических данных: неотсортированный
+// и отсортированный вход против снимка базы
+void runSemiJoinBenchmark(size_t databaseKeys, size_t inputKeys) {
+    cout << "\n=== МАССОВАЯ ПРОВЕРКА ПРИСУТСТВИЯ UID ===" << endl;
+    
+    UidGenerator uidGen;
+    Database<CuckooIndex> db;
+    db.reserve(databaseKeys);
+    vector<string> uids(databaseKeys);
+    for (size_t i = 0; i < databaseKeys; ++i) {
+        uids[i] = uidGen.generateUid();
+        db.addRecord(Record(uids[i], to_string(i)));
+    }
+    string base = "/tmp/testuid-semijoin-" + to_string(getpid());
+    {
+        ofstream out(base + ".snap", ios::binary | ios::trunc);
+        writeSnapshot(db, 0, out);
+    }
+    
+    // Вход: половина ключей из базы, половина случайных
+    mt19937 gen(random_device{}());
+    vector<uint64_t> input(inputKeys);
+    for (size_t i = 0; i < inputKeys; ++i) {
+        input[i] = i % 2 ? packUid(uids[gen() % databaseKeys]) : packUid(uidGen.generateUid());
+    }
+    auto writeInput = [&](const string& path) {
+        string text;
+        for (uint64_t key : input) {
+            appendHexUid(text, key);
+        }
+        ofstream(path, ios::trunc) << text;
+    };
+    writeInput(base + ".unsorted");
+    sort(input.begin(), input.end());
+    writeInput(base + ".sorted");
+    
+    MappedSnapshot snapshot(base + ".snap");
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    snapshot.verifyAll(threads);
+    cout << "Ключей в базе: " << formatNumber(databaseKeys) << ", во входе: " << formatNumber(inputKeys)
+         << ", потоков: " << threads << endl;
+    
+    for (const char* suffix : {".unsorted", ".sorted"}) {
+        BulkMembership membership(snapshot.keyArray(), snapshot.size(), threads);
+        FILE* in = fopen((base + suffix).c_str(), "r");
+        FILE* out = fopen((base + ".out").c_str(), "w");
+        SemiJoinStats stats = runSemiJoin(membership, in, out, inputKeys);
+        fclose(in);
+        fclose(out);
+        printSemiJoinStats(suffix[1] == 'u' ? "Неотсортированный вход" : "Отсортированный вход", stats);
+        
+        // Обе стратегии на том же входе без разбора текста - проверка
+        // оценки стоимости
+        vector<uint64_t> keys = input;
+        if (suffix[1] == 'u') {
+            shuffle(keys.begin(), keys.end(), gen);
+        }
+        for (BulkMembership::Strategy strategy : {BulkMembership::HASH_PROBE, BulkMembership::SORT_MERGE}) {
+            BulkMembership fresh(snapshot.keyArray(), snapshot.size(), threads);
+            double estimate = fresh.estimateCost(strategy, keys.size(), keys.size(), suffix[1] == 's');
+            vector<uint8_t> found;
+            auto start = chrono::steady_clock::now();
+            fresh.probe(keys, strategy, found);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            size_t hits = count(found.begin(), found.end(), 1);
+            cout << "    в памяти, " << (strategy == BulkMembership::HASH_PROBE ? "хэш-поиск" : "слияние")
+                 << ": " << formatNumber(static_cast<size_t>(keys.size() / seconds))
+                 << " ключей/с (оценка " << fixed << setprecision(0)
+                 << estimate / 1e6 << " мс, факт "
+                 << seconds * 1000 << " мс)" << endl;
+            if (hits != stats.foundKeys) {
+                throw runtime_error("Стратегии полусоединения дали разный результат");
+            }
+        }
+    }
+    for (const char* suffix : {".snap", ".unsorted", ".sorted", ".out"}) {
+        unlink((base + suffix).c_str());
+    }
+}
+
+// Операции над множествами UID: случайные (разреженные) популяции
+// против вложенных циклов findRecord, большие случайные популяции без
+// баз и плотные популяции из диапазонов
+void runUidSetBenchmark(size_t sparseMembers, size_t denseMembers, size_t randomMembers) {
+    cout << "\n=== СЖАТЫЕ МНОЖЕСТВА UID ===" << endl;
+    
+    auto timeMillis = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+    auto report = [&](const string& title, const UidSet& a, const UidSet& b) {
+        auto start = chrono::steady_clock::now();
+        UidSet both = UidSet::intersect(a, b);
+        double andMillis = timeMillis(start);
+        start = chrono::steady_clock::now();
+        UidSet either = UidSet::unite(a, b);
+        double orMillis = timeMillis(start);
+        start = chrono::steady_clock::now();
+        UidSet onlyA = UidSet::subtract(a, b);
+        double andNotMillis = timeMillis(start);
+        start = chrono::steady_clock::now();
+        uint64_t cardinality = either.cardinality();
+        double countMillis = timeMillis(start);
+        
+        cout << title << ": |A| = " << formatNumber(a.cardinality()) << ", |B| = " << formatNumber(b.cardinality())
+             << ", контейнеров A: " << formatNumber(a.containerCount())
+             << ", одиночных ключей A: " << formatNumber(a.sparseCount())
+             << ", память A: " << fixed << setprecision(2)
+             << static_cast<double>(a.memoryUsage()) / a.cardinality() << " байт на UID" << endl;
+        cout << "  AND: " << setprecision(1) << andMillis << " мс (" << formatNumber(both.cardinality()) << ")"
+             << ", OR: " << orMillis << " мс (" << formatNumber(cardinality) << ")"
+             << ", ANDNOT: " << andNotMillis << " мс (" << formatNumber(onlyA.cardinality()) << ")"
+             << ", мощность OR: " << setprecision(3) << countMillis << " мс" << endl;
+        if (both.cardinality() + cardinality != a.cardinality() + b.cardinality()
+            || onlyA.cardinality() + both.cardinality() != a.cardinality()) {
+            throw runtime_error("Несогласованные результаты операций над множествами");
+        }
+    };
+    
+    // Разреженный случай: две базы с пересечением в половину
+    UidGenerator uidGen;
+    Database<CuckooIndex> first, second;
+    first.reserve(sparseMembers);
+    second.reserve(sparseMembers);
+    for (size_t i = 0; i < sparseMembers; ++i) {
+        string uid = uidGen.generateUid();
+        first.addRecord(Record(uid, ""));
+        second.addRecord(Record(i % 2 ? uid : uidGen.generateUid(), ""));
+    }
+    auto start = chrono::steady_clock::now();
+    UidSet a = UidSet::fromDatabase(first);
+    UidSet b = UidSet::fromDatabase(second);
+    cout << "Построение из баз: " << fixed << setprecision(0) << timeMillis(start) << " мс" << endl;
+    report("Случайные UID", a, b);
+    
+    // Прежний способ: вложенный цикл поиска по второй базе
+    start = chrono::steady_clock::now();
+    size_t common = 0;
+    first.forEachRecord([&](const Record& record) {
+        common += second.findRecord(record.getUid()) != nullptr;
+    });
+    cout << "  Пересечение циклом findRecord: " << setprecision(1) << timeMillis(start) << " мс ("
+         << formatNumber(common) << ")" << endl;
+    
+    // Большие случайные популяции: ключи A строятся сразу по возрастанию
+    // случайными шагами, B берёт каждый ключ A с вероятностью 1/2 и столько
+    // же новых ключей между соседними ключами A
+    vector<uint64_t> keysA, keysB;
+    {
+        mt19937_64 gen(random_device{}());
+        const uint64_t MAX_STEP = 2 * ((uint64_t(1) << 56) / max<size_t>(randomMembers, 1));
+        keysA.reserve(randomMembers);
+        keysB.reserve(randomMembers);
+        uint64_t key = 0;
+        for (size_t i = 0; i < randomMembers; ++i) {
+            uint64_t step = 2 + gen() % (MAX_STEP - 2);
+            if (gen() & 1) {
+                keysB.push_back(key + 1 + gen() % (step - 1));
+            }
+            key += step;
+            keysA.push_back(key);
+            if (gen() & 1) {
+                keysB.push_back(key);
+            }
+        }
+    }
+    start = chrono::steady_clock::now();
+    a = UidSet::fromSortedKeys(keysA.data(), keysA.size());
+    b = UidSet::fromSortedKeys(keysB.data(), keysB.size());
+    cout << "Построение из отсортированных ключей: " << setprecision(0) << timeMillis(start) << " мс" << endl;
+    vector<uint64_t>().swap(keysA);
+    vector<uint64_t>().swap(keysB);
+    report("Случайные UID без баз", a, b);
+    
+    // Плотный случай: UID выдаются диапазонами, B сдвинуто на полдиапазона
+    const uint64_t RANGE = 1 << 20;
+    keysA.reserve(denseMembers);
+    keysB.reserve(denseMembers);
+    mt19937_64 gen(random_device{}());
+    for (uint64_t base = gen() & ((uint64_t(1) << 50) - 1); keysA.size() < denseMembers; base += 4 * RANGE) {
+        for (uint64_t k = 0; k < RANGE && keysA.size() < denseMembers; ++k) {
+            keysA.push_back(base + k);
+            keysB.push_back(base + RANGE / 2 + k);
+        }
+    }
+    a = UidSet::fromSortedKeys(keysA.data(), keysA.size());
+    b = UidSet::fromSortedKeys(keysB.data(), keysB.size());
+    vector<uint64_t>().swap(keysA);
+    vector<uint64_t>().swap(keysB);
+    report("Плотные диапазоны (карты)", a, b);
+    a.runOptimize();
+    b.runOptimize();
+    report("Плотные диапазоны (серии)", a, b);
+}
+
+// Чтение по снимкам при непрерывных изменениях: проверка видимости,
+// стоимость чтения последней версии и изменений, сборка старых версий
+void runMvccTest(size_t totalRecords) {
+    cout << "\n=== ЧТЕНИЕ ПО СНИМКАМ (MVCC) ===" << endl;
+    
+    UidGenerator uidGen;
+    Database<CuckooIndex> db;
+    db.reserve(totalRecords * 2);
+    vector<string> uids(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        uids[i] = uidGen.generateUid();
+        db.addRecord(Record(uids[i], "v0-" + to_string(i)));
+    }
+    
+    mt19937 gen(random_device{}());
+    const size_t LOOKUPS = 1000000;
+    vector<const string*> probes(LOOKUPS);
+    for (auto& probe : probes) {
+        probe = &uids[gen() % totalRecords];
+    }
+    size_t latestFound = 0;
+    auto timeLatest = [&]() {
+        auto start = chrono::steady_clock::now();
+        for (const string* uid : probes) {
+            const Record* record = db.findRecord(*uid);
+            latestFound += record ? record->getData().size() : 0;
+        }
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / LOOKUPS;
+    };
+    // Изменения: обновление каждой пятой записи, удаление каждой десятой
+    // (со сдвигом) и новые записи
+    auto churn = [&](int round) {
+        auto start = chrono::steady_clock::now();
+        size_t operations = 0;
+        for (size_t i = round; i < totalRecords; i += 5) {
+            db.updateRecord(uids[i], "v" + to_string(round + 1) + "-" + to_string(i));
+            ++operations;
+        }
+        for (size_t i = round + 3; i < totalRecords; i += 10) {
+            db.eraseRecord(uids[i]);
+            ++operations;
+        }
+        for (size_t i = 0; i < totalRecords / 20; ++i, ++operations) {
+            db.addRecord(Record(uidGen.generateUid(), "new"));
+        }
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / operations;
+    };
+    
+    double latestPlain = timeLatest();
+    double churnPlain = churn(0);
+    
+    // Снимок и изменения после него
+    auto snapshot = db.openSnapshot();
+    size_t visibleBefore = 0;
+    db.forEachRecord(snapshot, [&](const Record&) { ++visibleBefore; });
+    double churnWithSnapshot = churn(1);
+    double latestWithSnapshot = timeLatest();
+    
+    size_t found = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string* uid : probes) {
+        const Record* record = db.findRecord(*uid, snapshot);
+        found += record ? record->getData().size() : 0;
+    }
+    double snapshotNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / LOOKUPS;
+    
+    // Снимок видит состояние после первого раунда изменений
+    bool consistent = true;
+    for (size_t i = 0; i < totalRecords && consistent; i += 7) {
+        const Record* record = db.findRecord(uids[i], snapshot);
+        bool erased = i >= 3 && (i - 3) % 10 == 0;
+        string expected = (i % 5 == 0 ? "v1-" : "v0-") + to_string(i);
+        consistent = erased ? record == nullptr : record && record->getData() == expected;
+    }
+    size_t visibleAfter = 0;
+    db.forEachRecord(snapshot, [&](const Record&) { ++visibleAfter; });
+    consistent = consistent && visibleAfter == visibleBefore;
+    
+    size_t historySize = db.historySize();
+    start = chrono::steady_clock::now();
+    snapshot.release();
+    double releaseMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Записей: " << formatNumber(totalRecords) << ", видимо снимку: " << formatNumber(visibleBefore) << endl;
+    cout << fixed << setprecision(1);
+    cout << "Поиск последней версии: " << latestPlain << " нс без снимков, "
+         << latestWithSnapshot << " нс при открытом снимке" << endl;
+    cout << "Поиск по снимку: " << snapshotNanos << " нс (байт данных: " << formatNumber(found + latestFound) << ")" << endl;
+    cout << "Изменение: " << churnPlain << " нс без снимков, " << churnWithSnapshot << " нс при открытом снимке" << endl;
+    cout << "Сохранено старых версий: " << formatNumber(historySize) << ", освобождение снимка: "
+         << setprecision(2) << releaseMillis << " мс, осталось: " << formatNumber(db.historySize()) << endl;
+    cout << "Видимость по снимку: " << (consistent ? "корректна" : "ОШИБКА") << endl;
+    if (!consistent || db.historySize() != 0) {
+        throw runtime_error("Нарушена изоляция снимка");
+    }
+}
+
+// Пакетная запись под нагрузкой чтения: задержка и пропускная способность
+// пакетов разного размера для одного сегмента (аналог внешней глобальной
+// блокировки) и для сегментированной базы. Читатель параллельно проверяет,
+// что группа ключей, обновляемая каждым пакетом, всегда согласована
+void runBatchWriteTest(size_t totalOps) {
+    cout << "\n=== АТОМАРНЫЕ ПАКЕТЫ ЗАПИСИ ===" << endl;
+    
+    const size_t GROUP = 8;
+    const vector<size_t> batchSizes = {16, 128, 1024, 8192};
+    
+    for (size_t shardCount : {size_t(1), size_t(16)}) {
+        cout << "Сегментов: " << shardCount << endl;
+        for (size_t batchSize : batchSizes) {
+            ShardedDatabase<CuckooIndex> db(shardCount);
+            UidGenerator uidGen;
+            vector<string> group(GROUP);
+            vector<BatchOp> initial;
+            for (string& uid : group) {
+                uid = uidGen.generateUid();
+                initial.push_back({BatchOp::INSERT, uid, "0"});
+            }
+            db.applyBatch(initial);
+            
+            atomic<bool> stop{false};
+            atomic<size_t> reads{0}, violations{0};
+            thread reader([&]() {
+                while (!stop) {
+                    string first;
+                    bool consistent = true;
+                    db.readConsistent(group, [&](const string&, const Record* record) {
+                        string value = record ? record->getData() : "-";
+                        if (first.empty()) {
+                            first = value;
+                        }
+                        consistent = consistent && value == first;
+                    });
+                    violations += !consistent;
+                    ++reads;
+                }
+            });
+            
+            // Пакет: обновление группы и вставки с удалением каждой третьей
+            // ранее вставленной записи
+            vector<string> inserted;
+            vector<double> nanos;
+            size_t batches = max<size_t>(totalOps / batchSize, 1);
+            mt19937 gen(random_device{}());
+            auto start = chrono::steady_clock::now();
+            for (size_t b = 1; b <= batches; ++b) {
+                vector<BatchOp> ops;
+                ops.reserve(batchSize);
+                for (const string& uid : group) {
+                    ops.push_back({BatchOp::UPDATE, uid, to_string(b)});
+                }
+                while (ops.size() < batchSize) {
+                    if (ops.size() % 3 == 0 && !inserted.empty()) {
+                        ops.push_back({BatchOp::ERASE, inserted[gen() % inserted.size()], ""});
+                    } else {
+                        inserted.push_back(uidGen.generateUid());
+                        ops.push_back({BatchOp::INSERT, inserted.back(), "Данные пакета " + to_string(b)});
+                    }
+                }
+                auto batchStart = chrono::steady_clock::now();
+                db.applyBatch(move(ops));
+                nanos.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - batchStart).count());
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            stop = true;
+            reader.join();
+            
+            // Восстановление из журнала должно дать то же содержимое
+            Database<CuckooIndex> replayed;
+            string log = db.readWal();
+            vector<WalEntry> entries;
+            WriteAheadLog::decode(log.data(), log.size(), entries);
+            for (WalEntry& entry : entries) {
+                applyWalEntry(replayed, entry);
+            }
+            
+            cout << "  Пакет " << setw(5) << batchSize << ": " << formatNumber(static_cast<size_t>(batches * batchSize / seconds))
+                 << " операций/с, " << formatNumber(static_cast<size_t>(reads / seconds)) << " согласованных чтений/с, "
+                 << "нарушений: " << violations << ", записей журнала: " << entries.size()
+                 << (replayed.size() == db.size() ? "" : " (ОШИБКА ВОССТАНОВЛЕНИЯ)") << endl;
+            printLatencies("фиксация пакета", nanos);
+            if (violations != 0 || replayed.size() != db.size()) {
+                throw runtime_error("Пакет применён не атомарно");
+            }
+        }
+    }
+}
+
+// Поток изменений: стоимость публикации для вставок (без потока, с потоком
+// без подписчиков, с локальным и удалённым подписчиками), сходимость
+// удалённой копии с базой и поведение медленного подписчика при
+// нескольких писателях
+void runChangeFeedTest(size_t totalRecords) {
+    cout << "\n=== ПОТОК ИЗМЕНЕНИЙ (CDC) ===" << endl;
+    
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    for (string& uid : uids) {
+        uid = uidGen.generateUid();
+    }
+    // Данные восстанавливаются по UID, так что подписчик может проверить
+    // целостность каждого события
+    auto dataFor = [](const string& uid) {
+        return "Данные " + to_string(packUid(uid) % 1000003);
+    };
+    
+    mutex dbLock;
+    auto runWorkload = [&](Database<CuckooIndex>& db) {
+        const size_t CHUNK = 1000;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < totalRecords; i += CHUNK) {
+            lock_guard<mutex> guard(dbLock);
+            for (size_t j = i; j < min(i + CHUNK, totalRecords); ++j) {
+                db.addRecord(Record(uids[j], dataFor(uids[j])));
+                if (j % 10 == 9) {
+                    db.eraseRecord(uids[j - 5]);
+                }
+            }
+        }
+        return totalRecords / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    
+    Database<CuckooIndex> plain;
+    plain.reserve(totalRecords);
+    double plainRate = runWorkload(plain);
+    
+    ChangeFeed feed(1 << 16);
+    Database<CuckooIndex> withFeed;
+    withFeed.reserve(totalRecords);
+    withFeed.attachChangeFeed(&feed);
+    double feedRate = runWorkload(withFeed);
+    
+    // Локальный подписчик читает кольцо в отдельном потоке, удалённый
+    // получает события через сокет
+    ChangeFeed subscribedFeed(1 << 18);
+    Database<CuckooIndex> primary;
+    primary.reserve(totalRecords);
+    primary.attachChangeFeed(&subscribedFeed);
+    string address = "unix:/tmp/testuid_cdc_" + to_string(getpid()) + ".sock";
+    ChangeFeedServer server(subscribedFeed, [&]() {
+        lock_guard<mutex> guard(dbLock);
+        ostringstream snapshot;
+        writeSnapshot(primary, 0, snapshot);
+        return snapshot.str();
+    }, address);
+    ChangeFeedSubscriber<HashMapIndex> remote(address);
+    while (remote.getResyncCount() == 0) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    atomic<bool> stop{false};
+    atomic<size_t> localEvents{0}, localOverruns{0};
+    thread local([&]() {
+        uint64_t next = subscribedFeed.headSequence();
+        vector<ChangeEvent> events;
+        while (!stop) {
+            events.clear();
+            if (!subscribedFeed.read(next, events, 4096)) {
+                ++localOverruns;
+                next = subscribedFeed.headSequence();
+            }
+            localEvents += events.size();
+            if (events.empty()) {
+                this_thread::sleep_for(chrono::microseconds(200));
+            }
+        }
+    });
+    double subscribedRate = runWorkload(primary);
+    server.stop();
+    remote.waitForDisconnect();
+    stop = true;
+    local.join();
+    
+    bool converged = remote.size() == primary.size();
+    string data;
+    for (size_t i = 0; i < totalRecords && converged; i += 13) {
+        bool present = primary.findRecord(uids[i]) != nullptr;
+        converged = remote.findRecord(uids[i], data) == present && (!present || data == dataFor(uids[i]));
+    }
+    
+    cout << "Вставок: " << formatNumber(totalRecords) << " (каждая десятая сопровождается удалением)" << endl;
+    cout << "Без потока: " << formatNumber(static_cast<size_t>(plainRate)) << " вставок/с" << endl;
+    cout << "Поток без подписчиков: " << formatNumber(static_cast<size_t>(feedRate)) << " вставок/с ("
+         << showpos << fixed << setprecision(1) << (plainRate / feedRate - 1) * 100 << noshowpos << "% времени)" << endl;
+    cout << "Локальный и удалённый подписчики: " << formatNumber(static_cast<size_t>(subscribedRate)) << " вставок/с ("
+         << showpos << (plainRate / subscribedRate - 1) * 100 << noshowpos << "% времени)" << endl;
+    cout << "  Локальный: событий " << formatNumber(localEvents) << ", переполнений " << localOverruns << endl;
+    cout << "  Удалённый: событий " << formatNumber(remote.getAppliedEvents()) << " в " << formatNumber(remote.getFrameCount())
+         << " кадрах, снимков " << remote.getResyncCount() << ", копия "
+         << (converged ? "совпадает с базой" : "РАСХОДИТСЯ с базой") << endl;
+    
+    // Медленный подписчик и четыре писателя в сегментированной базе:
+    // писатели не ждут, подписчик восстанавливается после переполнения
+    const size_t WRITERS = 4;
+    ChangeFeed smallFeed(1024);
+    ShardedDatabase<CuckooIndex> sharded(WRITERS);
+    sharded.attachChangeFeed(&smallFeed);
+    stop = false;
+    size_t slowEvents = 0, slowOverruns = 0, torn = 0;
+    thread slow([&]() {
+        uint64_t next = 0;
+        vector<ChangeEvent> events;
+        while (!stop) {
+            events.clear();
+            if (!smallFeed.read(next, events, 64)) {
+                ++slowOverruns;
+                next = smallFeed.headSequence();
+            }
+            for (const ChangeEvent& event : events) {
+                torn += event.op != BatchOp::INSERT || event.data != dataFor(event.uid);
+            }
+            slowEvents += events.size();
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    });
+    auto start = chrono::steady_clock::now();
+    vector<thread> writers;
+    for (size_t w = 0; w < WRITERS; ++w) {
+        writers.emplace_back([&, w]() {
+            for (size_t i = w; i < totalRecords; i += WRITERS * 100) {
+                vector<BatchOp> ops;
+                for (size_t j = i; j < min(i + WRITERS * 100, totalRecords); j += WRITERS) {
+                    ops.push_back({BatchOp::INSERT, uids[j], dataFor(uids[j])});
+                }
+                sharded.applyBatch(move(ops));
+            }
+        });
+    }
+    for (thread& writer : writers) {
+        writer.join();
+    }
+    double shardedRate = totalRecords / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stop = true;
+    slow.join();
+    cout << "Медленный подписчик, " << WRITERS << " писателя, кольцо " << smallFeed.capacity() << ": "
+         << formatNumber(static_cast<size_t>(shardedRate)) << " вставок/с, прочитано " << formatNumber(slowEvents)
+         << " событий, переполнений " << slowOverruns << ", повреждённых событий " << torn << endl;
+    if (!converged || torn != 0) {
+        throw runtime_error("Поток изменений доставлен с ошибками");
+    }
+}
+
+// Фильтры отрицательного поиска: доля ложных срабатываний и скорость
+// фильтра частного и фильтра Блума при одинаковом числе бит на ключ,
+// поведение после удаления, рост и слияние частей фильтра частного
+void runFilterBenchmark(size_t totalKeys) {
+    cout << "\n=== ФИЛЬТРЫ ОТРИЦАТЕЛЬНОГО ПОИСКА ===" << endl;
+    
+    mt19937_64 gen(random_device{}());
+    const uint64_t KEY_MASK = (uint64_t(1) << 56) - 1;
+    vector<uint64_t> keys(totalKeys), absent(totalKeys);
+    for (uint64_t& key : keys) {
+        key = gen() & KEY_MASK;
+    }
+    for (uint64_t& key : absent) {
+        key = gen() & KEY_MASK;
+    }
+    auto rate = [&](chrono::steady_clock::time_point start, size_t operations) {
+        return operations / chrono::duration<double>(chrono::steady_clock::now() - start).count() / 1e6;
+    };
+    
+    cout << "Ключей: " << formatNumber(totalKeys) << endl;
+    cout << "Отпечаток | остаток | бит/ключ | ЛС частного | ЛС Блума | вставка, млн/с (частное / Блум) | поиск, млн/с" << endl;
+    for (int fingerprintBits = 24; fingerprintBits <= 36; fingerprintBits += 2) {
+        QuotientFilter quotient(totalKeys, fingerprintBits);
+        auto start = chrono::steady_clock::now();
+        for (uint64_t key : keys) {
+            quotient.insert(key);
+        }
+        double quotientInsert = rate(start, totalKeys);
+        double bitsPerKey = quotient.memoryUsage() * 8.0 / totalKeys;
+        
+        BloomFilter bloom(totalKeys, bitsPerKey);
+        start = chrono::steady_clock::now();
+        for (uint64_t key : keys) {
+            bloom.insert(key);
+        }
+        double bloomInsert = rate(start, totalKeys);
+        
+        size_t quotientPositives = 0, bloomPositives = 0, missed = 0;
+        start = chrono::steady_clock::now();
+        for (uint64_t key : absent) {
+            quotientPositives += quotient.mayContain(key);
+        }
+        double quotientLookup = rate(start, totalKeys);
+        start = chrono::steady_clock::now();
+        for (uint64_t key : absent) {
+            bloomPositives += bloom.mayContain(key);
+        }
+        double bloomLookup = rate(start, totalKeys);
+        for (size_t i = 0; i < totalKeys; i += 7) {
+            missed += !quotient.mayContain(keys[i]) + !bloom.mayContain(keys[i]);
+        }
+        if (missed != 0) {
+            throw runtime_error("Фильтр пропустил добавленный ключ");
+        }
+        
+        cout << setw(9) << fingerprintBits << " | " << setw(7) << quotient.getRemainderBits() << " | "
+             << fixed << setprecision(1) << setw(8) << bitsPerKey << " | "
+             << setprecision(4) << setw(10) << 100.0 * quotientPositives / totalKeys << "% | "
+             << setw(7) << 100.0 * bloomPositives / totalKeys << "% | "
+             << setprecision(1) << setw(15) << quotientInsert << " / " << bloomInsert << " | "
+             << quotientLookup << " / " << bloomLookup << endl;
+    }
+    
+    // Удаление половины ключей: фильтр частного забывает их, фильтр Блума нет
+    const int BITS = 30;
+    QuotientFilter quotient = QuotientFilter::fromKeys(keys, BITS);
+    BloomFilter bloom(totalKeys, quotient.memoryUsage() * 8.0 / totalKeys);
+    for (uint64_t key : keys) {
+        bloom.insert(key);
+    }
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < totalKeys; i += 2) {
+        quotient.erase(keys[i]);
+    }
+    double eraseRate = rate(start, (totalKeys + 1) / 2);
+    size_t staleQuotient = 0, staleBloom = 0, kept = 0;
+    for (size_t i = 0; i < totalKeys; ++i) {
+        if (i % 2 == 0) {
+            staleQuotient += quotient.mayContain(keys[i]);
+            staleBloom += bloom.mayContain(keys[i]);
+        } else {
+            kept += quotient.mayContain(keys[i]);
+        }
+    }
+    cout << "После удаления половины ключей (отпечаток " << BITS << " бит): удалённые UID проходят через фильтр частного в "
+         << setprecision(3) << 100.0 * staleQuotient / ((totalKeys + 1) / 2) << "% случаев, через фильтр Блума - в "
+         << 100.0 * staleBloom / ((totalKeys + 1) / 2) << "%; удаление " << setprecision(1) << eraseRate << " млн/с" << endl;
+    if (kept != totalKeys / 2) {
+        throw runtime_error("Фильтр частного потерял оставшийся ключ");
+    }
+    
+    // Рост с минимального размера
+    QuotientFilter growing(1000, BITS);
+    start = chrono::steady_clock::now();
+    for (uint64_t key : keys) {
+        growing.insert(key);
+    }
+    double growingInsert = rate(start, totalKeys);
+    size_t growingPositives = 0;
+    for (uint64_t key : absent) {
+        growingPositives += growing.mayContain(key);
+    }
+    cout << "Рост с 1 000 ключей: " << growing.resizes() << " удвоений, вставка " << growingInsert
+         << " млн/с, остаток " << growing.getRemainderBits() << " бит, ЛС " << setprecision(4)
+         << 100.0 * growingPositives / totalKeys << "%" << endl;
+    
+    // Массовое построение частями в потоках и слияние
+    const size_t PARTS = 4;
+    start = chrono::steady_clock::now();
+    vector<QuotientFilter> parts(PARTS, QuotientFilter(1, BITS));
+    vector<thread> builders;
+    for (size_t part = 0; part < PARTS; ++part) {
+        builders.emplace_back([&, part]() {
+            vector<uint64_t> chunk(keys.begin() + totalKeys * part / PARTS, keys.begin() + totalKeys * (part + 1) / PARTS);
+            parts[part] = QuotientFilter::fromKeys(chunk, BITS);
+        });
+    }
+    for (thread& builder : builders) {
+        builder.join();
+    }
+    QuotientFilter merged = QuotientFilter::merge(QuotientFilter::merge(parts[0], parts[1]),
+                                                  QuotientFilter::merge(parts[2], parts[3]));
+    double mergeRate = rate(start, totalKeys);
+    size_t mergedMissed = 0;
+    for (uint64_t key : keys) {
+        mergedMissed += !merged.mayContain(key);
+    }
+    cout << "Построение " << PARTS << " частями со слиянием: " << setprecision(1) << mergeRate
+         << " млн ключей/с, заполнение " << setprecision(2) << merged.loadFactor()
+         << ", пропущено ключей: " << mergedMissed << endl;
+    if (mergedMissed != 0) {
+        throw runtime_error("Слияние фильтров потеряло ключи");
+    }
+}
+
+// Данные внутри слотов индекса против базы: задержка попадания с чтением
+// данных, память и доля вынесенных значений. Девять из десяти значений
+// короче 16 байт, остальные - 40 байт
+template <size_t InlineBytes>
+double measureInlineHits(const InlinePayloadStore<InlineBytes>& store, const vector<string>& probes, size_t& bytes) {
+    TRACE_SPAN("пакет поиска");
+    bytes = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string& uid : probes) {
+        string_view data;
+        if (store.findRecord(uid, data)) {
+            bytes += data.size() + static_cast<unsigned char>(data[0]);
+        }
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / probes.size();
+}
+
+void runInlinePayloadBenchmark(size_t totalRecords) {
+    cout << "\n=== ДАННЫЕ В СЛОТАХ ИНДЕКСА ===" << endl;
+    
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords), payloads(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        uids[i] = uidGen.generateUid();
+        payloads[i] = i % 10 == 9 ? "long-payload-" + to_string(i) + string(40, '.') : "v" + to_string(i);
+        payloads[i].resize(i % 10 == 9 ? 40 : min<size_t>(payloads[i].size(), 15));
+    }
+    
+    Database<CuckooIndex> db;
+    InlinePayloadStore<24> small;
+    InlinePayloadStore<56> wide;
+    db.reserve(totalRecords);
+    small.reserve(totalRecords);
+    wide.reserve(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        Record record(uids[i], payloads[i]);
+        small.addRecord(record);
+        wide.addRecord(record);
+        db.addRecord(move(record));
+    }
+    
+    mt19937 gen(random_device{}());
+    const size_t PROBES = 2000000;
+    vector<string> probes(PROBES);
+    for (string& uid : probes) {
+        uid = uids[gen() % totalRecords];
+    }
+    
+    size_t dbBytes = 0;
+    auto start = chrono::steady_clock::now();
+    {
+        TRACE_SPAN("пакет поиска");
+        for (const string& uid : probes) {
+            Record* record = db.findRecord(uid);
+            if (record) {
+                dbBytes += record->getData().size() + static_cast<unsigned char>(record->getData()[0]);
+            }
         }
     }
+    double dbNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / PROBES;
+    size_t smallBytes, wideBytes;
+    double smallNanos = measureInlineHits(small, probes, smallBytes);
+    double wideNanos = measureInlineHits(wide, probes, wideBytes);
+    if (smallBytes != dbBytes || wideBytes != dbBytes) {
+        throw runtime_error("Данные в слотах разошлись с базой");
+    }
     
-    const string& getUid() const { return uid; }
-    const string& getData() const { return data; }
-};
-
-// Класс для управления базой данных с эффективным поиском
-class Database {
-private:
-    unordered_map<string, Record*> index;
-    vector<Record> records;
+    // Изменения: замена коротких значений длинными и удаление
+    size_t erased = 0;
+    for (size_t i = 0; i < totalRecords; i += 5) {
+        small.insert(packUid(uids[i]), payloads[(i + 9) % totalRecords]);
+        if (i + 1 < totalRecords) {
+            erased += small.erase(packUid(uids[i + 1]));
+        }
+    }
+    bool consistent = small.size() == totalRecords - erased;
+    for (size_t i = 0; i < totalRecords && consistent; i += 97) {
+        string_view data;
+        bool found = small.findRecord(uids[i], data);
+        if (i % 5 == 1) {
+            consistent = !found;
+        } else {
+            consistent = found && data == (i % 5 == 0 ? payloads[(i + 9) % totalRecords] : payloads[i]);
+        }
+    }
     
-public:
-    ~Database() {
-        // Очищаем указатели в index, так как записи хранятся в vector
-        index.clear();
+    cout << "Записей: " << formatNumber(totalRecords) << ", поисков: " << formatNumber(PROBES) << endl;
+    cout << "  База (индекс -> запись -> строка): " << fixed << setprecision(1) << dbNanos << " нс на попадание" << endl;
+    cout << "  Слот " << InlinePayloadStore<24>::slotBytes() << " байт: " << smallNanos << " нс ("
+         << setprecision(2) << dbNanos / smallNanos << "x), " << setprecision(1)
+         << static_cast<double>(small.memoryUsage()) / small.size() << " байт на запись, вынесено "
+         << formatNumber(small.spilled()) << endl;
+    cout << "  Слот " << InlinePayloadStore<56>::slotBytes() << " байт: " << wideNanos << " нс ("
+         << setprecision(2) << dbNanos / wideNanos << "x), " << setprecision(1)
+         << static_cast<double>(wide.memoryUsage()) / wide.size() << " байт на запись, вынесено "
+         << formatNumber(wide.spilled()) << endl;
+    cout << "  После замены и удаления " << formatNumber(erased) << " записей хранилище "
+         << (consistent ? "согласовано" : "НЕ СОГЛАСОВАНО") << endl;
+    if (!consistent) {
+        throw runtime_error("Хранилище данных в слотах потеряло запись");
     }
+}
+
+// Интернирование данных: память базы и хранилища с общими блобами при
+// разной доле повторяющихся значений, скорость параллельной массовой
+// загрузки и согласованность после изменений и удалений
+void runInternBenchmark(size_t totalRecords) {
+    cout << "\n=== ИНТЕРНИРОВАНИЕ ДАННЫХ ===" << endl;
     
-    // Добавление записи в базу данных
-    void addRecord(Record&& record) {
-        records.push_back(move(record));
-        // Сохраняем указатель на только что добавленную запись
-        index[records.back().getUid()] = &records.back();
+    const vector<string> STATUSES = {
+        "status=active;tier=standard", "status=active;tier=premium", "status=suspended;reason=billing",
+        "status=pending;step=email-confirmation", "status=closed;reason=user-request",
+        "status=active;tier=trial", "status=blocked;reason=fraud-check", "status=pending;step=kyc-review"
+    };
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    for (string& uid : uids) {
+        uid = uidGen.generateUid();
     }
+    auto heapBytes = [](const string& s) {
+        return s.capacity() > string().capacity() ? s.capacity() + 1 : 0;
+    };
     
-    // Поиск записи по UID
-    Record* findRecord(const string& uid) {
-        auto it = index.find(uid);
-        if (it != index.end()) {
-            return it->second;
+    cout << "Записей: " << formatNumber(totalRecords) << ", потоков загрузки: " << threads << endl;
+    cout << "Различных значений | база, байт/запись | интернирование, байт/запись | экономия | загрузка, млн/с" << endl;
+    // Доля различных значений; 0 - только восемь строк состояния
+    for (double distinct : {1.0, 0.5, 0.1, 0.01, 0.0}) {
+        size_t values = distinct > 0 ? max<size_t>(static_cast<size_t>(totalRecords * distinct), 1) : STATUSES.size();
+        vector<Record> records;
+        records.reserve(totalRecords);
+        mt19937 gen(42);
+        for (size_t i = 0; i < totalRecords; ++i) {
+            size_t value = gen() % values;
+            records.emplace_back(uids[i], distinct > 0 ? "payload-" + to_string(value) + ";source=import" : STATUSES[value]);
+        }
+        
+        Database<CuckooIndex> db;
+        db.reserve(totalRecords);
+        for (const Record& record : records) {
+            db.addRecord(Record(record));
         }
-        return nullptr; 
+        size_t dbMemory = db.getIndex().memoryUsage() + totalRecords * (sizeof(Record) + sizeof(uint64_t));
+        db.forEachRecord([&](const Record& record) {
+            dbMemory += heapBytes(record.getUid()) + heapBytes(record.getData());
+        });
+        
+        InternedRecordStore<CuckooIndex> store;
+        auto start = chrono::steady_clock::now();
+        store.bulkLoad(records, threads);
+        double loadRate = totalRecords / chrono::duration<double>(chrono::steady_clock::now() - start).count() / 1e6;
+        size_t internedMemory = store.memoryUsage();
+        
+        // Изменения и удаления в обоих хранилищах, затем сверка
+        for (size_t i = 0; i < totalRecords; i += 7) {
+            const string& data = records[(i * 31) % totalRecords].getData();
+            db.updateRecord(uids[i], data);
+            store.updateRecord(uids[i], data);
+            if (i + 3 < totalRecords) {
+                db.eraseRecord(uids[i + 3]);
+                store.eraseRecord(uids[i + 3]);
+            }
+        }
+        bool consistent = store.size() == db.size();
+        for (size_t i = 0; i < totalRecords && consistent; ++i) {
+            const Record* record = db.findRecord(uids[i]);
+            const string* data = store.findData(uids[i]);
+            consistent = record ? data && *data == record->getData() : !data;
+        }
+        size_t referenced = 0;
+        for (size_t i = 0; i < totalRecords; ++i) {
+            referenced += store.findData(uids[i]) != nullptr;
+        }
+        consistent = consistent && referenced == store.size();
+        
+        cout << setw(18) << formatNumber(values) << " | " << fixed << setprecision(1)
+             << setw(17) << static_cast<double>(dbMemory) / totalRecords << " | "
+             << setw(27) << static_cast<double>(internedMemory) / totalRecords << " | "
+             << setw(7) << 100.0 * (1.0 - static_cast<double>(internedMemory) / dbMemory) << "% | "
+             << loadRate << (consistent ? "" : " (НЕ СОГЛАСОВАНО)") << endl;
+        if (!consistent) {
+            throw runtime_error("Интернированное хранилище разошлось с базой");
+        }
+    }
+}
+
+// UID разной длины: поиск в базе с таблицами по длинам против общей
+// хэш-таблицы со строковыми ключами. Смесь: 55% UID по 7 байт,
+// по 15% - 6, 8 и 16 байт; половина поисков - промахи
+void runMixedWidthBenchmark(size_t totalRecords) {
+    cout << "\n=== UID РАЗНОЙ ДЛИНЫ ===" << endl;
+    
+    const size_t WIDTHS[] = {7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 6, 6, 6, 8, 8, 8, 16, 16, 16};
+    UidGenerator uidGen;
+    mt19937 gen(random_device{}());
+    vector<string> uids(totalRecords);
+    size_t perWidth[17] = {};
+    for (string& uid : uids) {
+        uid = uidGen.generateUid(WIDTHS[gen() % size(WIDTHS)]);
+        ++perWidth[uid.length()];
     }
     
+    MixedWidthDatabase<CuckooIndex> mixed;
+    unordered_map<string, uint32_t> generic;
+    vector<Record> genericRecords;
+    mixed.reserve(perWidth[6], perWidth[7], perWidth[8], perWidth[16]);
+    generic.reserve(totalRecords);
+    genericRecords.reserve(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        string data = "Данные для записи " + to_string(i);
+        mixed.addRecord(Record(uids[i], data));
+        generic[uids[i]] = static_cast<uint32_t>(genericRecords.size());
+        genericRecords.emplace_back(uids[i], data);
+    }
     
-    size_t size() const {
-        return records.size();
+    const size_t PROBES = 2000000;
+    vector<string> narrowUids;
+    copy_if(uids.begin(), uids.end(), back_inserter(narrowUids), [](const string& uid) {
+        return uid.length() == 7;
+    });
+    vector<string> probes(PROBES), narrowProbes(PROBES);
+    for (size_t i = 0; i < PROBES; ++i) {
+        probes[i] = i % 2 ? uids[gen() % totalRecords] : uidGen.generateUid(WIDTHS[gen() % size(WIDTHS)]);
+        narrowProbes[i] = i % 2 ? narrowUids[gen() % narrowUids.size()] : uidGen.generateUid();
     }
     
+    auto measure = [&](const vector<string>& keys, auto lookup, size_t& found) {
+        TRACE_SPAN("пакет поиска");
+        found = 0;
+        auto start = chrono::steady_clock::now();
+        for (const string& uid : keys) {
+            found += lookup(uid) != nullptr;
+        }
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / keys.size();
+    };
+    auto genericLookup = [&](const string& uid) -> Record* {
+        auto it = generic.find(uid);
+        return it != generic.end() ? &genericRecords[it->second] : nullptr;
+    };
+    auto mixedLookup = [&](const string& uid) { return mixed.findRecord(uid); };
+    auto narrowLookup = [&](const string& uid) { return mixed.getNarrow().findRecord(uid); };
     
-    void clear() {
-        records.clear();
-        index.clear();
+    size_t mixedFound, genericFound, viaMixedFound, narrowFound;
+    double mixedNanos = measure(probes, mixedLookup, mixedFound);
+    double genericNanos = measure(probes, genericLookup, genericFound);
+    double viaMixedNanos = measure(narrowProbes, mixedLookup, viaMixedFound);
+    double narrowNanos = measure(narrowProbes, narrowLookup, narrowFound);
+    if (mixedFound != genericFound || viaMixedFound != narrowFound) {
+        throw runtime_error("Таблицы по длинам UID разошлись со строковыми ключами");
     }
-};
+    
+    // Удаление и замена в таблицах каждой длины
+    size_t erased = 0;
+    for (size_t i = 0; i < totalRecords; i += 3) {
+        erased += mixed.eraseRecord(uids[i]);
+        generic.erase(uids[i]);
+        if (i + 1 < totalRecords) {
+            mixed.updateRecord(uids[i + 1], "изменено");
+            genericRecords[generic[uids[i + 1]]].setData("изменено");
+        }
+    }
+    bool consistent = mixed.size() == generic.size();
+    for (size_t i = 0; i < totalRecords && consistent; ++i) {
+        Record* expected = genericLookup(uids[i]);
+        Record* actual = mixed.findRecord(uids[i]);
+        consistent = expected ? actual && actual->getData() == expected->getData() : !actual;
+    }
+    
+    cout << "Записей: " << formatNumber(totalRecords) << ", поисков: " << formatNumber(PROBES)
+         << " (половина - промахи)" << endl;
+    cout << "  Смесь длин, таблицы по длинам: " << fixed << setprecision(1) << mixedNanos << " нс" << endl;
+    cout << "  Смесь длин, строковые ключи:   " << genericNanos << " нс ("
+         << setprecision(2) << genericNanos / mixedNanos << "x медленнее)" << endl;
+    cout << "  Только 7 байт, через MixedWidthDatabase: " << setprecision(1) << viaMixedNanos
+         << " нс, напрямую в Database: " << narrowNanos << " нс" << endl;
+    cout << "  После удаления " << formatNumber(erased) << " записей и изменений база "
+         << (consistent ? "согласована" : "НЕ СОГЛАСОВАНА") << endl;
+    if (!consistent) {
+        throw runtime_error("База с UID разной длины потеряла запись");
+    }
+}
 
-// Генератор случайных UID (7 байт)
-class UidGenerator {
-private:
-    random_device rd;
-    mt19937 gen;
-    uniform_int_distribution<int> dist;
+// Ответы сервера с крупными данными: копирование в буфер ответа против
+// отправки прямо из записей (sendmsg с iovec) и MSG_ZEROCOPY. Параллельно
+// второй клиент заменяет записи, поэтому проверяется и закрепление
+// отправляемых данных эпохой: каждое полученное значение должно целиком
+// состоять из одного байта
+void runZeroCopyBenchmark(size_t payloadBytes, size_t totalRecords) {
+    cout << "\n=== ОТВЕТЫ БЕЗ КОПИРОВАНИЯ ДАННЫХ ===" << endl;
     
-public:
-    UidGenerator() : gen(rd()), dist(0, 255) {}
+    const size_t BATCH = max<size_t>((4 << 20) / payloadBytes, 1);
+    const double SECONDS = 2.0;
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    for (string& uid : uids) {
+        uid = uidGen.generateUid();
+    }
+    cout << "Записей: " << formatNumber(totalRecords) << " по " << formatNumber(payloadBytes)
+         << " байт, ключей в запросе: " << formatNumber(BATCH) << endl;
     
-    string generateUid() {
-        string uid;
-        uid.reserve(7);
+    const pair<ResponsePath, const char*> PATHS[] = {
+        {RESPONSE_COPY, "копирование в буфер"},
+        {RESPONSE_SCATTER, "sendmsg с iovec"},
+        {RESPONSE_ZEROCOPY, "MSG_ZEROCOPY"}
+    };
+    for (const auto& mode : PATHS) {
+        string address = "tcp:" + to_string(30000 + getpid() % 20000 + mode.first * 7);
+        ClusterServer server(address, mode.first);
+        thread runner([&]() {
+            server.run();
+        });
         
-        for (int i = 0; i < 7; ++i) {
-            uid += static_cast<char>(dist(gen));
+        ClusterClient client({address});
+        for (size_t i = 0; i < totalRecords; i += 16) {
+            vector<Record> batch;
+            for (size_t j = i; j < min(i + 16, totalRecords); ++j) {
+                batch.emplace_back(uids[j], string(payloadBytes, 'a'));
+            }
+            client.put(batch);
         }
         
-        return uid;
+        atomic<bool> done{false};
+        size_t replaced = 0;
+        thread writer([&]() {
+            ClusterClient writerClient({address});
+            mt19937 gen(7);
+            while (!done) {
+                size_t i = gen() % totalRecords;
+                writerClient.put({Record(uids[i], string(payloadBytes, static_cast<char>('a' + gen() % 26)))});
+                ++replaced;
+            }
+        });
+        
+        mt19937 gen(random_device{}());
+        size_t torn = 0;
+        vector<uint8_t> found;
+        vector<string> data;
+        uint64_t cpuStart = server.responseCpuNanos(), bytesStart = server.responseBytes();
+        auto start = chrono::steady_clock::now();
+        while (chrono::duration<double>(chrono::steady_clock::now() - start).count() < SECONDS) {
+            vector<string> keys(BATCH);
+            for (string& key : keys) {
+                key = uids[gen() % totalRecords];
+            }
+            client.multiGet(keys, found, data);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                torn += !found[i] || data[i].size() != payloadBytes
+                     || data[i].find_first_not_of(data[i][0]) != string::npos;
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        done = true;
+        writer.join();
+        double bytes = static_cast<double>(server.responseBytes() - bytesStart);
+        double cpuSeconds = (server.responseCpuNanos() - cpuStart) / 1e9;
+        
+        cout << "  " << mode.second << ": " << fixed << setprecision(2)
+             << bytes / seconds / (1 << 30) << " ГиБ/с, ЦП сервера " << setprecision(1)
+             << cpuSeconds * 1000 / (bytes / (1 << 30)) << " мс на ГиБ, замен записей: "
+             << formatNumber(replaced) << ", повреждённых значений: " << torn;
+        if (mode.first == RESPONSE_ZEROCOPY) {
+            cout << ", отправок MSG_ZEROCOPY: " << formatNumber(server.zeroCopySendCount())
+                 << " (ядро скопировало " << formatNumber(server.copiedZeroCopySends()) << ")";
+        }
+        cout << endl;
+        
+        client.shutdownServers();
+        runner.join();
+        if (torn != 0) {
+            throw runtime_error("Получены повреждённые данные");
+        }
     }
-};
-
+}
 
-string formatNumber(size_t number) {
-    string str = to_string(number);
-    int n = str.length() - 3;
-    while (n > 0) {
-        str.insert(n, " ");
-        n -= 3;
+// Объединение одиночных запросов: потоки приложения ищут по одному UID
+// через общий CoalescingClient против отдельного запроса на каждый ключ
+// (у каждого потока своё соединение). Сервер - отдельный процесс
+void runCoalescingBenchmark(size_t threads, size_t totalRecords) {
+    cout << "\n=== ОБЪЕДИНЕНИЕ ЗАПРОСОВ КЛИЕНТА ===" << endl;
+    
+    const double SECONDS = 1.5;
+    string address = "unix:/tmp/testuid-coalesce-" + to_string(getpid()) + ".sock";
+    vector<pid_t> servers = spawnClusterServers({address});
+    
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    {
+        ClusterClient loader({address});
+        vector<Record> batch;
+        for (size_t i = 0; i < totalRecords; ++i) {
+            uids[i] = uidGen.generateUid();
+            batch.emplace_back(uids[i], "Данные для записи " + to_string(i));
+            if (batch.size() == 1000 || i + 1 == totalRecords) {
+                loader.put(batch);
+                batch.clear();
+            }
+        }
     }
-    return str;
+    cout << "Записей: " << formatNumber(totalRecords) << ", потоков приложения: " << threads << endl;
+    
+    // lookup(поток, uid, data) выполняет один поиск
+    auto run = [&](const string& title, function<bool(size_t, const string&, string&)> lookup) {
+        vector<vector<double>> nanos(threads);
+        vector<size_t> wrong(threads, 0);
+        vector<thread> workers;
+        atomic<bool> done{false};
+        auto start = chrono::steady_clock::now();
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                mt19937 gen(static_cast<unsigned>(t + 1));
+                string data;
+                while (!done) {
+                    size_t i = gen() % totalRecords;
+                    auto begin = chrono::steady_clock::now();
+                    bool found = lookup(t, uids[i], data);
+                    nanos[t].push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count());
+                    wrong[t] += !found || data != "Данные для записи " + to_string(i);
+                }
+            });
+        }
+        this_thread::sleep_for(chrono::duration<double>(SECONDS));
+        done = true;
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        vector<double> all;
+        size_t errors = 0;
+        for (size_t t = 0; t < threads; ++t) {
+            all.insert(all.end(), nanos[t].begin(), nanos[t].end());
+            errors += wrong[t];
+        }
+        cout << title << ": " << formatNumber(static_cast<size_t>(all.size() / seconds)) << " запросов/с" << endl;
+        printLatencies("задержка", all);
+        if (errors != 0) {
+            throw runtime_error("Неверный ответ на " + to_string(errors) + " запросов");
+        }
+    };
+    
+    {
+        vector<unique_ptr<ClusterClient>> clients;
+        for (size_t t = 0; t < threads; ++t) {
+            clients.emplace_back(new ClusterClient({address}));
+        }
+        run("Запрос на каждый ключ", [&](size_t t, const string& uid, string& data) {
+            vector<uint8_t> found;
+            vector<string> values;
+            clients[t]->multiGet({uid}, found, values);
+            data = move(values[0]);
+            return found[0] != 0;
+        });
+    }
+    for (int window : {10, 100}) {
+        CoalescingClient client({address}, 256, chrono::microseconds(window));
+        run("Объединение, окно " + to_string(window) + " мкс", [&](size_t, const string& uid, string& data) {
+            return client.findRecord(uid, data);
+        });
+        cout << "  в среднем " << fixed << setprecision(1)
+             << static_cast<double>(client.keyCount()) / max<size_t>(client.batchCount(), 1) << " ключей в пакете" << endl;
+    }
+    
+    ClusterClient({address}).shutdownServers();
+    for (pid_t pid : servers) {
+        waitpid(pid, nullptr, 0);
+    }
+    unlink(address.substr(5).c_str());
 }
 
+// Адаптивный выбор индекса: фазы нагрузки сменяют друг друга, потоки
+// чтения работают всё время, база сама перестраивается между фазами
+void runAdaptiveBenchmark(size_t totalRecords) {
+    cout << "\n=== АДАПТИВНЫЙ ВЫБОР ИНДЕКСА ===" << endl;
+    
+    const size_t READERS = max(thread::hardware_concurrency(), 2u) - 1;
+    const double PHASE_SECONDS = 2.0;
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords), absent(totalRecords);
+    for (size_t i = 0; i < totalRecords; ++i) {
+        uids[i] = uidGen.generateUid();
+        absent[i] = uidGen.generateUid();
+    }
+    
+    AdaptiveDatabase db(chrono::milliseconds(200));
+    for (size_t i = 0; i < totalRecords; ++i) {
+        db.addRecord(Record(uids[i], to_string(i)));
+    }
+    atomic<double> hitShare{0.9};
+    atomic<bool> writing{true};
+    atomic<bool> done{false};
+    atomic<uint64_t> lookups{0};
+    atomic<uint64_t> wrong{0};
+    
+    vector<thread> readers;
+    for (size_t t = 0; t < READERS; ++t) {
+        readers.emplace_back([&, t]() {
+            mt19937 gen(static_cast<unsigned>(t + 1));
+            uniform_real_distribution<double> coin(0.0, 1.0);
+            string data;
+            uint64_t local = 0;
+            while (!done) {
+                size_t i = gen() % totalRecords;
+                if (coin(gen) < hitShare) {
+                    // Данные записи - её номер (после изменений - с пометкой)
+                    wrong += !db.findRecord(uids[i], data) || data.compare(0, data.find(';'), to_string(i)) != 0;
+                } else {
+                    wrong += db.findRecord(absent[i], data);
+                }
+                if (++local % 1024 == 0) {
+                    lookups += 1024;
+                }
+            }
+        });
+    }
+    thread writer([&]() {
+        mt19937 gen(99);
+        size_t updates = 0;
+        while (!done) {
+            if (writing) {
+                size_t i = gen() % totalRecords;
+                db.updateRecord(uids[i], to_string(i) + ";" + to_string(++updates));
+            }
+            this_thread::sleep_for(chrono::microseconds(20));
+        }
+    });
+    
+    auto phase = [&](const string& title, bool write, double hits) {
+        writing = write;
+        hitShare = hits;
+        uint64_t before = lookups.load();
+        auto start = chrono::steady_clock::now();
+        this_thread::sleep_for(chrono::duration<double>(PHASE_SECONDS));
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Фаза \"" << title << "\": " << formatNumber(static_cast<size_t>((lookups - before) / seconds))
+             << " поисков/с, индекс " << db.layout() << endl;
+    };
+    cout << "Записей: " << formatNumber(totalRecords) << ", потоков чтения: " << READERS << endl;
+    phase("изменения и чтение", true, 0.9);
+    phase("только чтение", false, 0.9);
+    phase("чтение с промахами", false, 0.2);
+    phase("возобновление изменений", true, 0.9);
+    done = true;
+    writer.join();
+    for (thread& reader : readers) {
+        reader.join();
+    }
+    
+    cout << "Решений: " << db.getDecisions().size() << ", неверных ответов: " << wrong << endl;
+    if (wrong != 0) {
+        throw runtime_error("Адаптивная база вернула неверные данные");
+    }
+}
 
-void runPerformanceTest() {
-    const int TOTAL_RECORDS = 100000;
-    const int SEARCH_TESTS = 10000;
+// Прогрев отображённого снимка: файл вытесняется из страничного кэша,
+// затем открывается в каждом режиме, и поиски идут пакетами сразу после
+// открытия. Устоявшимся считается момент, когда медиана p99 нескольких
+// последних пакетов не выше удвоенного p99 на прогретом файле
+void runWarmupBenchmark(size_t totalRecords, size_t payloadBytes) {
+    cout << "\n=== ПРОГРЕВ ОТОБРАЖЁННОГО СНИМКА ===" << endl;
     
-    Database db;
+    const size_t BATCH = 2000;
+    const double SECONDS = 3.0;
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
     UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    string path = "/tmp/testuid-warmup-" + to_string(getpid()) + ".snap";
+    {
+        Database<CuckooIndex> db;
+        db.reserve(totalRecords);
+        for (size_t i = 0; i < totalRecords; ++i) {
+            uids[i] = uidGen.generateUid();
+            string data = to_string(i);
+            data.resize(payloadBytes, '.');
+            db.addRecord(Record(uids[i], data));
+        }
+        ofstream out(path, ios::binary | ios::trunc);
+        writeSnapshot(db, 0, out);
+    }
+    auto evict = [&]() {
+        int fd = open(path.c_str(), O_RDONLY);
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    };
     
-    cout << "=== ТЕСТИРОВАНИЕ БАЗЫ ДАННЫХ ===" << endl;
-    cout << "Генерация " << formatNumber(TOTAL_RECORDS) << " записей..." << endl;
+    mt19937 gen(random_device{}());
+    auto batchP99 = [&](const MappedSnapshot& snapshot) {
+        vector<double> nanos(BATCH);
+        string_view data;
+        for (double& n : nanos) {
+            const string& uid = uids[gen() % totalRecords];
+            auto start = chrono::steady_clock::now();
+            if (!snapshot.find(uid, data)) {
+                throw runtime_error("Запись не найдена в снимке");
+            }
+            n = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        }
+        nth_element(nanos.begin(), nanos.begin() + BATCH * 99 / 100, nanos.end());
+        return nanos[BATCH * 99 / 100];
+    };
     
-    // Генерация уникальных UID
-    unordered_map<string, bool> usedUids;
-    auto startTime = chrono::high_resolution_clock::now();
+    double steady;
+    {
+        MappedSnapshot warm(path);
+        warm.warmup(MappedSnapshot::WARMUP_TOUCH, threads, false);
+        vector<double> p99s;
+        for (int i = 0; i < 20; ++i) {
+            p99s.push_back(batchP99(warm));
+        }
+        sort(p99s.begin(), p99s.end());
+        steady = p99s[p99s.size() / 2];
+    }
+    cout << "Снимок: " << formatNumber(totalRecords) << " записей по " << payloadBytes << " байт, потоков прогрева: "
+         << threads << ", p99 на прогретом файле: " << fixed << setprecision(0) << steady << " нс" << endl;
     
-    for (int i = 0; i < TOTAL_RECORDS; ++i) {
-        string uid;
-       
-        do {
-            uid = uidGen.generateUid();
-        } while (usedUids.count(uid) > 0);
-        
-        usedUids[uid] = true;
-        string data = "Данные для записи " + to_string(i + 1);
-        db.addRecord(Record(uid, data));
+    struct Mode {
+        const char* title;
+        int mapFlags;
+        int warmup;  // -1 - без прогрева, иначе MappedSnapshot::Warmup
+        bool background;
+    };
+    const Mode MODES[] = {
+        {"без прогрева", 0, -1, false},
+        {"MAP_POPULATE", MAP_POPULATE, -1, false},
+        {"madvise(WILLNEED)", 0, MappedSnapshot::WARMUP_WILLNEED, false},
+        {"чтение потоками", 0, MappedSnapshot::WARMUP_TOUCH, false},
+        {"чтение потоками в фоне", 0, MappedSnapshot::WARMUP_TOUCH, true}
+    };
+    for (const Mode& mode : MODES) {
+        evict();
+        auto start = chrono::steady_clock::now();
+        MappedSnapshot snapshot(path, mode.mapFlags);
+        if (mode.warmup >= 0) {
+            snapshot.warmup(static_cast<MappedSnapshot::Warmup>(mode.warmup), threads, mode.background);
+        }
+        double readyMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        double residentAtReady = snapshot.residentShare();
         
+        // Момент (от открытия), когда медиана p99 последних пакетов впервые
+        // уложилась в порог: одиночные всплески от планировщика не в счёт
+        const size_t WINDOW = 5;
+        deque<double> window;
+        double firstP99 = 0.0, steadyMillis = 0.0, elapsed = 0.0, progressAtSteady = 0.0;
+        while (steadyMillis == 0.0 && elapsed < SECONDS * 1000) {
+            double p99 = batchP99(snapshot);
+            elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (window.empty() && firstP99 == 0.0) {
+                firstP99 = p99;
+            }
+            window.push_back(p99);
+            if (window.size() > WINDOW) {
+                window.pop_front();
+            }
+            vector<double> sorted(window.begin(), window.end());
+            sort(sorted.begin(), sorted.end());
+            if (window.size() == WINDOW && sorted[WINDOW / 2] <= 2 * steady) {
+                steadyMillis = elapsed;
+                progressAtSteady = snapshot.warmupProgress();
+            }
+        }
+        bool reached = steadyMillis > 0.0;
         
-        if ((i + 1) % 10000 == 0) {
-            cout << "Сгенерировано записей: " << formatNumber(i + 1) << endl;
+        cout << "  " << mode.title << ": готов через " << setprecision(1) << readyMillis << " мс (в памяти "
+             << setprecision(0) << residentAtReady * 100 << "%), p99 первого пакета " << firstP99
+             << " нс, устоявшаяся задержка ";
+        if (reached) {
+            cout << "через " << setprecision(1) << steadyMillis << " мс";
+        } else {
+            cout << "не достигнута за " << SECONDS << " с";
         }
+        if (mode.background) {
+            cout << " (прогрев выполнен на " << setprecision(0) << progressAtSteady * 100 << "%)";
+        }
+        cout << endl;
     }
     
-    auto endTime = chrono::high_resolution_clock::now();
-    auto generationTime = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
-    cout << "Генерация завершена за " << generationTime.count() << " мс" << endl;
+    // Повреждение одного байта в середине данных: прогрев останавливается
+    // с ошибкой и в переднем плане, и в фоне, процесс не падает
+    {
+        fstream file(path, ios::binary | ios::in | ios::out);
+        file.seekg(0, ios::end);
+        file.seekp(static_cast<streamoff>(file.tellg()) / 2);
+        file.put('\xFF');
+    }
+    size_t failures = 0;
+    for (bool background : {false, true}) {
+        MappedSnapshot snapshot(path);
+        try {
+            snapshot.warmup(MappedSnapshot::WARMUP_TOUCH, threads, background);
+            snapshot.waitWarmup();
+        } catch (const runtime_error& error) {
+            failures += snapshot.warmupState() == MappedSnapshot::WARMUP_FAILED;
+            cout << "  Повреждённый снимок, прогрев " << (background ? "в фоне" : "в переднем плане")
+                 << ": остановлен на " << setprecision(0) << snapshot.warmupProgress() * 100 << "% (" << error.what()
+                 << ")" << endl;
+        }
+    }
+    unlink(path.c_str());
+    if (failures != 2) {
+        throw runtime_error("Прогрев не обнаружил повреждённый блок снимка");
+    }
+}
+
+// Перешардирование на ходу: задержка поиска до, во время деления самого
+// большого сегмента и слияния двух соседних самых маленьких, и после.
+// Читатели ищут только существующие записи и считают промахи, писатель
+// всё время вставляет новые записи и обновляет старые; в конце каждая
+// записанная запись сверяется с базой
+void runReshardBenchmark(size_t totalRecords) {
+    cout << "\n=== ПЕРЕШАРДИРОВАНИЕ НА ХОДУ ===" << endl;
     
+    const size_t READERS = 2;
+    const size_t PRELOAD_BATCH = 1000;
+    const auto QUIET = chrono::milliseconds(500);
+    ShardedDatabase<CuckooIndex> db(4);
+    UidGenerator uidGen;
+    vector<string> uids(totalRecords);
+    for (size_t begin = 0; begin < totalRecords; begin += PRELOAD_BATCH) {
+        vector<BatchOp> ops;
+        for (size_t i = begin; i < min(begin + PRELOAD_BATCH, totalRecords); ++i) {
+            uids[i] = uidGen.generateUid();
+            ops.push_back({BatchOp::INSERT, uids[i], "v0"});
+        }
+        db.applyBatch(move(ops));
+    }
     
-    cout << "\nПодготовка тестовых ключей для поиска..." << endl;
-    vector<string> searchKeys;
-    vector<string> existingUids;
+    enum Phase { BEFORE, SPLIT, MERGE, AFTER, PHASES };
+    const char* TITLES[PHASES] = {"До миграции", "Во время деления", "Во время слияния", "После миграции"};
+    atomic<int> phase{BEFORE};
+    atomic<bool> stop{false};
+    atomic<size_t> missing{0};
+    vector<array<vector<double>, PHASES>> samples(READERS);
+    vector<thread> readers;
+    for (size_t r = 0; r < READERS; ++r) {
+        readers.emplace_back([&, r]() {
+            mt19937 gen(static_cast<unsigned>(r + 1));
+            string data;
+            while (!stop.load(memory_order_relaxed)) {
+                const string& uid = uids[gen() % totalRecords];
+                int current = phase.load(memory_order_relaxed);
+                auto start = chrono::steady_clock::now();
+                bool found = db.findRecord(uid, data);
+                samples[r][current].push_back(
+                    chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+                missing += !found;
+            }
+        });
+    }
     
+    // Писатель: новые записи и обновления старых; значение записи - номер
+    // её последнего изменения, чтобы потом сверить базу
+    unordered_map<string, string> written;
+    thread writer([&]() {
+        mt19937 gen(random_device{}());
+        UidGenerator writerGen;
+        for (size_t n = 1; !stop.load(memory_order_relaxed); ++n) {
+            vector<BatchOp> ops;
+            string fresh = writerGen.generateUid();
+            const string& old = uids[gen() % totalRecords];
+            string value = "v" + to_string(n);
+            ops.push_back({BatchOp::INSERT, fresh, value});
+            ops.push_back({BatchOp::UPDATE, old, value});
+            db.applyBatch(move(ops));
+            written[fresh] = written[old] = value;
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+    });
     
-    for (const auto& pair : usedUids) {
-        existingUids.push_back(pair.first);
-    }
+    auto printSizes = [&]() {
+        cout << "  Записей по сегментам:";
+        for (size_t size : db.shardSizes()) {
+            cout << " " << formatNumber(size);
+        }
+        cout << endl;
+    };
+    auto printStats = [](const string& title, const ShardedDatabase<CuckooIndex>::ReshardStats& stats) {
+        cout << title << ": скопировано " << formatNumber(stats.copied) << " записей за " << fixed << setprecision(1)
+             << stats.copyMillis << " мс, переключение " << setprecision(3) << stats.cutoverMillis << " мс" << endl;
+    };
     
-    // 70% существующих ключей, 30% случайных (несуществующих)
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_int_distribution<int> existDist(0, existingUids.size() - 1);
+    cout << "Записей: " << formatNumber(totalRecords) << ", сегментов: " << db.shardCount() << ", читателей: " << READERS
+         << endl;
+    this_thread::sleep_for(QUIET);
     
-    for (int i = 0; i < SEARCH_TESTS; ++i) {
-        if (i < SEARCH_TESTS * 0.7) {
-           
-            searchKeys.push_back(existingUids[existDist(gen)]);
-        } else {
-            
-            searchKeys.push_back(uidGen.generateUid());
+    phase = SPLIT;
+    vector<size_t> sizes = db.shardSizes();
+    size_t largest = max_element(sizes.begin(), sizes.end()) - sizes.begin();
+    printStats("Деление сегмента " + to_string(largest), db.splitShard(largest));
+    printSizes();
+    
+    phase = MERGE;
+    sizes = db.shardSizes();
+    size_t coldest = 0;
+    for (size_t i = 1; i + 1 < sizes.size(); ++i) {
+        if (sizes[i] + sizes[i + 1] < sizes[coldest] + sizes[coldest + 1]) {
+            coldest = i;
         }
     }
+    printStats("Слияние сегментов " + to_string(coldest) + " и " + to_string(coldest + 1), db.mergeShards(coldest));
+    printSizes();
     
+    phase = AFTER;
+    this_thread::sleep_for(QUIET);
+    stop = true;
+    writer.join();
+    for (thread& reader : readers) {
+        reader.join();
+    }
     
-    shuffle(searchKeys.begin(), searchKeys.end(), gen);
-    
+    for (int p = 0; p < PHASES; ++p) {
+        vector<double> merged;
+        for (size_t r = 0; r < READERS; ++r) {
+            merged.insert(merged.end(), samples[r][p].begin(), samples[r][p].end());
+        }
+        printLatencies(TITLES[p], merged);
+    }
     
-    cout << "Тестирование поиска " << formatNumber(SEARCH_TESTS) << " ключей..." << endl;
+    size_t lost = 0;
+    string data;
+    for (const auto& entry : written) {
+        lost += !db.findRecord(entry.first, data) || data != entry.second;
+    }
+    size_t inserted = db.size() - totalRecords;
+    cout << "Промахов читателей: " << missing << ", записей писателя: " << formatNumber(written.size())
+         << " (новых " << formatNumber(inserted) << "), расхождений: " << lost << endl;
+    if (missing != 0 || lost != 0) {
+        throw runtime_error("Записи потеряны при перешардировании");
+    }
+}
+
+// Замеры поиска в индексе: попадания и промахи по заранее
+// подготовленным случайным ключам
+template <typename Index>
+void addIndexMicroBenchmarks(MicroBenchmarkSuite& suite, const vector<uint64_t>& keys,
+                             const vector<uint64_t>& hits, const vector<uint64_t>& misses) {
+    auto index = make_shared<Index>();
+    bool built = false;
+    auto build = [&]() {
+        if (!built) {
+            index->reserve(keys.size());
+            for (size_t i = 0; i < keys.size(); ++i) {
+                index->insert(keys[i], static_cast<uint32_t>(i));
+            }
+            index->build();
+            built = true;
+        }
+    };
+    string prefix = string("индекс ") + Index::name() + ": ";
+    for (const auto& probe : {make_pair("попадание", &hits), make_pair("промах", &misses)}) {
+        const vector<uint64_t>& probes = *probe.second;
+        suite.add(prefix + probe.first, [&, index](size_t operations) {
+            build();
+            uint32_t slot = 0;
+            for (size_t i = 0; i < operations; ++i) {
+                bool found = index->find(probes[i], slot);
+                doNotOptimize(found);
+            }
+            doNotOptimize(slot);
+        }, probes.size());
+    }
+}
+
+// Набор микробенчмарков горячих путей: генерация и упаковка UID,
+// хэширование, поиск в индексах, вставка, чтение данных, сериализация
+// и разбор журнала и снимка. filter отбирает замеры по подстроке имени
+void runMicroBenchmarks(const string& filter) {
+    cout << "\n=== МИКРОБЕНЧМАРКИ КОМПОНЕНТОВ ===" << endl;
     
-    int foundCount = 0;
-    int notFoundCount = 0;
+    const size_t KEYS = 1000000;
+    const size_t PROBES = 1 << 20;
+    mt19937_64 gen(12345);
+    const uint64_t KEY_MASK = (uint64_t(1) << 56) - 1;
+    vector<uint64_t> keys(KEYS), hits(PROBES), misses(PROBES);
+    for (uint64_t& key : keys) {
+        key = gen() & KEY_MASK;
+    }
+    for (size_t i = 0; i < PROBES; ++i) {
+        hits[i] = keys[gen() % KEYS];
+        misses[i] = gen() & KEY_MASK;
+    }
+    vector<string> uids(PROBES);
+    for (size_t i = 0; i < PROBES; ++i) {
+        uids[i] = unpackUid(hits[i]);
+    }
     
-    startTime = chrono::high_resolution_clock::now();
+    MicroBenchmarkSuite suite(filter);
     
-    for (int i = 0; i < SEARCH_TESTS; ++i) {
-        Record* record = db.findRecord(searchKeys[i]);
-        if (record) {
-            foundCount++;
-        } else {
-            notFoundCount++;
+    UidGenerator uidGen;
+    suite.add("генерация UID", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            string uid = uidGen.generateUid();
+            doNotOptimize(uid);
         }
-        
-        
-        if (SEARCH_TESTS > 1000 && (i + 1) % 1000 == 0) {
-            cout << "Выполнено поисков: " << formatNumber(i + 1) << endl;
+    });
+    suite.add("упаковка UID (packUid)", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            uint64_t key = packUid(uids[i]);
+            doNotOptimize(key);
         }
-    }
+    }, PROBES);
+    suite.add("распаковка UID (unpackUid)", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            string uid = unpackUid(hits[i]);
+            doNotOptimize(uid);
+        }
+    }, PROBES);
+    suite.add("хэш mixHash", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            uint64_t h = mixHash(hits[i]);
+            doNotOptimize(h);
+        }
+    }, PROBES);
+    suite.add("хэш std::hash<string> по UID", [&](size_t operations) {
+        hash<string> hasher;
+        for (size_t i = 0; i < operations; ++i) {
+            size_t h = hasher(uids[i]);
+            doNotOptimize(h);
+        }
+    }, PROBES);
+    string block(4096, 'x');
+    suite.add("CRC32C, 4 КиБ", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            uint32_t crc = Crc32c::compute(block.data(), block.size());
+            doNotOptimize(crc);
+        }
+    });
     
-    endTime = chrono::high_resolution_clock::now();
-    auto searchTime = chrono::duration_cast<chrono::microseconds>(endTime - startTime);
+    addIndexMicroBenchmarks<HashMapIndex>(suite, keys, hits, misses);
+    addIndexMicroBenchmarks<CuckooIndex>(suite, keys, hits, misses);
+    addIndexMicroBenchmarks<RmiIndex>(suite, keys, hits, misses);
+    addIndexMicroBenchmarks<RadixIndex<2>>(suite, keys, hits, misses);
     
-    // Статистика
-    cout << "\n=== РЕЗУЛЬТАТЫ ТЕСТИРОВАНИЯ ===" << endl;
-    cout << "Общая статистика:" << endl;
-    cout << "  Всего записей в базе: " << formatNumber(db.size()) << endl;
-    cout << "  Выполнено тестов поиска: " << formatNumber(SEARCH_TESTS) << endl;
-    cout << "  Найдено записей: " << formatNumber(foundCount) << endl;
-    cout << "  Не найдено записей: " << formatNumber(notFoundCount) << endl;
+    // Вставка: база пересоздаётся перед каждым повтором вне замера
+    unique_ptr<Database<CuckooIndex>> insertDb;
+    suite.add("вставка addRecord (CuckooIndex)", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            insertDb->addRecord(Record(uids[i], "Данные"));
+        }
+    }, PROBES, [&](size_t operations) {
+        insertDb.reset(new Database<CuckooIndex>());
+        insertDb->reserve(operations);
+    });
     
-    cout << "\nПроизводительность поиска:" << endl;
-    cout << "  Общее время поиска: " << searchTime.count() << " мкс" << endl;
-    cout << "  Среднее время на поиск: " 
-              << fixed << setprecision(3) 
-              << (static_cast<double>(searchTime.count()) / SEARCH_TESTS) 
-              << " мкс" << endl;
-    cout << "  Поисков в секунду: " 
-              << formatNumber(static_cast<long long>((SEARCH_TESTS * 1000000.0) / searchTime.count()))
-              << endl;
+    Database<CuckooIndex> db;
+    db.reserve(KEYS);
+    for (size_t i = 0; i < KEYS; ++i) {
+        db.addRecord(Record(unpackUid(keys[i]), "Данные для записи " + to_string(i)));
+    }
+    suite.add("чтение данных findRecord + getData", [&](size_t operations) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < operations; ++i) {
+            Record* record = db.findRecord(uids[i]);
+            bytes += record->getData().size();
+        }
+        doNotOptimize(bytes);
+    }, PROBES);
     
-    cout << "\nЭффективность:" << endl;
-    double speed = (SEARCH_TESTS * 1000000.0) / searchTime.count();
-    cout << "  Скорость обработки: " << fixed << setprecision(0) << speed << " операций/сек" << endl;
+    InlinePayloadStore<24> inlineStore;
+    inlineStore.reserve(KEYS);
+    for (size_t i = 0; i < KEYS; ++i) {
+        inlineStore.insert(keys[i], "v" + to_string(i));
+    }
+    suite.add("чтение данных InlinePayloadStore<24>", [&](size_t operations) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < operations; ++i) {
+            string_view data;
+            inlineStore.findRecord(uids[i], data);
+            bytes += data.size();
+        }
+        doNotOptimize(bytes);
+    }, PROBES);
     
-    // Сравнение с линейным поиском
-    double linearSearchTime = (TOTAL_RECORDS / 2.0) * SEARCH_TESTS * 0.0001; // примерная оценка
-    double speedup = linearSearchTime / (searchTime.count() / 1000000.0);
-    cout << "  Ускорение относительно линейного поиска: ~" << formatNumber(static_cast<size_t>(speedup)) << " раз" << endl;
+    WriteAheadLog wal;
+    suite.add("журнал: добавление записи", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            uint64_t lsn = wal.append(WAL_INSERT, uids[i & (PROBES - 1)], "Данные для записи");
+            doNotOptimize(lsn);
+        }
+    });
+    WriteAheadLog parsedWal;
+    for (size_t i = 0; i < 100000; ++i) {
+        parsedWal.append(WAL_INSERT, uids[i], "Данные для записи");
+    }
+    string walBytes = parsedWal.read(0, parsedWal.sizeBytes());
+    suite.add("журнал: разбор (на запись)", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            vector<WalEntry> entries;
+            WriteAheadLog::decode(walBytes.data(), walBytes.size(), entries);
+            doNotOptimize(entries.data());
+        }
+    }, SIZE_MAX, nullptr, 100000);
+    
+    Database<CuckooIndex> small;
+    for (size_t i = 0; i < 100000; ++i) {
+        small.addRecord(Record(uids[i], "Данные для записи " + to_string(i)));
+    }
+    ostringstream snapshotOut;
+    writeSnapshot(small, 1, snapshotOut);
+    string snapshotBytes = snapshotOut.str();
+    suite.add("снимок: сериализация (на запись)", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            ostringstream out;
+            writeSnapshot(small, 1, out);
+            doNotOptimize(out.tellp());
+        }
+    }, SIZE_MAX, nullptr, small.size());
+    suite.add("снимок: разбор и загрузка (на запись)", [&](size_t operations) {
+        for (size_t i = 0; i < operations; ++i) {
+            Database<CuckooIndex> loaded;
+            loadSnapshot(loaded, snapshotBytes.data(), snapshotBytes.size());
+            doNotOptimize(loaded.size());
+        }
+    }, SIZE_MAX, nullptr, small.size());
+    
+    if (suite.executedCount() == 0) {
+        cout << "Нет замеров, содержащих \"" << filter << "\"" << endl;
+    }
 }
 
 
 void demonstration() {
     cout << "\n=== ДЕМОНСТРАЦИОННЫЙ ПРИМЕР ===" << endl;
     
-    Database db;
+    Database<> db;
     
   
     db.addRecord(Record("ABCDEFG", "Тестовая запись 1"));
@@ -245,24 +9762,151 @@ void demonstration() {
     cout << "Всего записей в демо-базе: " << db.size() << endl;
 }
 
-int main() {
+// Режимы запуска:
+//   testuid                         демонстрация и сравнение индексов
+//   testuid cuckoo [ключей] [загрузка]  заполнение кукушечного индекса
+//   testuid radix [ключей...]       таблица прямой адресации против хэш-таблицы
+//   testuid replication [секунд]    лидер и реплика в двух процессах
+//   testuid leader <адрес> [секунд] [файл журнала]
+//   testuid follower <адрес>        отдельные процессы лидера и реплики
+//   testuid cluster [записей] [шардов...]  масштабирование кластера
+//   testuid cluster-server <адрес>  отдельный сервер кластера
+//   testuid bgsave [записей]        фоновое сохранение снимка под нагрузкой
+//   testuid checksum [записей]      скорость CRC32C и проверки снимков
+//   testuid payload [записей]       обратный поиск UID по данным
+//   testuid substring [записей]     поиск по фрагменту данных
+//   testuid semijoin <файл UID> <снимок> [вывод]  отбор присутствующих UID
+//   testuid semijoin-bench [записей] [ключей]     то же на синтетических данных
+//   testuid uidset [случайных] [плотных] [случайных без баз]  операции над сжатыми множествами UID
+//   testuid mvcc [записей]         чтение по снимкам при изменениях
+//   testuid batch [операций]       атомарные пакеты записи под нагрузкой чтения
+//   testuid cdc [записей]          поток изменений и подписчики
+//   testuid filter [ключей]        фильтр частного против фильтра Блума
+//   testuid inline [записей]       данные в слотах индекса против базы
+//   testuid intern [записей]       экономия памяти на повторяющихся данных
+//   testuid widths [записей]       UID разной длины против строковых ключей
+//   testuid zerocopy [байт] [записей]  ответы сервера без копирования данных
+//   testuid coalesce [потоков] [записей]  объединение одиночных запросов клиента
+//   testuid adaptive [записей]     перестройка индекса по наблюдаемой нагрузке
+//   testuid warmup [записей] [байт]  прогрев отображённого снимка
+//   testuid reshard [записей]      деление и слияние сегментов под нагрузкой
+//   testuid bench [фильтр]         микробенчмарки компонентов (по подстроке имени)
+// Если задана переменная окружения TESTUID_TRACE, фазы работы записываются
+// в указанный файл в формате Chrome trace events (открывается в Perfetto).
+int main(int argc, char* argv[]) {
     setlocale(LC_ALL, "ru_RU.UTF-8");
     
     cout << "=== СИСТЕМА ПОИСКА В БАЗЕ ДАННЫХ ПО UID ===" << endl;
     cout << "Реализация с использованием хэш-таблицы для эффективного поиска" << endl;
     
+    string mode = argc > 1 ? argv[1] : "";
+    const char* tracePath = getenv("TESTUID_TRACE");
+    if (tracePath) {
+        Tracer::enable();
+    }
+    
     try {
-        
-        demonstration();
-        
-        
-        runPerformanceTest();
-        
+        if (mode == "cuckoo") {
+            size_t keys = argc > 2 ? stoull(argv[2]) : 10000000;
+            double loadFactor = argc > 3 ? stod(argv[3]) : 0.95;
+            runCuckooLoadTest(keys, loadFactor);
+        } else if (mode == "radix") {
+            if (argc > 2) {
+                for (int i = 2; i < argc; ++i) {
+                    runRadixBenchmark(static_cast<size_t>(stod(argv[i])));
+                }
+            } else {
+                runRadixBenchmark(1000000);
+                runRadixBenchmark(10000000);
+            }
+        } else if (mode == "replication") {
+            if (!runReplicationDemo(argc > 2 ? stoi(argv[2]) : 3)) {
+                return 1;
+            }
+        } else if (mode == "leader" && argc > 2) {
+            runReplicationLeader(argv[2], argc > 3 ? stoi(argv[3]) : 10, argc > 4 ? argv[4] : "");
+        } else if (mode == "follower" && argc > 2) {
+            return runReplicationFollower(argv[2]);
+        } else if (mode == "cluster") {
+            vector<int> shardCounts;
+            for (int i = 3; i < argc; ++i) {
+                shardCounts.push_back(stoi(argv[i]));
+            }
+            if (shardCounts.empty()) {
+                shardCounts = {1, 2, 4};
+            }
+            runClusterBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000, shardCounts);
+        } else if (mode == "bgsave") {
+            runBackgroundSaveTest(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "checksum") {
+            runChecksumBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 2000000);
+        } else if (mode == "payload") {
+            runPayloadIndexTest(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "substring") {
+            runSubstringSearchTest(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "semijoin" && argc > 3) {
+            runSemiJoinCommand(argv[2], argv[3], argc > 4 ? argv[4] : "");
+            return 0;
+        } else if (mode == "semijoin-bench") {
+            runSemiJoinBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 2000000,
+                                 argc > 3 ? static_cast<size_t>(stod(argv[3])) : 5000000);
+        } else if (mode == "uidset") {
+            runUidSetBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 2000000,
+                               argc > 3 ? static_cast<size_t>(stod(argv[3])) : 100000000,
+                               argc > 4 ? static_cast<size_t>(stod(argv[4])) : 100000000);
+        } else if (mode == "mvcc") {
+            runMvccTest(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "batch") {
+            runBatchWriteTest(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 200000);
+        } else if (mode == "cdc") {
+            runChangeFeedTest(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "filter") {
+            runFilterBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 900000);
+        } else if (mode == "inline") {
+            runInlinePayloadBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "intern") {
+            runInternBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "widths") {
+            runMixedWidthBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "zerocopy") {
+            runZeroCopyBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 65536,
+                                 argc > 3 ? static_cast<size_t>(stod(argv[3])) : 512);
+        } else if (mode == "coalesce") {
+            runCoalescingBenchmark(argc > 2 ? stoul(argv[2]) : 32,
+                                   argc > 3 ? static_cast<size_t>(stod(argv[3])) : 100000);
+        } else if (mode == "adaptive") {
+            runAdaptiveBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 200000);
+        } else if (mode == "warmup") {
+            runWarmupBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 2000000,
+                               argc > 3 ? static_cast<size_t>(stod(argv[3])) : 100);
+        } else if (mode == "reshard") {
+            runReshardBenchmark(argc > 2 ? static_cast<size_t>(stod(argv[2])) : 1000000);
+        } else if (mode == "bench") {
+            runMicroBenchmarks(argc > 2 ? argv[2] : "");
+        } else if (mode == "cluster-server" && argc > 2) {
+            ClusterServer server(argv[2]);
+            server.run();
+        } else {
+            demonstration();
+            
+            runPerformanceTest<HashMapIndex>();
+            runPerformanceTest<CuckooIndex>();
+            runPerformanceTest<RmiIndex>();
+            runPerformanceTest<RadixIndex<2>>();
+            
+            runCuckooLoadTest(1000000, 0.95);
+            runRadixBenchmark(1000000);
+        }
     } catch (const exception& e) {
         cerr << "Ошибка выполнения: " << e.what() << endl;
         return 1;
     }
     
+    if (tracePath) {
+        size_t spans = Tracer::writeJson(tracePath);
+        cout << "\nТрасса: " << formatNumber(spans) << " интервалов записано в " << tracePath << endl;
+    }
+    
     cout << "\n=== ТЕСТИРОВАНИЕ ЗАВЕРШЕНО ===" << endl;
     return 0;
 }
\ No newline at end of file